@@ -11,6 +11,53 @@
 
 #include <attentive/at.h>
 
+#include "FreeRTOS.h"
+#include "task.h"
+
+/** Reader task stack depth, in words. */
+#define AT_FREERTOS_STACK_DEPTH (configMINIMAL_STACK_SIZE * 2)
+
+/** Deferred work task stack depth, in words. Work items issue commands,
+ * so this needs room for at_command()'s line buffer. */
+#ifndef AT_FREERTOS_WORKER_DEPTH
+#define AT_FREERTOS_WORKER_DEPTH (configMINIMAL_STACK_SIZE * 2)
+#endif
+
+/** Task notification index used to wake a task waiting for a response.
+ * Defaults to the last one, leaving index 0 to the application when the
+ * kernel provides more than one. */
+#ifndef AT_FREERTOS_NOTIFY_INDEX
+#define AT_FREERTOS_NOTIFY_INDEX (configTASK_NOTIFICATION_ARRAY_ENTRIES - 1)
+#endif
+#if AT_FREERTOS_NOTIFY_INDEX >= configTASK_NOTIFICATION_ARRAY_ENTRIES
+#error "AT_FREERTOS_NOTIFY_INDEX exceeds configTASK_NOTIFICATION_ARRAY_ENTRIES"
+#endif
+
+/* at_lock() nests. */
+#if !configUSE_RECURSIVE_MUTEXES
+#error "attentive needs configUSE_RECURSIVE_MUTEXES"
+#endif
+
+#ifdef AT_FREERTOS_RX_STREAM
+/* Receive stream buffer size; must cover the worst ISR latency of the
+ * reader task at the port's baudrate. */
+#ifndef AT_FREERTOS_RX_BUFFER
+#define AT_FREERTOS_RX_BUFFER 512
+#endif
+/* Largest run of bytes handed to the parser at once. */
+#define AT_FREERTOS_RX_CHUNK 64
+#define AT_FREERTOS_RX_SIZE (AT_FREERTOS_RX_BUFFER + 1 + AT_FREERTOS_RX_CHUNK + \
+                             sizeof(StaticStreamBuffer_t) + 4*sizeof(void *))
+#else
+#define AT_FREERTOS_RX_SIZE 0
+#endif
+
+/** Storage size for at_init_freertos(). */
+#define AT_FREERTOS_SIZE (21*sizeof(void *) + sizeof(StaticEventGroup_t) + \
+                          3*sizeof(StaticSemaphore_t) + sizeof(StaticQueue_t) + \
+                          AT_WORK_QUEUE*sizeof(struct at_work) + AT_FREERTOS_RX_SIZE + \
+                          AT_STATS_SIZE)
+
 /**
  * Create an AT channel instance.
  *
@@ -20,6 +67,48 @@
  */
 struct at *at_alloc_freertos(void);
 
+#if configSUPPORT_STATIC_ALLOCATION
+/**
+ * Initialize an AT channel instance in caller-provided memory, without
+ * touching the heap. at_free() stops the reader task but leaves the memory
+ * alone.
+ *
+ * @param storage AT_FREERTOS_SIZE bytes, pointer-aligned.
+ * @param parser AT_PARSER_SIZE bytes for the parser, pointer-aligned.
+ * @param buf Response buffer.
+ * @param bufsize Response buffer size in bytes.
+ * @param stack Reader task stack, AT_FREERTOS_STACK_DEPTH words.
+ * @param task Reader task control block.
+ * @param worker_stack Deferred work task stack, AT_FREERTOS_WORKER_DEPTH words.
+ * @param worker_task Deferred work task control block.
+ * @returns Instance pointer.
+ */
+struct at *at_init_freertos(void *storage, void *parser, char *buf, size_t bufsize,
+                            StackType_t *stack, StaticTask_t *task,
+                            StackType_t *worker_stack, StaticTask_t *worker_task);
+#endif
+
+#ifdef AT_FREERTOS_RX_STREAM
+
+/**
+ * Feed received bytes into the channel. Call from the UART RX interrupt, or
+ * from the DMA half/full transfer interrupts with the fresh part of the
+ * circular buffer. The reader task wakes up and parses them in chunks.
+ *
+ * Only available when built with AT_FREERTOS_RX_STREAM; the UART driver's
+ * own RX path is not used then.
+ *
+ * @param at AT channel instance.
+ * @param data Received bytes.
+ * @param len Number of bytes.
+ * @param pxHigherPriorityTaskWoken Set if a context switch is due; pass to
+ *        portYIELD_FROM_ISR().
+ * @returns Number of bytes accepted; less than len on overflow.
+ */
+size_t at_freertos_rx_from_isr(struct at *at, const void *data, size_t len,
+                               BaseType_t *pxHigherPriorityTaskWoken);
+#endif
+
 #endif
 
 /* vim: set ts=4 sw=4 et: */
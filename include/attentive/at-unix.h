@@ -9,6 +9,7 @@
 #ifndef ATTENTIVE_AT_UNIX_H
 #define ATTENTIVE_AT_UNIX_H
 
+#include <pthread.h>
 #include <termios.h>
 
 #include <attentive/at.h>
@@ -22,6 +23,25 @@
  */
 struct at *at_alloc_unix(const char *devpath, speed_t baudrate);
 
+/** Storage size for at_init_unix(). */
+#define AT_UNIX_SIZE (32*sizeof(void *) + 64 + 3*sizeof(pthread_mutex_t) + 2*sizeof(pthread_cond_t) + \
+                      sizeof(pthread_t) + AT_WORK_QUEUE*sizeof(struct at_work) + AT_STATS_SIZE)
+
+/**
+ * Initialize an AT channel instance in caller-provided memory. at_free()
+ * stops the reader thread but leaves the memory alone.
+ *
+ * @param storage AT_UNIX_SIZE bytes, pointer-aligned.
+ * @param parser AT_PARSER_SIZE bytes for the parser, pointer-aligned.
+ * @param buf Response buffer.
+ * @param bufsize Response buffer size in bytes.
+ * @param devpath Device path.
+ * @param baudrate If non-zero, sets device baudrate (see termios.h).
+ * @returns Instance pointer.
+ */
+struct at *at_init_unix(void *storage, void *parser, char *buf, size_t bufsize,
+                        const char *devpath, speed_t baudrate);
+
 #endif
 
 /* vim: set ts=4 sw=4 et: */
@@ -10,6 +10,60 @@
 #define ATTENTIVE_AT_H
 
 #include <attentive/parser.h>
+#ifdef AT_TRACE
+#include <attentive/trace.h>
+#endif
+
+#ifdef AT_STATS
+/** Commands tracked separately; the ones that don't fit share the last slot. */
+#define AT_STATS_COMMANDS 12
+/** Latency buckets; upper bounds 10, 30, 100, 300, 1000, 3000, 10000 ms, and the rest. */
+#define AT_STATS_BUCKETS 8
+#define AT_STATS_NAME_LENGTH 12
+
+/** Round-trip latency histogram of one command. */
+struct at_latency {
+    char name[AT_STATS_NAME_LENGTH];    /**< "+CREG", "D", "raw" or "*" for the rest; empty if unused. */
+    unsigned count;
+    unsigned buckets[AT_STATS_BUCKETS];
+    unsigned max_ms;
+    uint64_t total_ms;
+};
+
+/** Channel statistics; see at_stats_snapshot(). */
+struct at_stats {
+    unsigned commands;          /**< Commands sent with at_command() and at_command_raw(). */
+    unsigned writes;            /**< Writes not awaiting a response: at_send(), at_send_raw(), at_online_write(). */
+    unsigned timeouts;          /**< Commands without a response in time. */
+    unsigned truncations;       /**< Commands too long to send, plus truncated responses. */
+    unsigned urcs;              /**< URCs handled. */
+    uint64_t bytes_out;         /**< Bytes written, online data included. */
+    uint64_t bytes_in;          /**< Bytes read, online data included. */
+    uint64_t parser_us;         /**< Time spent parsing, URC handlers included. */
+    struct at_latency latency[AT_STATS_COMMANDS];
+};
+
+/** Room taken by statistics in struct at; part of the *_SIZE constants. */
+#define AT_STATS_SIZE (sizeof(struct at_stats) + 4*sizeof(void *))
+#else
+#define AT_STATS_SIZE 0
+#endif
+
+/** Deferred work queue length; see at_defer(). */
+#ifndef AT_WORK_QUEUE
+#define AT_WORK_QUEUE 8
+#endif
+
+struct at;
+
+/** Deferred work function; see at_defer(). */
+typedef void (*at_work_t)(struct at *at, void *arg);
+
+/** Queued work item. */
+struct at_work {
+    at_work_t work;
+    void *arg;
+};
 
 /*
  * Publicly accessible fields. Platform-specific implementations may add private
@@ -20,6 +74,16 @@ struct at {
     const struct at_callbacks *cbs;
     void *arg;
     at_line_scanner_t command_scanner;
+#ifdef AT_STATS
+    /* Statistics; see at_stats_snapshot(). */
+    struct at_stats stats;
+    struct at_latency *stats_pending;   /**< Command in flight; NULL if none. */
+    uint64_t stats_sent;                /**< at_monotonic_ms() when it was sent. */
+    unsigned stats_truncations;         /**< Parser truncations at the last reset. */
+#endif
+#ifdef AT_TRACE
+    struct at_trace *trace;             /**< See at_trace_attach(). */
+#endif
 };
 
 struct at_callbacks {
@@ -85,6 +149,17 @@ void at_set_command_scanner(struct at *at, at_line_scanner_t scanner);
  */
 void at_set_character_handler(struct at *at, at_character_handler_t handler);
 
+/**
+ * Deliver raw data blocks of the next command's response to a sink instead
+ * of the response buffer. See at_parser_set_rawdata_sink(). The sink is
+ * called from the reader context.
+ *
+ * @param at AT channel instance.
+ * @param sink Raw data sink.
+ * @param arg Private argument passed to the sink.
+ */
+void at_set_rawdata_sink(struct at *at, at_rawdata_sink_t sink, void *arg);
+
 /**
  * Expect "> " dataprompt as a response for the next command.
  *
@@ -100,15 +175,98 @@ void at_expect_dataprompt(struct at *at);
  */
 void at_set_timeout(struct at *at, int timeout);
 
+/** Condition predicate for at_wait_until(). */
+typedef bool (*at_condition_t)(void *arg);
+
+/**
+ * Block until a condition becomes true. The condition is re-evaluated every
+ * time a URC is handled, so URC handlers can update the state it checks. It
+ * is called with the channel locked and must not issue commands. A caller's
+ * at_lock() is let go of while waiting and taken back before returning.
+ *
+ * @param at AT channel instance.
+ * @param cond Condition predicate, or NULL to wait for any URC.
+ * @param arg Private argument passed to the predicate.
+ * @param timeout Timeout in milliseconds.
+ * @returns True if the condition was met, false on timeout.
+ */
+bool at_wait_until(struct at *at, at_condition_t cond, void *arg, int timeout);
+
+/**
+ * Hold off URC handling, e.g. to take back a callback that a URC handler
+ * may be about to call. Keep it short and don't issue commands while
+ * holding it. URC handlers and at_wait_until() conditions already run with
+ * it held, so they must not take it.
+ *
+ * @param at AT channel instance.
+ */
+void at_urc_lock(struct at *at);
+
+/**
+ * Resume URC handling after at_urc_lock().
+ *
+ * @param at AT channel instance.
+ */
+void at_urc_unlock(struct at *at);
+
+/**
+ * Keep other threads or tasks off the channel for a sequence of commands:
+ * per-command settings, the command, a dataprompt payload and the use of
+ * the response. Commands of others wait until at_unlock(). Nests, and
+ * every command takes it on its own. Cellular ops and work items run with
+ * it held. Don't take it in URC handlers.
+ *
+ * Blocking waits, at_wait_until() and at_online_read(), let go of it until
+ * they return, so others get their turn during long ops. A response doesn't
+ * survive such a wait.
+ *
+ * @param at AT channel instance.
+ */
+void at_lock(struct at *at);
+
+/**
+ * Release the channel after at_lock().
+ *
+ * @param at AT channel instance.
+ */
+void at_unlock(struct at *at);
+
+/**
+ * Monotonic clock for timeouts and cache expiry. Platform-specific.
+ *
+ * @returns Milliseconds since an arbitrary point in time.
+ */
+uint64_t at_monotonic_ms(void);
+
+/**
+ * Run a function later on the channel's worker. Meant for URC handlers:
+ * they run in the reader context, where a slow reaction stalls reception
+ * and a command would deadlock. Work items run one at a time, in order,
+ * with at_lock() held, so they may use per-command settings and issue
+ * full commands without disturbing an application's sequence.
+ *
+ * Pending work is dropped by at_free(), which must not be called from a
+ * work item.
+ *
+ * @param at AT channel instance.
+ * @param work Function to run.
+ * @param arg Private argument passed to the function.
+ * @returns Zero on success, -1 and sets errno (ENOSPC if the queue is full).
+ */
+int at_defer(struct at *at, at_work_t work, void *arg);
+
 /**
  * Send an AT command and receive a response. Accepts printf-compatible
  * format and arguments.
  *
+ * Fails with EBUSY while the channel is online, and while another thread
+ * or task is due to send the payload after a dataprompt.
+ *
  * @param at AT channel instance.
  * @param format printf-comaptible format.
- * @returns Pointer to response (valid until next at_command) or NULL
- *          if a timeout occurs. Response is newline-delimited and does
- *          not include the final "OK".
+ * @returns Pointer to response (valid until next at_command; hold
+ *          at_lock() to keep it) or NULL and sets errno. Response is
+ *          newline-delimited and does not include the final "OK".
  */
 __attribute__ ((format (printf, 2, 3)))
 const char *at_command(struct at *at, const char *format, ...);
@@ -120,10 +278,38 @@ const char *at_command(struct at *at, const char *format, ...);
  * @param data Raw data to send.
  * @param size Data size in bytes.
  * @returns Pointer to response (valid until next at_command) or NULL
- *          if a timeout occurs.
+ *          and sets errno, as at_command().
  */
 const char *at_command_raw(struct at *at, const void *data, size_t size);
 
+/**
+ * One command of a batch. See at_command_batch().
+ */
+struct at_batch {
+    const char *command;    /**< Command without the "AT" prefix, e.g. "+CMEE=2". */
+    char *response;         /**< Buffer for the command's response lines, or NULL. */
+    size_t size;            /**< Response buffer size. */
+    int lines;              /**< Number of response lines received. */
+};
+
+/**
+ * Send several commands concatenated on as few command lines as possible
+ * (V.250 5.4.1) and split the combined response back into per-command
+ * results. Extended commands are separated with semicolons.
+ *
+ * A response line prefixed with a command name ("+CREG: ...") goes to the
+ * next command of that name which has no response yet, or to the current
+ * one if there is none. Lines without a name prefix ("+CGSN" output) go to
+ * the next command that takes no arguments, one line each.
+ *
+ * @param at AT channel instance.
+ * @param cmds Commands to send.
+ * @param count Number of commands.
+ * @param maxlen Maximum command line length accepted by the modem.
+ * @returns Zero if all commands returned OK, -1 and sets errno otherwise.
+ */
+int at_command_batch(struct at *at, struct at_batch *cmds, size_t count, size_t maxlen);
+
 /**
  * Send an AT command. Accepts printf-compatible format and arguments.
  *
@@ -144,6 +330,88 @@ bool at_send(struct at *at, const char *format, ...);
  */
 bool at_send_raw(struct at *at, const void *data, size_t size);
 
+/**
+ * Switch to online (transparent) data mode after the next command.
+ *
+ * If the next command completes with a successful empty response (e.g. a
+ * "CONNECT" classified as AT_RESPONSE_FINAL_OK by a command scanner), the
+ * reader stops consuming bytes from the port right after the response line.
+ * The byte stream is then accessed with at_online_read() and
+ * at_online_write() until at_online_escape() is called.
+ *
+ * @param at AT channel instance.
+ */
+void at_expect_online(struct at *at);
+
+/**
+ * Check whether the channel is in online data mode.
+ *
+ * @param at AT channel instance.
+ * @returns True if online.
+ */
+bool at_is_online(struct at *at);
+
+/**
+ * Read raw bytes from the port while in online data mode.
+ *
+ * @param at AT channel instance.
+ * @param buf Destination buffer.
+ * @param len Buffer size in bytes.
+ * @param timeout Timeout in milliseconds.
+ * @returns Number of bytes read, zero on timeout, -1 and sets errno on failure.
+ */
+int at_online_read(struct at *at, void *buf, size_t len, int timeout);
+
+/**
+ * Write raw bytes to the port while in online data mode.
+ *
+ * @param at AT channel instance.
+ * @param data Data to write.
+ * @param size Data size in bytes.
+ * @returns Number of bytes written, -1 and sets errno on failure.
+ */
+int at_online_write(struct at *at, const void *data, size_t size);
+
+/**
+ * Return from online data mode to command mode. Sends the "+++" escape
+ * sequence surrounded by the guard time, discards pending input and
+ * resynchronizes the parser with a plain "AT".
+ *
+ * @param at AT channel instance.
+ * @returns Zero on success, -1 and sets errno on failure.
+ */
+int at_online_escape(struct at *at);
+
+#ifdef AT_STATS
+/**
+ * Copy out the channel statistics gathered since the last reset. Only
+ * available when built with AT_STATS. Counters aren't locked against the
+ * reader, so a snapshot may catch one of them mid-update.
+ *
+ * @param at AT channel instance.
+ * @param stats Destination.
+ */
+void at_stats_snapshot(struct at *at, struct at_stats *stats);
+
+/**
+ * Zero the channel statistics.
+ *
+ * @param at AT channel instance.
+ */
+void at_stats_reset(struct at *at);
+#endif
+
+#ifdef AT_TRACE
+/**
+ * Record the channel's traffic in a trace ring. Only available when built
+ * with AT_TRACE.
+ *
+ * @param at AT channel instance.
+ * @param trace Trace ring prepared with at_trace_init(), or NULL to stop.
+ */
+void at_trace_attach(struct at *at, struct at_trace *trace);
+#endif
+
 /**
  * Send an AT command and return -1 if it doesn't return OK.
  */
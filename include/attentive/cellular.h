@@ -16,6 +16,9 @@
 
 #include <attentive/at.h>
 
+/* Strict C99 <time.h> doesn't define it; the ops only pass pointers. */
+struct timespec;
+
 #if defined(__cplusplus) || !defined(__STRICT_ANSI__) || !defined(__ssize_t)
  /* always defined in C++ and non-strict C for consistency of debug info */
   typedef int ssize_t;   /* see <stddef.h> */
@@ -28,6 +31,14 @@
 #define CELLULAR_MEID_LENGTH 14
 #define CELLULAR_ICCID_LENGTH 19
 
+#define CELLULAR_MAX_SOCKETS 8
+
+#define CELLULAR_DNS_CACHE 4
+#define CELLULAR_DNS_HOST_LENGTH 64
+#define CELLULAR_IP_LENGTH 16
+
+#define CELLULAR_LOCATE_CACHE 4
+
 
 enum {
     CREG_NOT_REGISTERED = 0,
@@ -38,14 +49,180 @@ enum {
     CREG_REGISTERED_ROAMING = 5,
 };
 
+/** PDP context state as last seen by the driver. */
+enum cellular_pdp_state {
+    CELLULAR_PDP_UNKNOWN = 0,   /**< Not known; verify with pdp_open. */
+    CELLULAR_PDP_DOWN,          /**< Closed or deactivated by the network. */
+    CELLULAR_PDP_UP,            /**< Opened successfully and not lost since. */
+};
+
+/**
+ * Data sink for streaming transfers. Called from the AT reader context, so
+ * it must not issue commands.
+ *
+ * @returns Zero to continue, -1 to abort the transfer.
+ */
+typedef int (*cellular_sink_t)(const void *data, size_t len, void *arg);
+
+/** Streaming transfer statistics. */
+struct cellular_transfer_stats {
+    size_t bytes;               /**< Payload bytes delivered to the sink. */
+    int chunks;                 /**< Data requests issued. */
+    int stalls;                 /**< Times the modem had no data ready. */
+    int elapsed_ms;             /**< Transfer duration; bytes/elapsed_ms is the throughput. */
+};
+
+/** HTTP request methods, numbered as in AT+HTTPACTION. */
+enum cellular_http_method {
+    CELLULAR_HTTP_GET = 0,
+    CELLULAR_HTTP_POST = 1,
+    CELLULAR_HTTP_HEAD = 2,
+};
+
+/** HTTP request for the http() op. */
+struct cellular_http_request {
+    enum cellular_http_method method;
+    const char *url;
+    const char *content_type;   /**< POST only; NULL for the modem default. */
+    const void *body;           /**< POST only. */
+    size_t body_len;
+
+    /* Results. */
+    int status;                 /**< HTTP status code, or a modem-specific error code. */
+    size_t length;              /**< Response body length reported by the modem. */
+};
+
+/** Certificate types for tls_cert(). */
+enum cellular_cert_type {
+    CELLULAR_CERT_CA,           /**< Trusted CA; enables server verification. */
+    CELLULAR_CERT_CLIENT,       /**< Client certificate. */
+    CELLULAR_CERT_KEY,          /**< Client private key. */
+};
+
+/** Network-based location fix. */
+struct cellular_location {
+    float latitude;
+    float longitude;
+    float altitude;             /**< Zero if the modem doesn't report it. */
+};
+
+struct cellular;
+
+/**
+ * Completion callback for cellular_locate(). Called from the AT reader
+ * context, so it must not issue commands.
+ *
+ * @param status Zero on success, an errno value on failure.
+ * @param loc Location; only valid on success.
+ */
+typedef void (*cellular_locate_cb_t)(struct cellular *modem, int status,
+                                     const struct cellular_location *loc, void *arg);
+
+/** Location cache entry; see cellular_locate(). */
+struct cellular_location_entry {
+    unsigned lac;
+    unsigned ci;
+    struct cellular_location loc;
+    uint64_t updated;           /**< at_monotonic_ms() of the lookup; 0 if unused. */
+};
+
+/** socket_recv() flags. */
+enum {
+    CELLULAR_MSG_WAIT = 0x01,   /**< Block until some data arrives. */
+};
+
+#ifdef CELLULAR_ACCOUNTING
+#ifndef AT_STATS
+#error "CELLULAR_ACCOUNTING counts commands with AT_STATS; define both."
+#endif
+
+/** Ops slots; at least the number of ops in struct cellular_ops. */
+#define CELLULAR_ACCOUNT_OPS 40
+
+/** AT traffic of one op; see cellular_account(). */
+struct cellular_op_account {
+    const char *name;           /**< Op name, e.g. "pdp_open"; NULL if never called. */
+    unsigned calls;
+    unsigned commands;          /**< Commands sent, in all calls. */
+    unsigned max_commands;      /**< Most commands sent in one call. */
+    unsigned writes;            /**< Writes not awaiting a response, e.g. payloads; in all calls. */
+    unsigned max_writes;        /**< Most writes in one call. */
+    unsigned timeouts;          /**< Commands that timed out. */
+    uint64_t total_ms;          /**< Wall time spent, in all calls. */
+    unsigned max_ms;            /**< Longest call. */
+};
+
+/** Command budget of one op; see cellular_account_check(). */
+struct cellular_budget {
+    const char *op;
+    unsigned commands;          /**< Most commands allowed in one call. */
+    unsigned writes;            /**< Most writes allowed in one call. */
+};
+#endif
+
+/** DNS cache entry; see cellular_resolve(). */
+struct cellular_dns_entry {
+    char host[CELLULAR_DNS_HOST_LENGTH];
+    char ip[CELLULAR_IP_LENGTH];
+    uint64_t updated;           /**< at_monotonic_ms() of the last lookup; 0 if unused. */
+};
+
 struct cellular {
     const struct cellular_ops *ops;
     struct at *at;
+    const struct cellular_ops *driver_ops;  /**< Unwrapped ops; see cellular_wrap_ops(). */
 
     /* Private fields. */
     const char *apn;
     int pdp_failures;
     int pdp_threshold;
+    enum cellular_pdp_state pdp_state;
+
+    /* Socket ACK tracking; see cellular_ack_poll(). */
+    int unacked[CELLULAR_MAX_SOCKETS];  /**< Bytes not yet ACKed; -1 if closed. */
+    unsigned ack_issued;                /**< Number of status polls issued. */
+    unsigned ack_completed;             /**< Issue number of the last completed poll. */
+    uint64_t ack_polled;                /**< When the last poll completed. */
+    bool dgram[CELLULAR_MAX_SOCKETS];   /**< Datagram socket; nothing to ACK. */
+
+    /* Network state cache; see cellular_op_creg() and cellular_op_rssi(). */
+    int creg;                   /**< Circuit-switched registration status. */
+    int cgreg;                  /**< Packet-switched registration status. */
+    int rssi;                   /**< Signal strength, AT+CSQ scale. */
+    unsigned lac;               /**< Serving cell location area code. */
+    unsigned ci;                /**< Serving cell ID. */
+    uint64_t creg_updated;      /**< at_monotonic_ms() of the last update; 0 if never. */
+    uint64_t rssi_updated;      /**< at_monotonic_ms() of the last update; 0 if never. */
+    bool creg_urc;              /**< Registration URCs are enabled. */
+    bool rssi_urc;              /**< Signal strength URCs are enabled. */
+
+    /* DNS cache; see cellular_resolve(). */
+    struct cellular_dns_entry dns[CELLULAR_DNS_CACHE];
+
+    /* Location cache; see cellular_locate(). */
+    struct cellular_location_entry locations[CELLULAR_LOCATE_CACHE];
+    cellular_locate_cb_t locate_cb;     /**< Pending lookup's callback; NULL if none. */
+    void *locate_arg;
+    unsigned locate_lac;                /**< Serving cell when the lookup started. */
+    unsigned locate_ci;
+
+    /* Clock cache; see cellular_clock_gettime(). */
+    int64_t clock_offset;       /**< Unix time minus at_monotonic_ms(), in milliseconds. */
+    uint64_t clock_updated;     /**< at_monotonic_ms() of the last RTC read; 0 if never. */
+
+    /* Last attach; see cellular_attach(). */
+    int attach_ms;              /**< Time taken by the last attach. */
+    int attach_changed;         /**< Number of settings it had to change. */
+
+#ifdef CELLULAR_ACCOUNTING
+    /* Per-op accounting; see cellular_account(). */
+    struct cellular_op_account accounts[CELLULAR_ACCOUNT_OPS];
+    int account_depth;          /**< Ops in progress, nested ones included. */
+    unsigned account_commands;  /**< Command count when the outermost op began. */
+    unsigned account_writes;
+    unsigned account_timeouts;
+    uint64_t account_started;
+#endif
 };
 
 struct cellular_ops {
@@ -60,31 +237,71 @@ struct cellular_ops {
     int (*meid)(struct cellular *modem, char *buf, size_t len);
     /** Read SIM serial number (ICCID). */
     int (*iccid)(struct cellular *modem, char *iccid, size_t len);
+    /** Read IMEI and ICCID in a single round trip. */
+    int (*identity)(struct cellular *modem, char *imei, size_t imei_len, char *iccid, size_t iccid_len);
 
-    /** Get network registration status. */
+    /** Get network registration status. Served from cache while fresh. */
     int (*creg)(struct cellular *modem);
-    /** Get signal strength. */
+    /** Get signal strength. Served from cache while fresh. */
     int (*rssi)(struct cellular *modem);
 
-//    /** Read RTC date and time. Compatible with clock_gettime(). */
-//    int (*clock_gettime)(struct cellular *modem, struct timespec *ts);
-//    /** Set RTC date and time. Compatible with clock_settime(). */
-//    int (*clock_settime)(struct cellular *modem, const struct timespec *ts);
-//    /** Get network date and time. */
-//    int (*clock_ntptime)(struct cellular *modem, struct timespec *ts);
+    /** Read RTC date and time. Compatible with clock_gettime(). */
+    int (*clock_gettime)(struct cellular *modem, struct timespec *ts);
+    /** Set RTC date and time. Compatible with clock_settime(). */
+    int (*clock_settime)(struct cellular *modem, const struct timespec *ts);
+    /** Sync RTC with network time and return it. */
+    int (*clock_ntptime)(struct cellular *modem, struct timespec *ts);
+
+    /** Look up a hostname's IPv4 address, bypassing the cache. */
+    int (*resolve)(struct cellular *modem, const char *host, char *ip, size_t len);
+    /** Start a lookup without waiting for it; the result lands in the cache. */
+    int (*resolve_async)(struct cellular *modem, const char *host);
 
     int (*socket_connect)(struct cellular *modem, int connid, const char *host, uint16_t port);
+    /** Connect a datagram (UDP) socket. Each send is one datagram and never
+     *  waits for ACKs; each recv returns at most one datagram. */
+    int (*socket_connect_udp)(struct cellular *modem, int connid, const char *host, uint16_t port);
+    /** Connect a TLS socket terminated in the modem. Data is plaintext on the
+     *  AT link; use socket_send()/socket_recv()/socket_close() as usual. */
+    int (*socket_connect_tls)(struct cellular *modem, int connid, const char *host, uint16_t port);
+    /** Store a certificate or key for TLS sockets in the modem. */
+    int (*tls_cert)(struct cellular *modem, enum cellular_cert_type type, const void *data, size_t len);
     ssize_t (*socket_send)(struct cellular *modem, int connid, const void *buffer, size_t amount, int flags);
     ssize_t (*socket_recv)(struct cellular *modem, int connid, void *buffer, size_t length, int flags);
     int (*socket_waitack)(struct cellular *modem, int connid);
     int (*socket_close)(struct cellular *modem, int connid);
+    /** Refresh unacked[] of all sockets with as few commands as possible. */
+    int (*socket_ackpoll)(struct cellular *modem);
+    /** Connect a socket in online (transparent) data mode. The byte stream is
+     *  then accessed with at_online_read()/at_online_write(); socket_close()
+     *  escapes back to command mode. */
+    int (*socket_online)(struct cellular *modem, int connid, const char *host, uint16_t port);
 
     int (*ftp_open)(struct cellular *modem, const char *host, uint16_t port, const char *username, const char *password, bool passive);
     int (*ftp_get)(struct cellular *modem, const char *filename);
+    /** Start the next ftp_get() at an offset into the file. */
+    int (*ftp_rest)(struct cellular *modem, size_t offset);
     int (*ftp_getdata)(struct cellular *modem, char *buffer, size_t length);
+    /** Stream the rest of the file opened with ftp_get() into a sink, in the
+     *  largest chunks the modem allows. Returns zero at end of file. */
+    int (*ftp_download)(struct cellular *modem, cellular_sink_t sink, void *arg, struct cellular_transfer_stats *stats);
+    /** Start uploading a file. */
+    int (*ftp_put)(struct cellular *modem, const char *filename);
+    /** Append data to the file being uploaded; zero length finishes it. Data
+     *  is staged so the modem always gets chunks of its maximum size. */
+    int (*ftp_putdata)(struct cellular *modem, const void *buffer, size_t length);
     int (*ftp_close)(struct cellular *modem);
 
+    /** Perform a request with the modem's built-in HTTP client and stream the
+     *  response body into a sink (NULL to skip it). Returns the HTTP status
+     *  code. */
+    int (*http)(struct cellular *modem, struct cellular_http_request *req,
+                cellular_sink_t sink, void *arg, struct cellular_transfer_stats *stats);
+
+    /** Locate the device by its serving cell, blocking until done. */
     int (*locate)(struct cellular *modem, float *latitude, float *longitude, float *altitude);
+    /** Start a location lookup; the result is passed to cellular_locate_done(). */
+    int (*locate_async)(struct cellular *modem);
 };
 
 
@@ -100,7 +317,9 @@ struct cellular *cellular_alloc(void);
 
 /**
  * Attach cellular modem instance to an AT channel.
- * Performs initialization, attaches callbacks, etc.
+ * Performs initialization, attaches callbacks, etc. Settings the modem
+ * already has are not re-sent; the time taken and the number of changed
+ * settings are recorded in attach_ms and attach_changed.
  *
  * @param modem Cellular modem instance.
  * @param at AT channel instance.
@@ -116,6 +335,184 @@ int cellular_attach(struct cellular *modem, struct at *at, const char *apn);
  */
 int cellular_detach(struct cellular *modem);
 
+/**
+ * Refresh the unacknowledged byte counts of all sockets with one shared
+ * status query. socket_waitack() callers reuse the result, so a background
+ * task or a monitoring loop calling this periodically spares them from
+ * issuing their own queries.
+ *
+ * @param modem Cellular modem instance.
+ * @returns Zero on success, -1 and sets errno on failure.
+ */
+int cellular_ack_poll(struct cellular *modem);
+
+/**
+ * Read date and time from the clock cache. The modem's RTC is only queried
+ * when the cache is empty or old enough for the local clock to have drifted;
+ * otherwise the time is extrapolated from at_monotonic_ms().
+ *
+ * @param modem Cellular modem instance.
+ * @param ts Unix time.
+ * @returns Zero on success, -1 and sets errno on failure.
+ */
+int cellular_clock_gettime(struct cellular *modem, struct timespec *ts);
+
+/**
+ * Locate the device by its serving cell without blocking. Lookups are
+ * cached per cell (LAC and CI), so a stationary device gets its location
+ * right away without any network traffic; the callback is then called
+ * before this function returns.
+ *
+ * On SIM800 lookups are synchronous: AT+CIPGSMLOC is only answered once the
+ * fix is in, so a cache miss blocks for up to 70 seconds and the callback
+ * runs before this function returns.
+ *
+ * @param modem Cellular modem instance.
+ * @param cb Completion callback.
+ * @param arg Private argument passed to the callback.
+ * @returns Zero if the lookup was started or served from the cache, -1 and
+ *          sets errno on failure (EBUSY if another lookup is pending).
+ */
+int cellular_locate(struct cellular *modem, cellular_locate_cb_t cb, void *arg);
+
+/**
+ * Resolve a hostname through the DNS cache. Fresh entries are served
+ * without touching the modem. Stale ones are served too if the modem can
+ * refresh them in the background; otherwise they're looked up again, and
+ * only used if that fails. IP addresses are passed through unchanged.
+ * socket_connect() and socket_connect_udp() use this transparently.
+ *
+ * @param modem Cellular modem instance.
+ * @param host Hostname or dotted IPv4 address.
+ * @param ip Buffer for the address; CELLULAR_IP_LENGTH is enough.
+ * @param len Buffer size.
+ * @returns Zero on success, -1 and sets errno on failure.
+ */
+int cellular_resolve(struct cellular *modem, const char *host, char *ip, size_t len);
+
+/**
+ * Resumable FTP download. See cellular_ftp_download().
+ */
+struct cellular_download {
+    /* Server parameters, kept for reconnects. Strings are not copied. */
+    const char *host;
+    uint16_t port;
+    const char *username;
+    const char *password;
+    bool passive;
+    const char *filename;
+    int attempts;               /**< Connection attempts before giving up. */
+    bool check_crc32;           /**< Verify the result against expected_crc32. */
+    uint32_t expected_crc32;
+
+    /* Progress; zero before the first call. */
+    size_t offset;              /**< Bytes delivered to the sink; the resume point. */
+    uint32_t crc32;             /**< CRC-32 of the bytes delivered so far. */
+    int resumes;                /**< Times the transfer was resumed. */
+    struct cellular_transfer_stats stats;   /**< Totals over all attempts. */
+};
+
+/**
+ * Download a file, resuming from the last delivered byte after connection
+ * failures. The CRC-32 is computed as data streams in. Calling it again
+ * with the same struct continues an interrupted download.
+ *
+ * @param modem Cellular modem instance.
+ * @param dl Download parameters and progress.
+ * @param sink Data sink; see cellular_sink_t.
+ * @param arg Private argument passed to the sink.
+ * @returns Zero on success, -1 and sets errno on failure (EBADMSG on a
+ *          CRC mismatch).
+ */
+int cellular_ftp_download(struct cellular *modem, struct cellular_download *dl,
+                          cellular_sink_t sink, void *arg);
+
+/**
+ * Update a CRC-32 (IEEE 802.3, as used by zlib) with more data.
+ *
+ * @param crc CRC of the data so far; zero to start.
+ * @returns Updated CRC.
+ */
+uint32_t cellular_crc32(uint32_t crc, const void *data, size_t len);
+
+/**
+ * PDP supervisor state and reconnect metrics. See cellular_supervise().
+ */
+struct cellular_supervisor {
+    /* Configuration. */
+    int backoff_min;            /**< First retry delay, in milliseconds. */
+    int backoff_max;            /**< Retry delay cap, in milliseconds. */
+
+    /* Private fields. */
+    int backoff;
+    uint64_t retry_at;
+    uint64_t down_since;
+    int cgreg;
+
+    /* Metrics. */
+    unsigned reconnects;        /**< Successful reconnects done by the supervisor. */
+    unsigned attempts;          /**< Reconnect attempts, including failed ones. */
+    int last_latency;           /**< Time from losing the context to reopening it, in ms. */
+    int max_latency;            /**< Worst reconnect latency seen, in ms. */
+};
+
+/**
+ * Prepare a PDP supervisor.
+ *
+ * @param sup Supervisor instance.
+ * @param backoff_min First retry delay, in milliseconds.
+ * @param backoff_max Retry delay cap, in milliseconds.
+ */
+void cellular_supervisor_init(struct cellular_supervisor *sup, int backoff_min, int backoff_max);
+
+/**
+ * Keep the PDP context open. Blocks until the context is lost (or its state
+ * becomes unknown) and reopens it, retrying with jittered exponential
+ * backoff. Regaining GPRS registration triggers an immediate retry. Meant to
+ * be called in a loop from a supervising thread or task, alongside the
+ * application's own ops; the channel lock keeps their commands apart.
+ *
+ * @param modem Cellular modem instance.
+ * @param sup Supervisor instance.
+ * @param timeout Maximum time to block, in milliseconds.
+ * @returns Zero if the context is up, -1 otherwise.
+ */
+int cellular_supervise(struct cellular *modem, struct cellular_supervisor *sup, int timeout);
+
+#ifdef CELLULAR_ACCOUNTING
+/**
+ * Look up the AT traffic of an op. Only available when built with
+ * CELLULAR_ACCOUNTING. Each call of an op is charged with every command,
+ * write and millisecond spent until it returns, those of ops it calls
+ * included; nested ops aren't charged separately. Ops of one modem must not
+ * run concurrently, or they'll be charged for each other's commands.
+ *
+ * @param modem Cellular modem instance.
+ * @param op Op name, e.g. "socket_send".
+ * @returns Accounting entry, or NULL if the op hasn't been called.
+ */
+const struct cellular_op_account *cellular_account(struct cellular *modem, const char *op);
+
+/**
+ * Forget the accounting of all ops.
+ *
+ * @param modem Cellular modem instance.
+ */
+void cellular_account_reset(struct cellular *modem);
+
+/**
+ * Check ops against their command budgets, e.g. in a test run against a
+ * simulated modem. An op is over budget if any call of it sent more
+ * commands, or made more writes, than allowed.
+ *
+ * @param modem Cellular modem instance.
+ * @param budgets Budgets to check; ops not called yet pass.
+ * @param count Number of budgets.
+ * @returns Number of ops over budget.
+ */
+int cellular_account_check(struct cellular *modem, const struct cellular_budget *budgets, size_t count);
+#endif
+
 /**
  * Free a cellular modem instance.
  *
@@ -124,15 +521,24 @@ int cellular_detach(struct cellular *modem);
 void cellular_free(struct cellular *modem);
 
 
-/* Modem-specific variants below. */
+/* Modem-specific variants below. The *_init() variants set up an instance
+ * in caller-provided, pointer-aligned storage of the matching *_SIZE; don't
+ * pass those to the *_free() functions. */
+
+#define CELLULAR_GENERIC_SIZE (sizeof(struct cellular))
+#define CELLULAR_TELIT2_SIZE (sizeof(struct cellular) + 1536 + 16*sizeof(void *))
+#define CELLULAR_SIM800_SIZE (sizeof(struct cellular) + 1360 + 32*sizeof(void *))
 
 struct cellular *cellular_generic_alloc(void);
+struct cellular *cellular_generic_init(void *storage);
 void cellular_generic_free(struct cellular *modem);
 
 struct cellular *cellular_telit2_alloc(void);
+struct cellular *cellular_telit2_init(void *storage);
 void cellular_telit2_free(struct cellular *modem);
 
 struct cellular *cellular_sim800_alloc(void);
+struct cellular *cellular_sim800_init(void *storage);
 void cellular_sim800_free(struct cellular *modem);
 
 #endif
@@ -50,6 +50,9 @@ typedef enum at_response_type (*at_line_scanner_t)(const char *line, size_t len,
 /** Response handler. */
 typedef void (*at_response_handler_t)(const char *line, size_t len, void *priv);
 
+/** Raw data sink. Receives payload of raw/hex data blocks in pieces. */
+typedef void (*at_rawdata_sink_t)(const void *data, size_t len, void *arg);
+
 struct at_parser_callbacks {
     at_line_scanner_t scan_line;
     at_response_handler_t handle_response;
@@ -67,6 +70,23 @@ struct at_parser_callbacks {
  */
 struct at_parser *at_parser_alloc(const struct at_parser_callbacks *cbs, size_t bufsize, void *priv);
 
+/** Storage size for at_parser_init(). */
+#define AT_PARSER_SIZE (16*sizeof(void *))
+
+/**
+ * Initialize a parser instance in caller-provided memory. Don't pass it to
+ * at_parser_free().
+ *
+ * @param storage AT_PARSER_SIZE bytes, pointer-aligned.
+ * @param cbs Parser callbacks; see at_parser_alloc().
+ * @param buf Response buffer.
+ * @param bufsize Response buffer size in bytes.
+ * @param priv Private argument; passed to callbacks.
+ * @returns Parser instance pointer.
+ */
+struct at_parser *at_parser_init(void *storage, const struct at_parser_callbacks *cbs,
+                                 char *buf, size_t bufsize, void *priv);
+
 /**
  * Reset parser instance to initial state.
  *
@@ -82,6 +102,18 @@ void at_parser_reset(struct at_parser *parser);
  */
 void at_parser_set_character_handler(struct at_parser *parser, at_character_handler_t handler);
 
+/**
+ * Deliver raw/hex data blocks of the current response to a sink instead of
+ * the response buffer. Only the header line is stored in the response, so
+ * the payload size is not limited by the buffer size. Reset together with
+ * the parser state after each response.
+ *
+ * @param parser Parser instance.
+ * @param sink Raw data sink.
+ * @param arg Private argument passed to the sink.
+ */
+void at_parser_set_rawdata_sink(struct at_parser *parser, at_rawdata_sink_t sink, void *arg);
+
 /**
  * Make the parser expect a dataprompt for the next command.
  *
@@ -101,6 +133,14 @@ void at_parser_expect_dataprompt(struct at_parser *parser);
  */
 void at_parser_await_response(struct at_parser *parser);
 
+/**
+ * Count responses and URCs that didn't fit into the response buffer.
+ *
+ * @param parser Parser instance.
+ * @returns Number of truncated responses since the parser was created.
+ */
+unsigned at_parser_truncations(struct at_parser *parser);
+
 /**
  * Feed parser. Callbacks are always called from this function's context.
  *
@@ -0,0 +1,106 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#ifndef ATTENTIVE_TRACE_H
+#define ATTENTIVE_TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Binary trace ring for AT traffic. Events are recorded without locks or
+ * formatting, so it's cheap enough to stay enabled in production; after an
+ * incident the ring is dumped (e.g. from RAM with a debugger, or written
+ * out with fwrite()) and decoded with at-trace-decode.
+ *
+ * Recording is compiled in with AT_TRACE and started with at_trace_attach().
+ */
+
+/** Number of events kept; a power of two, so slots stay in order when
+ * the sequence number wraps. */
+#ifndef AT_TRACE_ENTRIES
+#define AT_TRACE_ENTRIES 128
+#endif
+#if AT_TRACE_ENTRIES <= 0 || (AT_TRACE_ENTRIES & (AT_TRACE_ENTRIES - 1)) != 0
+#error "AT_TRACE_ENTRIES must be a power of two"
+#endif
+/** Payload bytes kept per event; longer lines are cut short. */
+#define AT_TRACE_DATA 52
+#define AT_TRACE_MAGIC 0x41547472
+
+enum at_trace_type {
+    AT_TRACE_TX = 1,            /**< Command or data sent. */
+    AT_TRACE_RX,                /**< Response received. */
+    AT_TRACE_URC,               /**< URC received. */
+    AT_TRACE_STATE,             /**< Channel state change: "open", "online", ... */
+    AT_TRACE_TIMEOUT,           /**< Command timed out. */
+};
+
+struct at_trace_event {
+    uint32_t seq;               /**< Sequence number plus one; zero while being written. */
+    uint32_t timestamp;         /**< at_monotonic_ms(), truncated. */
+    uint8_t type;               /**< enum at_trace_type. */
+    uint8_t len;                /**< Bytes kept in data. */
+    uint16_t size;              /**< Original size; more than len if cut short. */
+    char data[AT_TRACE_DATA];
+};
+
+struct at_trace {
+    uint32_t magic;             /**< AT_TRACE_MAGIC. */
+    uint16_t entries;           /**< AT_TRACE_ENTRIES, for the decoder. */
+    uint16_t event_size;        /**< sizeof(struct at_trace_event), for the decoder. */
+    uint32_t head;              /**< Next sequence number. */
+    struct at_trace_event events[AT_TRACE_ENTRIES];
+};
+
+/**
+ * Prepare an empty trace ring.
+ *
+ * @param trace Trace ring; may live in memory that survives a reset, so
+ *              check the old contents with at_trace_dump() first.
+ */
+void at_trace_init(struct at_trace *trace);
+
+/**
+ * Record an event. Safe to call concurrently from any number of tasks,
+ * threads or interrupts; needs atomic read-modify-write instructions.
+ *
+ * @param trace Trace ring.
+ * @param type Event type.
+ * @param data Payload.
+ * @param size Payload size.
+ * @param timestamp Event time in milliseconds.
+ */
+void at_trace_record(struct at_trace *trace, enum at_trace_type type,
+                     const void *data, size_t size, uint32_t timestamp);
+
+/**
+ * Copy out the events in the ring, oldest first. Events being written at
+ * the moment are skipped.
+ *
+ * @param trace Trace ring.
+ * @param events Destination.
+ * @param max Destination size in events.
+ * @returns Number of events copied.
+ */
+size_t at_trace_dump(const struct at_trace *trace, struct at_trace_event *events, size_t max);
+
+/**
+ * Format an event as a line of text, escaping non-printable bytes.
+ *
+ * @param event Event.
+ * @param buf Destination.
+ * @param len Destination size.
+ * @returns Length of the formatted line, as snprintf().
+ */
+int at_trace_format(const struct at_trace_event *event, char *buf, size_t len);
+
+#endif
+
+/* vim: set ts=4 sw=4 et: */
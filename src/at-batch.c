@@ -0,0 +1,190 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#include <attentive/at.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#define printf(...)
+
+/* Longest command line we're willing to build. */
+#define AT_BATCH_LENGTH 256
+
+static const char *const error_responses[] = {
+    "ERROR",
+    "+CME ERROR:",
+    "+CMS ERROR:",
+    NULL
+};
+
+/**
+ * Extended syntax commands need a semicolon before the next command; basic
+ * syntax commands (letters and "&"-prefixed) don't.
+ */
+static bool batch_is_extended(const char *command)
+{
+    return !((command[0] >= 'A' && command[0] <= 'Z') ||
+             (command[0] >= 'a' && command[0] <= 'z') ||
+             command[0] == '&');
+}
+
+/**
+ * Length of the command name, e.g. 5 for "+CREG?" or "+CREG=2".
+ */
+static size_t batch_name_length(const char *command)
+{
+    return strcspn(command, "=?");
+}
+
+static bool batch_takes_arguments(const char *command)
+{
+    return command[batch_name_length(command)] != '\0';
+}
+
+static bool batch_owns_line(const struct at_batch *cmd, const char *line)
+{
+    size_t namelen = batch_name_length(cmd->command);
+    return batch_is_extended(cmd->command) &&
+           !strncmp(line, cmd->command, namelen) && line[namelen] == ':';
+}
+
+static void batch_append(struct at_batch *cmd, const char *line, size_t len)
+{
+    cmd->lines++;
+    if (!cmd->response)
+        return;
+
+    size_t used = strlen(cmd->response);
+    /* Newline-delimited, just like at_command() responses. */
+    if (used > 0 && used+1 < cmd->size)
+        cmd->response[used++] = '\n';
+    if (len > cmd->size - used - 1)
+        len = cmd->size - used - 1;
+    memcpy(cmd->response + used, line, len);
+    cmd->response[used + len] = '\0';
+}
+
+/**
+ * Distribute the lines of a combined response over the commands.
+ *
+ * @returns Zero on success, -1 if the line was terminated by an error.
+ */
+static int batch_split(const char *response, struct at_batch *cmds, size_t count)
+{
+    size_t cursor = 0;      /* Command that received the last line. */
+    size_t bare = 0;        /* Next candidate for an unprefixed line. */
+
+    while (*response) {
+        size_t len = strcspn(response, "\n");
+
+        if (at_prefix_in_table(response, error_responses))
+            return -1;
+
+        size_t owner = count;
+        if (response[0] == '+' || response[0] == '#') {
+            /* Prefer the next same-named command that's still silent. */
+            for (size_t i=cursor; i<count; i++) {
+                if (batch_owns_line(&cmds[i], response) &&
+                    (cmds[i].lines == 0 || i == cursor)) {
+                    owner = i;
+                    if (cmds[i].lines == 0)
+                        break;
+                }
+            }
+        }
+        if (owner == count) {
+            size_t i = bare > cursor ? bare : cursor;
+            while (i < count && batch_takes_arguments(cmds[i].command))
+                i++;
+            owner = i;
+            bare = i+1;
+        }
+
+        if (owner < count) {
+            batch_append(&cmds[owner], response, len);
+            cursor = owner;
+        }
+
+        response += len;
+        if (*response)
+            response++;
+    }
+
+    return 0;
+}
+
+static int batch_run(struct at *at, struct at_batch *cmds, size_t count, size_t maxlen)
+{
+    char line[AT_BATCH_LENGTH];
+
+    /* Leave room for the terminating CR. */
+    if (maxlen > sizeof(line)-1)
+        maxlen = sizeof(line)-1;
+
+    for (size_t i=0; i<count; i++) {
+        cmds[i].lines = 0;
+        if (cmds[i].response && cmds[i].size > 0)
+            cmds[i].response[0] = '\0';
+    }
+
+    size_t first = 0;
+    while (first < count) {
+        /* Pack as many commands as fit on one line. */
+        size_t len = strlen("AT");
+        memcpy(line, "AT", len);
+
+        size_t last = first;
+        while (last < count) {
+            size_t cmdlen = strlen(cmds[last].command);
+            bool separator = (last > first && batch_is_extended(cmds[last-1].command));
+            if (len + separator + cmdlen > maxlen)
+                break;
+            if (separator)
+                line[len++] = ';';
+            memcpy(line + len, cmds[last].command, cmdlen);
+            len += cmdlen;
+            last++;
+        }
+
+        /* A single command that doesn't fit on a line. */
+        if (last == first) {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        printf("> %.*s\n", (int) len, line);
+
+        /* Append modem-style newline. */
+        line[len++] = '\r';
+
+        const char *response = at_command_raw(at, line, len);
+        if (response == NULL)
+            return -1;
+        if (batch_split(response, cmds + first, last - first) != 0) {
+            errno = EIO;
+            return -1;
+        }
+
+        first = last;
+    }
+
+    return 0;
+}
+
+int at_command_batch(struct at *at, struct at_batch *cmds, size_t count, size_t maxlen)
+{
+    /* Keep each response until it has been split. */
+    at_lock(at);
+    int result = batch_run(at, cmds, count, maxlen);
+    at_unlock(at);
+
+    return result;
+}
+
+/* vim: set ts=4 sw=4 et: */
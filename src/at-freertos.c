@@ -7,6 +7,8 @@
  */
 
 #include <attentive/at.h>
+#include <attentive/at-freertos.h>
+#include <errno.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
@@ -14,47 +16,146 @@
 #include "FreeRTOS_IO.h"
 #include "task.h"
 #include "semphr.h"
+#include "queue.h"
+#include "event_groups.h"
+#ifdef AT_FREERTOS_RX_STREAM
+#include "stream_buffer.h"
+#endif
 #define printf(...)
 
+#include "at-probes.h"
+#include "at-stats.h"
+#include "at-trace.h"
+
 // Remove once you refactor this out.
 #define AT_COMMAND_LENGTH 80
 
+/* "+++" escape guard time, with some margin on top of the usual S12=50. */
+#define AT_ESCAPE_GUARD_MS 1100
+#define AT_ESCAPE_ATTEMPTS 3
+
+/* UART read slice while online, without AT_FREERTOS_RX_STREAM. Offline,
+ * the reader task blocks on the UART without a timeout. */
+#define AT_ONLINE_READ_SLICE_MS 50
+
+/* Reader task run conditions; it blocks until all of them are set. */
+#define AT_EVENT_RUNNING (1 << 0)   /**< Reader should be running. */
+#define AT_EVENT_OPEN    (1 << 1)   /**< Port is open. */
+#define AT_EVENT_OFFLINE (1 << 2)   /**< Not in online data mode. */
+#define AT_EVENT_READER  (AT_EVENT_RUNNING | AT_EVENT_OPEN | AT_EVENT_OFFLINE)
+
+#ifdef AT_STATS
+/* Parser time clock. Defaults to the tick; point it at a cycle counter for
+ * useful resolution, e.g. DWT->CYCCNT / (SystemCoreClock / 1000000). */
+#ifndef AT_FREERTOS_STATS_US
+#define AT_FREERTOS_STATS_US() ((uint64_t) xTaskGetTickCount() * portTICK_PERIOD_MS * 1000)
+#endif
+#define stats_clock_us() AT_FREERTOS_STATS_US()
+#else
+#define stats_clock_us() 0
+#endif
+
 struct at_freertos {
     struct at at;
     int timeout;            /**< Command timeout in seconds. */
     const char *response;
 
     TaskHandle_t xTask;
-    /*SemaphoreHandle_t xMutex;*/
-    SemaphoreHandle_t xSem;
+    TaskHandle_t xWorker;       /**< Runs deferred work; see at_defer(). */
+    TaskHandle_t xCaller;       /**< Task waiting for a response; notified on arrival. */
+    EventGroupHandle_t xEvents; /**< AT_EVENT_* bits. */
+    SemaphoreHandle_t xMutex;   /**< Recursive; see at_lock(). */
+    SemaphoreHandle_t xParserMutex; /**< Held by the reader while it feeds the parser. */
+    SemaphoreHandle_t xUrcSem;  /**< Given on every URC; see at_wait_until(). */
+    QueueHandle_t xWork;        /**< Deferred work items. */
     Peripheral_Descriptor_t xUART;
+#ifdef AT_FREERTOS_RX_STREAM
+    StreamBufferHandle_t xRxStream;     /**< Fed by at_freertos_rx_from_isr(). */
+    char stash[AT_FREERTOS_RX_CHUNK];   /**< Chunk tail received after going online. */
+    size_t stash_len;                   /**< Guarded by xParserMutex. */
+#endif
+    bool notify;            /**< Response arrived; wake xCaller once the chunk is fed. */
+    int lock_depth;         /**< at_lock() nesting; guarded by xMutex. */
+    bool prompt;            /**< Current command expects a dataprompt. */
+    bool payload_pending;   /**< Got a dataprompt; xPayloadOwner sends next. */
+    TaskHandle_t xPayloadOwner;
+#if configSUPPORT_STATIC_ALLOCATION
+    StaticEventGroup_t xEventsBuffer;
+    StaticSemaphore_t xMutexBuffer;
+    StaticSemaphore_t xParserMutexBuffer;
+    StaticSemaphore_t xUrcSemBuffer;
+    StaticQueue_t xWorkBuffer;
+    uint8_t ucWorkStorage[AT_WORK_QUEUE * sizeof(struct at_work)];
+#ifdef AT_FREERTOS_RX_STREAM
+    StaticStreamBuffer_t xRxStreamBuffer;
+    uint8_t ucRxStorage[AT_FREERTOS_RX_BUFFER + 1];
+#endif
+#endif
 
     bool running : 1;       /**< Reader thread should be running. */
     bool open : 1;          /**< FD is valid. Set/cleared by open()/close(). */
     bool busy : 1;          /**< FD is in use. Set/cleared by reader thread. */
     bool waiting : 1;       /**< Waiting for response callback to arrive. */
+    bool online_pending : 1;/**< Go online when the next response arrives. */
+    bool online : 1;        /**< Online data mode; reader keeps off the UART. */
+    bool allocated : 1;     /**< Created by at_alloc_freertos(); at_free() frees it. */
 };
 
+/* Fail the build if AT_FREERTOS_SIZE is too small. */
+typedef char at_freertos_size_check[sizeof(struct at_freertos) <= AT_FREERTOS_SIZE ? 1 : -1];
+
 void at_reader_thread(void *arg);
+static void at_worker_thread(void *arg);
 
 static void handle_response(const char *buf, size_t len, void *arg)
 {
     struct at_freertos *priv = (struct at_freertos *) arg;
 
     /* The mutex is held by the reader thread; don't reacquire. */
+    at_trace_log(&priv->at, AT_TRACE_RX, buf, len);
     priv->response = buf;
-    (void) len;
     priv->waiting = false;
-    xSemaphoreGive(priv->xSem);
+
+    /* Stop the reader right after a successful connect response. */
+    if (priv->online_pending) {
+        priv->online_pending = false;
+        priv->online = (len == 0);
+        if (priv->online) {
+            at_trace_log(&priv->at, AT_TRACE_STATE, "online", 6);
+            xEventGroupClearBits(priv->xEvents, AT_EVENT_OFFLINE);
+        }
+    }
+
+    /* The rest of the chunk may belong to at_online_read(); the reader
+     * wakes the caller once it has been stashed. */
+    priv->notify = true;
+}
+
+/**
+ * Wake the caller if a response arrived in the data just fed.
+ */
+static void reader_wake_caller(struct at_freertos *priv)
+{
+    if (priv->notify) {
+        priv->notify = false;
+        xTaskNotifyGiveIndexed(priv->xCaller, AT_FREERTOS_NOTIFY_INDEX);
+    }
 }
 
 static void handle_urc(const char *buf, size_t len, void *arg)
 {
-    struct at *at = (struct at *) arg;
+    struct at_freertos *priv = (struct at_freertos *) arg;
+    struct at *at = &priv->at;
+
+    at_trace_log(at, AT_TRACE_URC, buf, len);
 
     /* Forward to caller's URC callback, if any. */
-    if (at->cbs->handle_urc)
+    if (at->cbs && at->cbs->handle_urc)
         at->cbs->handle_urc(buf, len, at->arg);
+
+    /* Let at_wait_until() callers re-check their conditions. */
+    at_stats_urc(at);
+    xSemaphoreGive(priv->xUrcSem);
 }
 
 enum at_response_type scan_line(const char *line, size_t len, void *arg)
@@ -83,6 +184,7 @@ struct at *at_alloc_freertos(void)
         return NULL;
     }
     memset(priv, 0, sizeof(struct at_freertos));
+    priv->allocated = true;
 
     /* allocate underlying parser */
     priv->at.parser = at_parser_alloc(&parser_callbacks, 512, (void *) priv);
@@ -93,12 +195,56 @@ struct at *at_alloc_freertos(void)
 
     /* initialize and start reader thread */
     priv->running = true;
-    /*priv->xMutex = xSemaphoreCreateBinary();*/
-    priv->xSem = xSemaphoreCreateBinary();
-    xTaskCreate(at_reader_thread, "ATReadTask", configMINIMAL_STACK_SIZE * 2, priv, 4, &priv->xTask);
+    priv->xMutex = xSemaphoreCreateRecursiveMutex();
+    priv->xParserMutex = xSemaphoreCreateMutex();
+    priv->xEvents = xEventGroupCreate();
+    xEventGroupSetBits(priv->xEvents, AT_EVENT_RUNNING | AT_EVENT_OFFLINE);
+    priv->xUrcSem = xSemaphoreCreateBinary();
+#ifdef AT_FREERTOS_RX_STREAM
+    priv->xRxStream = xStreamBufferCreate(AT_FREERTOS_RX_BUFFER, 1);
+#endif
+    xTaskCreate(at_reader_thread, "ATReadTask", AT_FREERTOS_STACK_DEPTH, priv, 4, &priv->xTask);
+
+    /* start deferred work task */
+    priv->xWork = xQueueCreate(AT_WORK_QUEUE, sizeof(struct at_work));
+    xTaskCreate(at_worker_thread, "ATWorkTask", AT_FREERTOS_WORKER_DEPTH, priv, 3, &priv->xWorker);
+
+    return (struct at *) priv;
+}
+
+#if configSUPPORT_STATIC_ALLOCATION
+struct at *at_init_freertos(void *storage, void *parser, char *buf, size_t bufsize,
+                            StackType_t *stack, StaticTask_t *task,
+                            StackType_t *worker_stack, StaticTask_t *worker_task)
+{
+    struct at_freertos *priv = storage;
+    memset(priv, 0, sizeof(struct at_freertos));
+
+    priv->at.parser = at_parser_init(parser, &parser_callbacks, buf, bufsize, (void *) priv);
+
+    /* initialize and start reader thread */
+    priv->running = true;
+    priv->xMutex = xSemaphoreCreateRecursiveMutexStatic(&priv->xMutexBuffer);
+    priv->xParserMutex = xSemaphoreCreateMutexStatic(&priv->xParserMutexBuffer);
+    priv->xEvents = xEventGroupCreateStatic(&priv->xEventsBuffer);
+    xEventGroupSetBits(priv->xEvents, AT_EVENT_RUNNING | AT_EVENT_OFFLINE);
+    priv->xUrcSem = xSemaphoreCreateBinaryStatic(&priv->xUrcSemBuffer);
+#ifdef AT_FREERTOS_RX_STREAM
+    priv->xRxStream = xStreamBufferCreateStatic(AT_FREERTOS_RX_BUFFER, 1,
+                                                priv->ucRxStorage, &priv->xRxStreamBuffer);
+#endif
+    priv->xTask = xTaskCreateStatic(at_reader_thread, "ATReadTask", AT_FREERTOS_STACK_DEPTH,
+                                    priv, 4, stack, task);
+
+    /* start deferred work task */
+    priv->xWork = xQueueCreateStatic(AT_WORK_QUEUE, sizeof(struct at_work),
+                                     priv->ucWorkStorage, &priv->xWorkBuffer);
+    priv->xWorker = xTaskCreateStatic(at_worker_thread, "ATWorkTask", AT_FREERTOS_WORKER_DEPTH,
+                                      priv, 3, worker_stack, worker_task);
 
     return (struct at *) priv;
 }
+#endif
 
 int at_open(struct at *at)
 {
@@ -109,14 +255,28 @@ int at_open(struct at *at)
         return -1;
     } else {
         FreeRTOS_ioctl(priv->xUART, ioctlUSE_DMA_TX, (void*)0);
+#ifndef AT_FREERTOS_RX_STREAM
         FreeRTOS_ioctl(priv->xUART, ioctlUSE_CIRCULAR_BUFFER_RX, (void*)512);
+#endif
         FreeRTOS_ioctl(priv->xUART, ioctlSET_TX_TIMEOUT, (void*)pdMS_TO_TICKS(200));
-        FreeRTOS_ioctl(priv->xUART, ioctlSET_RX_TIMEOUT, (void*)pdMS_TO_TICKS(50));
+        FreeRTOS_ioctl(priv->xUART, ioctlSET_RX_TIMEOUT, (void*)portMAX_DELAY);
     }
 
+#ifdef AT_FREERTOS_RX_STREAM
+    /* Drop anything received while the channel was closed. The reader is
+     * normally blocked on the stream, which makes xStreamBufferReset() fail,
+     * so drain it with non-blocking reads instead. */
+    char scratch[32];
+    while (xStreamBufferReceive(priv->xRxStream, scratch, sizeof(scratch), 0) > 0)
+        ;
+    at_urc_lock(at);
+    priv->stash_len = 0;
+    at_urc_unlock(at);
+#endif
+
     priv->open = true;
-    /*xSemaphoreGive(priv->xMutex);*/
-    xSemaphoreTake(priv->xSem, 0);
+    at_trace_log(at, AT_TRACE_STATE, "open", 4);
+    xEventGroupSetBits(priv->xEvents, AT_EVENT_OPEN | AT_EVENT_OFFLINE);
     return 0;
 }
 
@@ -125,7 +285,15 @@ int at_close(struct at *at)
     struct at_freertos *priv = (struct at_freertos *) at;
 
     /* Mark the port descriptor as invalid. */
+    at_trace_log(at, AT_TRACE_STATE, "close", 5);
     priv->open = false;
+    priv->online_pending = false;
+    priv->online = false;
+    xEventGroupClearBits(priv->xEvents, AT_EVENT_OPEN);
+
+    /* Wake up a caller waiting for a response; it sees the port closed. */
+    if (priv->waiting)
+        xTaskNotifyGiveIndexed(priv->xCaller, AT_FREERTOS_NOTIFY_INDEX);
 
     FreeRTOS_close(priv->xUART);
     priv->xUART = NULL;
@@ -142,13 +310,34 @@ void at_free(struct at *at)
 
     /* ask the reader thread to terminate */
     priv->running = false;
+    xEventGroupClearBits(priv->xEvents, AT_EVENT_RUNNING);
     if(priv->xTask != NULL) {
         vTaskDelete(priv->xTask);
     }
 
+    /* stop the worker between items, never holding a lock; pending work
+     * is dropped */
+    if(priv->xWorker != NULL) {
+        struct at_work stop = { .work = NULL, .arg = xTaskGetCurrentTaskHandle() };
+        ulTaskNotifyTakeIndexed(AT_FREERTOS_NOTIFY_INDEX, pdTRUE, 0);
+        xQueueSendToFront(priv->xWork, &stop, portMAX_DELAY);
+        ulTaskNotifyTakeIndexed(AT_FREERTOS_NOTIFY_INDEX, pdTRUE, portMAX_DELAY);
+        vTaskDelete(priv->xWorker);
+    }
+
     /* free up resources */
-    free(priv->at.parser);
-    free(priv);
+#ifdef AT_FREERTOS_RX_STREAM
+    vStreamBufferDelete(priv->xRxStream);
+#endif
+    vEventGroupDelete(priv->xEvents);
+    vQueueDelete(priv->xWork);
+    vSemaphoreDelete(priv->xMutex);
+    vSemaphoreDelete(priv->xParserMutex);
+    vSemaphoreDelete(priv->xUrcSem);
+    if (priv->allocated) {
+        at_parser_free(priv->at.parser);
+        free(priv);
+    }
 }
 
 void at_set_callbacks(struct at *at, const struct at_callbacks *cbs, void *arg)
@@ -176,57 +365,223 @@ void at_set_character_handler(struct at *at, at_character_handler_t handler)
 
 void at_expect_dataprompt(struct at *at)
 {
+    struct at_freertos *priv = (struct at_freertos *) at;
+
+    priv->prompt = true;
     at_parser_expect_dataprompt(at->parser);
 }
 
-static const char *_at_command(struct at_freertos *priv, const void *data, size_t size)
+void at_set_rawdata_sink(struct at *at, at_rawdata_sink_t sink, void *arg)
+{
+    at_parser_set_rawdata_sink(at->parser, sink, arg);
+}
+
+uint64_t at_monotonic_ms(void)
 {
-    /*if(!xSemaphoreTake(priv->xMutex, pdMS_TO_TICKS(1000))) {*/
-        /*return NULL;*/
-    /*}*/
+    /* Extend the tick counter past its wraparound. Relies on being called
+     * at least once per wrap period, which any cache user easily does. */
+    static TickType_t last;
+    static uint64_t wraps;
+
+    taskENTER_CRITICAL();
+    TickType_t now = xTaskGetTickCount();
+    if (now < last)
+        wraps++;
+    last = now;
+    uint64_t ticks = (wraps << (8*sizeof(TickType_t))) + now;
+    taskEXIT_CRITICAL();
+
+    return ticks * portTICK_PERIOD_MS;
+}
+
+/**
+ * Let go of the caller's at_lock(), however deeply nested, for the length
+ * of a blocking wait, so other tasks and the worker aren't held up.
+ *
+ * @returns Nesting depth to pass to lock_restore().
+ */
+static int lock_release(struct at_freertos *priv)
+{
+    /* Succeeds right away if we hold it, or if nobody does. */
+    if (xSemaphoreTakeRecursive(priv->xMutex, 0) != pdTRUE)
+        return 0;
+
+    int depth = priv->lock_depth;
+    priv->lock_depth = 0;
+    for (int i=0; i<=depth; i++)
+        xSemaphoreGiveRecursive(priv->xMutex);
+
+    return depth;
+}
+
+static void lock_restore(struct at_freertos *priv, int depth)
+{
+    for (int i=0; i<depth; i++)
+        at_lock(&priv->at);
+}
+
+static bool wait_until(struct at_freertos *priv, at_condition_t cond, void *arg, int timeout)
+{
+    struct at *at = &priv->at;
+
+    TickType_t start = xTaskGetTickCount();
+    TickType_t ticks = pdMS_TO_TICKS(timeout);
 
+    /* Forget URCs that arrived before we started waiting. */
+    xSemaphoreTake(priv->xUrcSem, 0);
+
+    while (true) {
+        at_urc_lock(at);
+        bool done = cond && cond(arg);
+        at_urc_unlock(at);
+        if (done)
+            break;
+
+        TickType_t elapsed = xTaskGetTickCount() - start;
+        if (!priv->open || elapsed >= ticks)
+            return false;
+        if (xSemaphoreTake(priv->xUrcSem, ticks - elapsed) && !cond)
+            return true;
+    }
+
+    return true;
+}
+
+bool at_wait_until(struct at *at, at_condition_t cond, void *arg, int timeout)
+{
+    struct at_freertos *priv = (struct at_freertos *) at;
+
+    int depth = lock_release(priv);
+    bool result = wait_until(priv, cond, arg, timeout);
+    lock_restore(priv, depth);
+
+    return result;
+}
+
+void at_urc_lock(struct at *at)
+{
+    struct at_freertos *priv = (struct at_freertos *) at;
+
+    xSemaphoreTake(priv->xParserMutex, portMAX_DELAY);
+}
+
+void at_urc_unlock(struct at *at)
+{
+    struct at_freertos *priv = (struct at_freertos *) at;
+
+    xSemaphoreGive(priv->xParserMutex);
+}
+
+void at_lock(struct at *at)
+{
+    struct at_freertos *priv = (struct at_freertos *) at;
+
+    xSemaphoreTakeRecursive(priv->xMutex, portMAX_DELAY);
+    priv->lock_depth++;
+}
+
+void at_unlock(struct at *at)
+{
+    struct at_freertos *priv = (struct at_freertos *) at;
+
+    priv->lock_depth--;
+    xSemaphoreGiveRecursive(priv->xMutex);
+}
+
+/**
+ * Check whether the calling task may write to the channel now. Called with
+ * xMutex held; sets errno if not.
+ */
+static bool channel_writable(struct at_freertos *priv)
+{
     /* Bail out if the channel is closing or closed. */
     if (!priv->open) {
-        /*xSemaphoreGive(priv->xMutex);*/
+        errno = ENODEV;
+        return false;
+    }
+
+    /* Keep out of the data stream and of another task's payload. */
+    if (priv->online ||
+        (priv->payload_pending && priv->xPayloadOwner != xTaskGetCurrentTaskHandle())) {
+        errno = EBUSY;
+        return false;
+    }
+
+    priv->payload_pending = false;
+    return true;
+}
+
+static const char *_at_command(struct at_freertos *priv, const void *data, size_t size)
+{
+    at_probe3(command__start, &priv->at, data, size);
+
+    /* Wait for another task's command to finish. */
+    at_lock(&priv->at);
+
+    if (!channel_writable(priv)) {
+        priv->prompt = false;
+        at_unlock(&priv->at);
+        at_probe2(command__done, &priv->at, NULL);
         return NULL;
     }
 
-    /* Prepare parser. */
+    /* Prepare parser. The response wakes us with a task notification, so
+     * drop any left over from a command that timed out. */
+    priv->xCaller = xTaskGetCurrentTaskHandle();
+    ulTaskNotifyTakeIndexed(AT_FREERTOS_NOTIFY_INDEX, pdTRUE, 0);
+    at_urc_lock(&priv->at);
+    priv->waiting = true;
     at_parser_await_response(priv->at.parser);
+    at_urc_unlock(&priv->at);
 
     /* Send the command. */
     // FIXME: handle interrupts, short writes, errors, etc.
+    at_stats_command(&priv->at, data, size);
+    at_trace_log(&priv->at, AT_TRACE_TX, data, size);
     FreeRTOS_write(priv->xUART, data, size);
 
     /* Wait for the parser thread to collect a response. */
-    priv->waiting = true;
-    /*xSemaphoreGive(priv->xMutex);*/
-    xSemaphoreTake(priv->xSem, 0);
-    int timeout = priv->timeout;
-    while (timeout-- && priv->open && priv->waiting) {
-        if (xSemaphoreTake(priv->xSem, pdMS_TO_TICKS(1000))) {
-            break;
-        }
-    }
-
-    /*xSemaphoreTake(priv->xMutex, pdMS_TO_TICKS(1000));*/
+    TimeOut_t xTimeOut;
+    TickType_t ticks = priv->timeout ? pdMS_TO_TICKS(priv->timeout * 1000) : portMAX_DELAY;
+    vTaskSetTimeOutState(&xTimeOut);
+    while (priv->open && priv->waiting && !xTaskCheckForTimeOut(&xTimeOut, &ticks))
+        ulTaskNotifyTakeIndexed(AT_FREERTOS_NOTIFY_INDEX, pdTRUE, ticks);
+
+    /* The reader may be feeding the parser right now. */
+    at_urc_lock(&priv->at);
+    bool waiting = priv->waiting;
     const char *result;
     if (!priv->open) {
         /* The serial port was closed behind our back. */
+        errno = ENODEV;
         result = NULL;
-    } else if (priv->waiting) {
+    } else if (waiting) {
         /* Timed out waiting for a response. */
+        at_trace_log(&priv->at, AT_TRACE_TIMEOUT, "", 0);
         at_parser_reset(priv->at.parser);
+        errno = ETIMEDOUT;
         result = NULL;
     } else {
         /* Response arrived. */
         result = priv->response;
     }
+    at_urc_unlock(&priv->at);
+    at_stats_response(&priv->at, waiting);
+
+    /* The prompt completes the command with an empty response; only this
+     * task may send the payload that follows. */
+    if (priv->prompt && result && !*result) {
+        priv->payload_pending = true;
+        priv->xPayloadOwner = xTaskGetCurrentTaskHandle();
+    }
 
     /* Reset per-command settings. */
     priv->at.command_scanner = NULL;
-    /*xSemaphoreGive(priv->xMutex);*/
+    priv->online_pending = false;
+    priv->prompt = false;
+    at_unlock(&priv->at);
 
+    at_probe2(command__done, &priv->at, result);
     return result;
 }
 
@@ -243,6 +598,7 @@ const char *at_command(struct at *at, const char *format, ...)
 
     /* Bail out if we run out of space. */
     if (len >= (int)(sizeof(line)-1)) {
+        at_stats_truncated(at);
         return NULL;
     }
 
@@ -264,17 +620,41 @@ const char *at_command_raw(struct at *at, const void *data, size_t size)
     return _at_command(priv, data, size);
 }
 
+int at_defer(struct at *at, at_work_t work, void *arg)
+{
+    struct at_freertos *priv = (struct at_freertos *) at;
+
+    /* A NULL item stops the worker; see at_free(). */
+    if (!work) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Never block: this is usually called from the reader task. */
+    struct at_work item = { .work = work, .arg = arg };
+    if (xQueueSend(priv->xWork, &item, 0) != pdTRUE) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    return 0;
+}
+
 bool _at_send(struct at_freertos *priv, const void *data, size_t size)
 {
-    /* Bail out if the channel is closing or closed. */
-    if (!priv->open) {
-        /*xSemaphoreGive(priv->xMutex);*/
+    /* Don't cut into another task's command. */
+    at_lock(&priv->at);
+    if (!channel_writable(priv)) {
+        at_unlock(&priv->at);
         return false;
     }
 
     /* Send the command. */
     // FIXME: handle interrupts, short writes, errors, etc.
+    at_stats_write(&priv->at, size);
+    at_trace_log(&priv->at, AT_TRACE_TX, data, size);
     FreeRTOS_write(priv->xUART, data, size);
+    at_unlock(&priv->at);
     return true;
 }
 
@@ -291,6 +671,7 @@ bool at_send(struct at *at, const char *format, ...)
 
     /* Bail out if we run out of space. */
     if (len >= (int)(sizeof(line)-1)) {
+        at_stats_truncated(at);
         return false;
     }
 
@@ -312,6 +693,187 @@ bool at_send_raw(struct at *at, const void *data, size_t size)
     return _at_send(priv, data, size);
 }
 
+void at_expect_online(struct at *at)
+{
+    struct at_freertos *priv = (struct at_freertos *) at;
+
+    priv->online_pending = true;
+}
+
+bool at_is_online(struct at *at)
+{
+    struct at_freertos *priv = (struct at_freertos *) at;
+
+    return priv->online;
+}
+
+int at_online_read(struct at *at, void *buf, size_t len, int timeout)
+{
+    struct at_freertos *priv = (struct at_freertos *) at;
+
+    if (!priv->online) {
+        return -1;
+    }
+
+#ifdef AT_FREERTOS_RX_STREAM
+    /* Bytes that arrived along with the connect response come first. */
+    at_urc_lock(at);
+    size_t n = priv->stash_len < len ? priv->stash_len : len;
+    memcpy(buf, priv->stash, n);
+    memmove(priv->stash, priv->stash + n, priv->stash_len - n);
+    priv->stash_len -= n;
+    at_urc_unlock(at);
+    if (n > 0)
+        return n;
+
+    /* The reader task stays off the stream while we're online. */
+    int depth = lock_release(priv);
+    size_t result = xStreamBufferReceive(priv->xRxStream, buf, len, pdMS_TO_TICKS(timeout));
+    lock_restore(priv, depth);
+    at_stats_read(at, result, 0);
+    return result;
+#else
+    /* The reader task stays off the UART while we're online. Read in
+     * slices so data is handed out as soon as some arrives. */
+    FreeRTOS_ioctl(priv->xUART, ioctlSET_RX_TIMEOUT, (void*)pdMS_TO_TICKS(AT_ONLINE_READ_SLICE_MS));
+    int depth = lock_release(priv);
+    TickType_t start = xTaskGetTickCount();
+    size_t result;
+    do {
+        result = FreeRTOS_read(priv->xUART, buf, len);
+    } while (result == 0 && xTaskGetTickCount() - start < pdMS_TO_TICKS(timeout));
+    lock_restore(priv, depth);
+
+    if (result > 0)
+        at_stats_read(at, result, 0);
+    return result;
+#endif
+}
+
+int at_online_write(struct at *at, const void *data, size_t size)
+{
+    struct at_freertos *priv = (struct at_freertos *) at;
+
+    if (!priv->online) {
+        return -1;
+    }
+
+    size_t written = 0;
+    while (written < size) {
+        size_t result = FreeRTOS_write(priv->xUART, (const char *) data + written, size - written);
+        if (result == 0)
+            return -1;
+        written += result;
+    }
+    at_stats_write(at, written);
+
+    return written;
+}
+
+int at_online_escape(struct at *at)
+{
+    struct at_freertos *priv = (struct at_freertos *) at;
+
+    if (!priv->online)
+        return 0;
+
+    printf("> +++\n");
+
+    /* The escape sequence must be surrounded by silence on the line. */
+    vTaskDelay(pdMS_TO_TICKS(AT_ESCAPE_GUARD_MS));
+    FreeRTOS_write(priv->xUART, "+++", 3);
+    vTaskDelay(pdMS_TO_TICKS(AT_ESCAPE_GUARD_MS));
+
+    /* Drop whatever data was still in flight and hand the port back. */
+    char scratch[32];
+#ifdef AT_FREERTOS_RX_STREAM
+    while (xStreamBufferReceive(priv->xRxStream, scratch, sizeof(scratch), 0) > 0)
+        ;
+#else
+    FreeRTOS_ioctl(priv->xUART, ioctlSET_RX_TIMEOUT, (void*)pdMS_TO_TICKS(AT_ONLINE_READ_SLICE_MS));
+    while (FreeRTOS_read(priv->xUART, scratch, sizeof(scratch)) > 0)
+        ;
+    FreeRTOS_ioctl(priv->xUART, ioctlSET_RX_TIMEOUT, (void*)portMAX_DELAY);
+#endif
+    at_urc_lock(at);
+#ifdef AT_FREERTOS_RX_STREAM
+    priv->stash_len = 0;
+#endif
+    at_parser_reset(priv->at.parser);
+    at_urc_unlock(at);
+    priv->online = false;
+    at_trace_log(at, AT_TRACE_STATE, "offline", 7);
+    xEventGroupSetBits(priv->xEvents, AT_EVENT_OFFLINE);
+
+    /* Resynchronize; a late "OK" to the escape may complete the first probe. */
+    int timeout = priv->timeout;
+    at_set_timeout(at, 1);
+    for (int i=0; i<AT_ESCAPE_ATTEMPTS; i++) {
+        const char *response = at_command(at, "AT");
+        if (response && !strcmp(response, "")) {
+            at_set_timeout(at, timeout);
+            return 0;
+        }
+    }
+    at_set_timeout(at, timeout);
+
+    return -1;
+}
+
+#ifdef AT_FREERTOS_RX_STREAM
+size_t at_freertos_rx_from_isr(struct at *at, const void *data, size_t len,
+                               BaseType_t *pxHigherPriorityTaskWoken)
+{
+    struct at_freertos *priv = (struct at_freertos *) at;
+
+    return xStreamBufferSendFromISR(priv->xRxStream, data, len, pxHigherPriorityTaskWoken);
+}
+
+static void reader_feed(struct at_freertos *priv, const char *buf, size_t len)
+{
+    if (!priv->online_pending) {
+        at_parser_feed(priv->at.parser, buf, len);
+        return;
+    }
+
+    /* Going online must stop the parser right after the connect response;
+     * whatever follows in the chunk belongs to at_online_read(). */
+    for (size_t i=0; i<len; i++) {
+        at_parser_feed(priv->at.parser, &buf[i], 1);
+        if (priv->online) {
+            memcpy(priv->stash, &buf[i+1], len-i-1);
+            priv->stash_len = len-i-1;
+            return;
+        }
+    }
+}
+
+void at_reader_thread(void *arg)
+{
+    struct at_freertos *priv = (struct at_freertos *)arg;
+
+    while (true) {
+        /* Wait for the port descriptor to be valid and not in online mode. */
+        xEventGroupWaitBits(priv->xEvents, AT_EVENT_READER, pdFALSE, pdTRUE, portMAX_DELAY);
+
+        /* Sleep until the ISR delivers something, then take all of it. */
+        char buf[AT_FREERTOS_RX_CHUNK];
+        priv->busy = true;
+        size_t result = xStreamBufferReceive(priv->xRxStream, buf, sizeof(buf), portMAX_DELAY);
+        priv->busy = false;
+
+        /* Drop bytes that straggled in after the port was closed. */
+        if (result > 0 && priv->open) {
+            uint64_t started = stats_clock_us();
+            at_urc_lock(&priv->at);
+            reader_feed(priv, buf, result);
+            at_urc_unlock(&priv->at);
+            at_stats_read(&priv->at, result, stats_clock_us() - started);
+            reader_wake_caller(priv);
+        }
+    }
+}
+#else
 void at_reader_thread(void *arg)
 {
     struct at_freertos *priv = (struct at_freertos *)arg;
@@ -319,37 +881,57 @@ void at_reader_thread(void *arg)
 //    printf("at_reader_thread: starting\n");
 
     while (true) {
-        if (!priv->running) {
-            vTaskDelay(pdMS_TO_TICKS(200));
-            continue;
-        }
-        /* Wait for the port descriptor to be valid. */
-        else if(!priv->open) {
-            vTaskDelay(pdMS_TO_TICKS(200));
-            continue;
-        }
+        /* Wait for the port descriptor to be valid and not in online mode. */
+        xEventGroupWaitBits(priv->xEvents, AT_EVENT_READER, pdFALSE, pdTRUE, portMAX_DELAY);
 
         /* Lock access to the port descriptor. */
-        /*xSemaphoreTake(priv->xMutex, pdMS_TO_TICKS(1000));*/
         priv->busy = true;
 
-        /* Attempt to read some data. */
+        /* Sleep in the driver until a byte arrives. */
         char ch;
         int result = FreeRTOS_read(priv->xUART, &ch, 1);
 
         /* Unlock access to the port descriptor. */
         priv->busy = false;
-        /* Notify at_close() that the port is now free. */
 
-        if (result == 1) {
+        /* Drop bytes that straggled in after the port was closed. */
+        if (result == 1 && priv->open) {
             /* Data received, feed the parser. */
+            uint64_t started = stats_clock_us();
+            at_urc_lock(&priv->at);
             at_parser_feed(priv->at.parser, &ch, 1);
+            at_urc_unlock(&priv->at);
+            at_stats_read(&priv->at, 1, stats_clock_us() - started);
+            reader_wake_caller(priv);
         }
-        /*xSemaphoreGive(priv->xMutex);*/
     }
 
 //    printf("at_reader_thread: finished\n");
 
 }
+#endif
+
+static void at_worker_thread(void *arg)
+{
+    struct at_freertos *priv = (struct at_freertos *)arg;
+
+    while (true) {
+        struct at_work item;
+        if (xQueueReceive(priv->xWork, &item, portMAX_DELAY) != pdTRUE)
+            continue;
+
+        /* at_free() wants us gone; park until it deletes us. */
+        if (!item.work) {
+            xTaskNotifyGiveIndexed((TaskHandle_t) item.arg, AT_FREERTOS_NOTIFY_INDEX);
+            while (true)
+                ulTaskNotifyTakeIndexed(AT_FREERTOS_NOTIFY_INDEX, pdTRUE, portMAX_DELAY);
+        }
+
+        /* Keep the application's command sequences out of the item's. */
+        at_lock(&priv->at);
+        item.work(&priv->at, item.arg);
+        at_unlock(&priv->at);
+    }
+}
 
 /* vim: set ts=4 sw=4 et: */
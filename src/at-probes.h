@@ -0,0 +1,58 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#ifndef ATTENTIVE_AT_PROBES_H
+#define ATTENTIVE_AT_PROBES_H
+
+/*
+ * USDT (sys/sdt.h) static tracepoints, provider "attentive". Build with
+ * AT_PROBES to compile them in; each one is then a single nop until a
+ * tracer attaches, e.g.:
+ *
+ *     bpftrace -e 'usdt:./app:attentive:command__start { @t[tid] = nsecs; }
+ *                  usdt:./app:attentive:command__done /@t[tid]/ {
+ *                      @ms = hist((nsecs - @t[tid]) / 1000000); delete(@t[tid]); }'
+ *
+ * Without AT_PROBES they compile to nothing and their arguments aren't
+ * evaluated.
+ *
+ * Probes and their arguments:
+ *
+ *   command__start(at, data, size)         command written to the port
+ *   command__done(at, response)            response arrived; NULL on failure
+ *   line(arg, line, len, type)             response line classified
+ *   urc(arg, line, len)                    URC handed to the URC handler
+ *   rawdata__start(arg, size)              raw or hex payload follows
+ *   rawdata__done(arg)                     payload fully received
+ *   socket__start(op, modem, connid)       socket op entered; op is its name
+ *   socket__done(op, modem, connid, result) socket op returned
+ *
+ * "arg" is the parser's private argument, i.e. the AT channel.
+ */
+
+#ifdef AT_PROBES
+
+#include <sys/sdt.h>
+
+#define at_probe1(name, a)              DTRACE_PROBE1(attentive, name, a)
+#define at_probe2(name, a, b)           DTRACE_PROBE2(attentive, name, a, b)
+#define at_probe3(name, a, b, c)        DTRACE_PROBE3(attentive, name, a, b, c)
+#define at_probe4(name, a, b, c, d)     DTRACE_PROBE4(attentive, name, a, b, c, d)
+
+#else
+
+#define at_probe1(name, a) do {} while (0)
+#define at_probe2(name, a, b) do {} while (0)
+#define at_probe3(name, a, b, c) do {} while (0)
+#define at_probe4(name, a, b, c, d) do {} while (0)
+
+#endif
+
+#endif
+
+/* vim: set ts=4 sw=4 et: */
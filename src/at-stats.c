@@ -0,0 +1,150 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#include <attentive/at.h>
+
+#include <string.h>
+
+#include "at-stats.h"
+
+#ifdef AT_STATS
+
+static const unsigned bucket_limits_ms[AT_STATS_BUCKETS-1] = {
+    10, 30, 100, 300, 1000, 3000, 10000
+};
+
+static bool is_alpha(char c)
+{
+    return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z');
+}
+
+static bool is_alnum(char c)
+{
+    return is_alpha(c) || (c >= '0' && c <= '9');
+}
+
+/**
+ * Extract the (first) command name from a command line: "+CREG" from
+ * "AT+CREG?", "D" from "ATD*99#". Anything not starting with "AT" is data.
+ */
+static void stats_name(const char *line, size_t size, char *name)
+{
+    if (size < 2 || (line[0] != 'A' && line[0] != 'a') || (line[1] != 'T' && line[1] != 't')) {
+        strcpy(name, "raw");
+        return;
+    }
+
+    const char *p = line + 2, *end = line + size;
+    size_t len = 0;
+
+    /* Extended names run on with digits; basic ones are single letters. */
+    if (p < end && *p && strchr("+#$%*^", *p)) {
+        name[len++] = *p++;
+        while (p < end && is_alnum(*p) && len < AT_STATS_NAME_LENGTH-1)
+            name[len++] = *p++;
+    } else {
+        if (p < end && *p == '&')
+            name[len++] = *p++;
+        if (p < end && is_alpha(*p))
+            name[len++] = *p++;
+    }
+
+    name[len] = '\0';
+    if (len == 0)
+        strcpy(name, "AT");
+}
+
+static struct at_latency *stats_slot(struct at *at, const char *name)
+{
+    struct at_latency *slots = at->stats.latency;
+
+    for (int i=0; i<AT_STATS_COMMANDS-1; i++) {
+        if (!slots[i].name[0])
+            strcpy(slots[i].name, name);
+        if (!strcmp(slots[i].name, name))
+            return &slots[i];
+    }
+
+    /* Out of slots. */
+    strcpy(slots[AT_STATS_COMMANDS-1].name, "*");
+    return &slots[AT_STATS_COMMANDS-1];
+}
+
+void at_stats_command(struct at *at, const void *data, size_t size)
+{
+    char name[AT_STATS_NAME_LENGTH];
+    stats_name(data, size, name);
+
+    at->stats.commands++;
+    at->stats.bytes_out += size;
+    at->stats_pending = stats_slot(at, name);
+    at->stats_sent = at_monotonic_ms();
+}
+
+void at_stats_response(struct at *at, bool timeout)
+{
+    struct at_latency *slot = at->stats_pending;
+    if (!slot)
+        return;
+    at->stats_pending = NULL;
+
+    if (timeout) {
+        at->stats.timeouts++;
+        return;
+    }
+
+    unsigned ms = at_monotonic_ms() - at->stats_sent;
+    int bucket = 0;
+    while (bucket < AT_STATS_BUCKETS-1 && ms >= bucket_limits_ms[bucket])
+        bucket++;
+
+    slot->count++;
+    slot->buckets[bucket]++;
+    slot->total_ms += ms;
+    if (ms > slot->max_ms)
+        slot->max_ms = ms;
+}
+
+void at_stats_truncated(struct at *at)
+{
+    at->stats.truncations++;
+}
+
+void at_stats_write(struct at *at, size_t size)
+{
+    at->stats.writes++;
+    at->stats.bytes_out += size;
+}
+
+void at_stats_read(struct at *at, size_t size, uint64_t parser_us)
+{
+    at->stats.bytes_in += size;
+    at->stats.parser_us += parser_us;
+}
+
+void at_stats_urc(struct at *at)
+{
+    at->stats.urcs++;
+}
+
+void at_stats_snapshot(struct at *at, struct at_stats *stats)
+{
+    *stats = at->stats;
+    stats->truncations += at_parser_truncations(at->parser) - at->stats_truncations;
+}
+
+void at_stats_reset(struct at *at)
+{
+    memset(&at->stats, 0, sizeof(at->stats));
+    at->stats_pending = NULL;
+    at->stats_truncations = at_parser_truncations(at->parser);
+}
+
+#endif
+
+/* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,47 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#ifndef ATTENTIVE_AT_STATS_H
+#define ATTENTIVE_AT_STATS_H
+
+#include <attentive/at.h>
+
+/*
+ * Statistics hooks for the platform implementations. They compile to nothing
+ * unless AT_STATS is defined.
+ */
+
+#ifdef AT_STATS
+
+/** A command is being sent; starts its latency measurement. */
+void at_stats_command(struct at *at, const void *data, size_t size);
+/** The command in flight got its response, or timed out. */
+void at_stats_response(struct at *at, bool timeout);
+/** A command didn't fit into the command line buffer. */
+void at_stats_truncated(struct at *at);
+/** Bytes written outside of commands. */
+void at_stats_write(struct at *at, size_t size);
+/** Bytes read and the time it took to parse them. */
+void at_stats_read(struct at *at, size_t size, uint64_t parser_us);
+/** A URC was handled. */
+void at_stats_urc(struct at *at);
+
+#else
+
+#define at_stats_command(at, data, size) do {} while (0)
+#define at_stats_response(at, timeout) do {} while (0)
+#define at_stats_truncated(at) do {} while (0)
+#define at_stats_write(at, size) do {} while (0)
+#define at_stats_read(at, size, parser_us) ((void) (parser_us))
+#define at_stats_urc(at) do {} while (0)
+
+#endif
+
+#endif
+
+/* vim: set ts=4 sw=4 et: */
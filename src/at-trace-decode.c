@@ -0,0 +1,71 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+/*
+ * Decode a raw dump of a struct at_trace, e.g. one taken from target RAM
+ * with "dump binary memory trace.bin &trace ((char *) &trace)+sizeof(trace)"
+ * in gdb. The dump must come from a target with the same endianness.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <attentive/trace.h>
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <trace dump>\n", argv[0]);
+        return 2;
+    }
+
+    FILE *f = fopen(argv[1], "rb");
+    if (!f) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    /* Read the header, then the ring of whatever size the target used. */
+    struct at_trace header;
+    size_t offset = offsetof(struct at_trace, events);
+    if (fread(&header, offset, 1, f) != 1 || header.magic != AT_TRACE_MAGIC ||
+        header.event_size != sizeof(struct at_trace_event) || header.entries == 0)
+    {
+        fprintf(stderr, "%s: not a trace dump\n", argv[1]);
+        return 1;
+    }
+
+    size_t size = offset + header.entries * sizeof(struct at_trace_event);
+    struct at_trace *trace = malloc(size);
+    struct at_trace_event *events = malloc(header.entries * sizeof(struct at_trace_event));
+    if (!trace || !events) {
+        perror("malloc");
+        return 1;
+    }
+    memcpy(trace, &header, offset);
+    if (fread(trace->events, sizeof(struct at_trace_event), header.entries, f) != header.entries) {
+        fprintf(stderr, "%s: truncated dump\n", argv[1]);
+        return 1;
+    }
+    fclose(f);
+
+    size_t count = at_trace_dump(trace, events, header.entries);
+    printf("%zu events, %u recorded in total\n", count, (unsigned) trace->head);
+    for (size_t i=0; i<count; i++) {
+        char line[5*AT_TRACE_DATA + 64];
+        at_trace_format(&events[i], line, sizeof(line));
+        printf("%s\n", line);
+    }
+
+    free(events);
+    free(trace);
+    return 0;
+}
+
+/* vim: set ts=4 sw=4 et: */
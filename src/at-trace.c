@@ -0,0 +1,119 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#include <attentive/trace.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef AT_TRACE
+#include <attentive/at.h>
+
+void at_trace_attach(struct at *at, struct at_trace *trace)
+{
+    at->trace = trace;
+}
+#endif
+
+static const char *const type_names[] = {
+    [AT_TRACE_TX] = "TX",
+    [AT_TRACE_RX] = "RX",
+    [AT_TRACE_URC] = "URC",
+    [AT_TRACE_STATE] = "STATE",
+    [AT_TRACE_TIMEOUT] = "TIMEOUT",
+};
+
+void at_trace_init(struct at_trace *trace)
+{
+    memset(trace, 0, sizeof(*trace));
+    trace->entries = AT_TRACE_ENTRIES;
+    trace->event_size = sizeof(struct at_trace_event);
+    trace->magic = AT_TRACE_MAGIC;
+}
+
+void at_trace_record(struct at_trace *trace, enum at_trace_type type,
+                     const void *data, size_t size, uint32_t timestamp)
+{
+    /* Claim a slot. Writers never wait for each other. */
+    uint32_t seq = __atomic_fetch_add(&trace->head, 1, __ATOMIC_RELAXED);
+    struct at_trace_event *event = &trace->events[seq % AT_TRACE_ENTRIES];
+
+    /* Mark the slot torn until it's complete; see at_trace_dump(). */
+    __atomic_store_n(&event->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    event->timestamp = timestamp;
+    event->type = type;
+    event->len = size < AT_TRACE_DATA ? size : AT_TRACE_DATA;
+    event->size = size < UINT16_MAX ? size : UINT16_MAX;
+    memcpy(event->data, data, event->len);
+
+    __atomic_store_n(&event->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+size_t at_trace_dump(const struct at_trace *trace, struct at_trace_event *events, size_t max)
+{
+    /* Dumps may come from another build; trust the header, not the macros. */
+    uint32_t entries = trace->entries;
+    uint32_t head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+    uint32_t first = head > entries ? head - entries : 0;
+    if (head - first > max)
+        first = head - max;
+
+    size_t count = 0;
+    for (uint32_t seq = first; seq != head; seq++) {
+        const struct at_trace_event *slot = &trace->events[seq % entries];
+
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq + 1)
+            continue;
+        memcpy(&events[count], slot, sizeof(*slot));
+
+        /* Overwritten while we were copying? */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq + 1)
+            continue;
+
+        count++;
+    }
+
+    return count;
+}
+
+int at_trace_format(const struct at_trace_event *event, char *buf, size_t len)
+{
+    const char *type = "?";
+    if (event->type < sizeof(type_names)/sizeof(*type_names) && type_names[event->type])
+        type = type_names[event->type];
+
+    size_t used = snprintf(buf, len, "%10u.%03u %-7s ",
+                           (unsigned) (event->timestamp / 1000),
+                           (unsigned) (event->timestamp % 1000), type);
+
+    /* Escape the payload; stop early rather than overrun. */
+    for (int i=0; i<event->len && used+5 < len; i++) {
+        unsigned char c = event->data[i];
+        if (c == '\r')
+            used += sprintf(buf + used, "\\r");
+        else if (c == '\n')
+            used += sprintf(buf + used, "\\n");
+        else if (c < 0x20 || c >= 0x7f || c == '\\')
+            used += sprintf(buf + used, "\\x%02x", c);
+        else
+            buf[used++] = c;
+    }
+    if (used < len)
+        buf[used] = '\0';
+
+    if (event->size > event->len)
+        used += snprintf(used < len ? buf + used : NULL, used < len ? len - used : 0,
+                         " [+%u bytes]", event->size - event->len);
+
+    return used;
+}
+
+/* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,31 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#ifndef ATTENTIVE_AT_TRACE_H
+#define ATTENTIVE_AT_TRACE_H
+
+#include <attentive/at.h>
+
+/*
+ * Trace hook for the platform implementations. Compiles to nothing unless
+ * AT_TRACE is defined.
+ */
+
+#ifdef AT_TRACE
+#define at_trace_log(at, type, data, size)                                  \
+    do {                                                                    \
+        if ((at)->trace)                                                    \
+            at_trace_record((at)->trace, type, data, size, at_monotonic_ms()); \
+    } while (0)
+#else
+#define at_trace_log(at, type, data, size) do {} while (0)
+#endif
+
+#endif
+
+/* vim: set ts=4 sw=4 et: */
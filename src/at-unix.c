@@ -7,9 +7,11 @@
  */
 
 #include <attentive/at.h>
+#include <attentive/at-unix.h>
 
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
@@ -24,9 +26,20 @@
 #include <sys/time.h>
 #endif
 
+#include "at-probes.h"
+#include "at-stats.h"
+#include "at-trace.h"
+
 // Remove once you refactor this out.
 #define AT_COMMAND_LENGTH 80
 
+/* "+++" escape guard time, with some margin on top of the usual S12=50. */
+#define AT_ESCAPE_GUARD_MS 1100
+#define AT_ESCAPE_ATTEMPTS 3
+
+/* Bytes read from the port in one go. */
+#define AT_READ_CHUNK 64
+
 struct at_unix {
     struct at at;
 
@@ -45,9 +58,36 @@ struct at_unix {
     bool open : 1;          /**< FD is valid. Set/cleared by open()/close(). */
     bool busy : 1;          /**< FD is in use. Set/cleared by reader thread. */
     bool waiting : 1;       /**< Waiting for response callback to arrive. */
+    bool online_pending : 1;/**< Go online when the next response arrives. */
+    bool online : 1;        /**< Online data mode; reader keeps off the FD. */
+    unsigned urc_seq;       /**< Bumped on every URC; see at_wait_until(). */
+
+    char stash[AT_READ_CHUNK];  /**< Data read past the online switch. */
+    size_t stash_len;
+
+    pthread_mutex_t command_mutex;  /**< Recursive; see at_lock(). */
+    int lock_depth;                 /**< at_lock() nesting; guarded by command_mutex. */
+    bool prompt;                    /**< Current command expects a dataprompt. */
+    bool payload_pending;           /**< Got a dataprompt; payload_owner sends next. */
+    pthread_t payload_owner;
+
+    /* Deferred work; see at_defer(). */
+    pthread_t worker;               /**< Worker thread. */
+    pthread_mutex_t work_mutex;     /**< Protects the queue; never held while working. */
+    pthread_cond_t work_cond;       /**< Signalled on new work and on shutdown. */
+    struct at_work work[AT_WORK_QUEUE];
+    unsigned work_head;             /**< Next item to run. */
+    unsigned work_count;            /**< Items queued. */
+    bool work_running;              /**< Worker thread should be running. */
+
+    bool allocated;         /**< Created by at_alloc_unix(); at_free() frees it. */
 };
 
+/* Fail the build if AT_UNIX_SIZE is too small. */
+typedef char at_unix_size_check[sizeof(struct at_unix) <= AT_UNIX_SIZE ? 1 : -1];
+
 void *at_reader_thread(void *arg);
+static void *at_worker_thread(void *arg);
 
 static void handle_sigusr1(int signal)
 {
@@ -59,19 +99,36 @@ static void handle_response(const char *buf, size_t len, void *arg)
     struct at_unix *priv = (struct at_unix *) arg;
 
     /* The mutex is held by the reader thread; don't reacquire. */
+    at_trace_log(&priv->at, AT_TRACE_RX, buf, len);
     priv->response = buf;
-    (void) len;
     priv->waiting = false;
-    pthread_cond_signal(&priv->cond);
+
+    /* Stop the reader right after a successful connect response. */
+    if (priv->online_pending) {
+        priv->online_pending = false;
+        priv->online = (len == 0);
+        if (priv->online)
+            at_trace_log(&priv->at, AT_TRACE_STATE, "online", 6);
+    }
+
+    pthread_cond_broadcast(&priv->cond);
 }
 
 static void handle_urc(const char *buf, size_t len, void *arg)
 {
-    struct at *at = (struct at *) arg;
+    struct at_unix *priv = (struct at_unix *) arg;
+    struct at *at = &priv->at;
+
+    at_trace_log(at, AT_TRACE_URC, buf, len);
 
     /* Forward to caller's URC callback, if any. */
-    if (at->cbs->handle_urc)
+    if (at->cbs && at->cbs->handle_urc)
         at->cbs->handle_urc(buf, len, at->arg);
+
+    /* Let at_wait_until() callers re-check their conditions. */
+    at_stats_urc(at);
+    priv->urc_seq++;
+    pthread_cond_broadcast(&priv->cond);
 }
 
 enum at_response_type scan_line(const char *line, size_t len, void *arg)
@@ -92,6 +149,36 @@ static const struct at_parser_callbacks parser_callbacks = {
     .scan_line = scan_line,
 };
 
+static void at_unix_start(struct at_unix *priv, const char *devpath, speed_t baudrate)
+{
+    /* copy over device parameters */
+    priv->devpath = devpath;
+    priv->baudrate = baudrate;
+
+    /* install empty SIGUSR1 handler */
+    struct sigaction sa = {
+        .sa_handler = handle_sigusr1,
+    };
+    sigaction(SIGUSR1, &sa, NULL);
+
+    /* initialize and start reader thread */
+    priv->running = true;
+    pthread_mutex_init(&priv->mutex, NULL);
+    pthread_cond_init(&priv->cond, NULL);
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&priv->command_mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    pthread_create(&priv->thread, NULL, at_reader_thread, (void *) priv);
+
+    /* start deferred work thread */
+    priv->work_running = true;
+    pthread_mutex_init(&priv->work_mutex, NULL);
+    pthread_cond_init(&priv->work_cond, NULL);
+    pthread_create(&priv->worker, NULL, at_worker_thread, (void *) priv);
+}
+
 struct at *at_alloc_unix(const char *devpath, speed_t baudrate)
 {
     /* allocate instance */
@@ -101,6 +188,7 @@ struct at *at_alloc_unix(const char *devpath, speed_t baudrate)
         return NULL;
     }
     memset(priv, 0, sizeof(struct at_unix));
+    priv->allocated = true;
 
     /* allocate underlying parser */
     priv->at.parser = at_parser_alloc(&parser_callbacks, 256, (void *) priv);
@@ -109,21 +197,19 @@ struct at *at_alloc_unix(const char *devpath, speed_t baudrate)
         return NULL;
     }
 
-    /* copy over device parameters */
-    priv->devpath = devpath;
-    priv->baudrate = baudrate;
+    at_unix_start(priv, devpath, baudrate);
 
-    /* install empty SIGUSR1 handler */
-    struct sigaction sa = {
-        .sa_handler = handle_sigusr1,
-    };
-    sigaction(SIGUSR1, &sa, NULL);
+    return (struct at *) priv;
+}
 
-    /* initialize and start reader thread */
-    priv->running = true;
-    pthread_mutex_init(&priv->mutex, NULL);
-    pthread_cond_init(&priv->cond, NULL);
-    pthread_create(&priv->thread, NULL, at_reader_thread, (void *) priv);
+struct at *at_init_unix(void *storage, void *parser, char *buf, size_t bufsize,
+                        const char *devpath, speed_t baudrate)
+{
+    struct at_unix *priv = storage;
+    memset(priv, 0, sizeof(struct at_unix));
+
+    priv->at.parser = at_parser_init(parser, &parser_callbacks, buf, bufsize, (void *) priv);
+    at_unix_start(priv, devpath, baudrate);
 
     return (struct at *) priv;
 }
@@ -152,7 +238,8 @@ int at_open(struct at *at)
     }
 
     priv->open = true;
-    pthread_cond_signal(&priv->cond);
+    at_trace_log(at, AT_TRACE_STATE, "open", 4);
+    pthread_cond_broadcast(&priv->cond);
     pthread_mutex_unlock(&priv->mutex);
 
     return 0;
@@ -169,7 +256,11 @@ int at_close(struct at *at)
     }
 
     /* Mark the port descriptor as invalid. */
+    at_trace_log(at, AT_TRACE_STATE, "close", 5);
     priv->open = false;
+    priv->online_pending = false;
+    priv->online = false;
+    priv->stash_len = 0;
 
     /* Interrupt read() in the reader thread. */
     pthread_kill(priv->thread, SIGUSR1);
@@ -193,6 +284,16 @@ void at_free(struct at *at)
     /* make sure the channel is closed */
     at_close(at);
 
+    /* stop the worker after its current item; pending work is dropped */
+    pthread_mutex_lock(&priv->work_mutex);
+    priv->work_running = false;
+    pthread_cond_signal(&priv->work_cond);
+    pthread_mutex_unlock(&priv->work_mutex);
+    pthread_join(priv->worker, NULL);
+    pthread_cond_destroy(&priv->work_cond);
+    pthread_mutex_destroy(&priv->work_mutex);
+    pthread_mutex_destroy(&priv->command_mutex);
+
     /* ask the reader thread to terminate */
     pthread_mutex_lock(&priv->mutex);
     priv->running = false;
@@ -205,8 +306,10 @@ void at_free(struct at *at)
     pthread_mutex_destroy(&priv->mutex);
 
     /* free up resources */
-    free(priv->at.parser);
-    free(priv);
+    if (priv->allocated) {
+        at_parser_free(priv->at.parser);
+        free(priv);
+    }
 }
 
 void at_set_callbacks(struct at *at, const struct at_callbacks *cbs, void *arg)
@@ -229,17 +332,176 @@ void at_set_timeout(struct at *at, int timeout)
 
 void at_expect_dataprompt(struct at *at)
 {
+    struct at_unix *priv = (struct at_unix *) at;
+
+    priv->prompt = true;
     at_parser_expect_dataprompt(at->parser);
 }
 
-static const char *_at_command(struct at_unix *priv, const void *data, size_t size)
+void at_set_rawdata_sink(struct at *at, at_rawdata_sink_t sink, void *arg)
 {
+    at_parser_set_rawdata_sink(at->parser, sink, arg);
+}
+
+/**
+ * Compute an absolute pthread_cond_timedwait() deadline.
+ */
+static void deadline_after(struct timespec *ts, int timeout)
+{
+#if _POSIX_TIMERS > 0
+    clock_gettime(CLOCK_REALTIME, ts);
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    ts->tv_sec = tv.tv_sec;
+    ts->tv_nsec = tv.tv_usec * 1000;
+#endif
+    ts->tv_sec += timeout / 1000;
+    ts->tv_nsec += (timeout % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec += 1;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+uint64_t at_monotonic_ms(void)
+{
+#if _POSIX_TIMERS > 0
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#endif
+}
+
+#ifdef AT_STATS
+static uint64_t stats_clock_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+#else
+#define stats_clock_us() 0
+#endif
+
+/**
+ * Let go of the caller's at_lock(), however deeply nested, for the length
+ * of a blocking wait, so other threads and the worker aren't held up.
+ *
+ * @returns Nesting depth to pass to lock_restore().
+ */
+static int lock_release(struct at_unix *priv)
+{
+    /* Succeeds right away if we hold it, or if nobody does. */
+    if (pthread_mutex_trylock(&priv->command_mutex) != 0)
+        return 0;
+
+    int depth = priv->lock_depth;
+    priv->lock_depth = 0;
+    for (int i=0; i<=depth; i++)
+        pthread_mutex_unlock(&priv->command_mutex);
+
+    return depth;
+}
+
+static void lock_restore(struct at_unix *priv, int depth)
+{
+    for (int i=0; i<depth; i++)
+        at_lock(&priv->at);
+}
+
+bool at_wait_until(struct at *at, at_condition_t cond, void *arg, int timeout)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    struct timespec ts;
+    deadline_after(&ts, timeout);
+    int depth = lock_release(priv);
+
     pthread_mutex_lock(&priv->mutex);
+    unsigned seq = priv->urc_seq;
+    bool result;
+    while (!(result = (cond ? cond(arg) : priv->urc_seq != seq)) && priv->open) {
+        if (pthread_cond_timedwait(&priv->cond, &priv->mutex, &ts) == ETIMEDOUT) {
+            result = (cond ? cond(arg) : priv->urc_seq != seq);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&priv->mutex);
+    lock_restore(priv, depth);
+
+    return result;
+}
+
+void at_urc_lock(struct at *at)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    /* The reader holds the mutex while feeding the parser. */
+    pthread_mutex_lock(&priv->mutex);
+}
 
+void at_urc_unlock(struct at *at)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    pthread_mutex_unlock(&priv->mutex);
+}
+
+void at_lock(struct at *at)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    pthread_mutex_lock(&priv->command_mutex);
+    priv->lock_depth++;
+}
+
+void at_unlock(struct at *at)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    priv->lock_depth--;
+    pthread_mutex_unlock(&priv->command_mutex);
+}
+
+/**
+ * Check that this thread may write to the channel. Call with at_lock() and
+ * priv->mutex held; sets errno if not.
+ */
+static bool channel_writable(struct at_unix *priv)
+{
     /* Bail out if the channel is closing or closed. */
     if (!priv->open) {
-        pthread_mutex_unlock(&priv->mutex);
         errno = ENODEV;
+        return false;
+    }
+
+    /* Keep out of the data stream and of another thread's payload. */
+    if (priv->online ||
+        (priv->payload_pending && !pthread_equal(priv->payload_owner, pthread_self()))) {
+        errno = EBUSY;
+        return false;
+    }
+
+    priv->payload_pending = false;
+    return true;
+}
+
+static const char *_at_command(struct at_unix *priv, const void *data, size_t size)
+{
+    at_probe3(command__start, &priv->at, data, size);
+    at_lock(&priv->at);
+    pthread_mutex_lock(&priv->mutex);
+
+    if (!channel_writable(priv)) {
+        priv->prompt = false;
+        pthread_mutex_unlock(&priv->mutex);
+        at_unlock(&priv->at);
+        at_probe2(command__done, &priv->at, NULL);
         return NULL;
     }
 
@@ -248,21 +510,15 @@ static const char *_at_command(struct at_unix *priv, const void *data, size_t si
 
     /* Send the command. */
     // FIXME: handle interrupts, short writes, errors, etc.
+    at_stats_command(&priv->at, data, size);
+    at_trace_log(&priv->at, AT_TRACE_TX, data, size);
     write(priv->fd, data, size);
 
     /* Wait for the parser thread to collect a response. */
     priv->waiting = true;
     if (priv->timeout) {
         struct timespec ts;
-#if _POSIX_TIMERS > 0
-        clock_gettime(CLOCK_REALTIME, &ts);
-#else
-        struct timeval tv;
-        gettimeofday(&tv, NULL);
-        ts.tv_sec = tv.tv_sec;
-        ts.tv_nsec = tv.tv_usec * 1000;
-#endif
-        ts.tv_sec += priv->timeout;
+        deadline_after(&ts, priv->timeout * 1000);
 
         while (priv->open && priv->waiting)
             if (pthread_cond_timedwait(&priv->cond, &priv->mutex, &ts) == ETIMEDOUT)
@@ -279,6 +535,7 @@ static const char *_at_command(struct at_unix *priv, const void *data, size_t si
         result = NULL;
     } else if (priv->waiting) {
         /* Timed out waiting for a response. */
+        at_trace_log(&priv->at, AT_TRACE_TIMEOUT, "", 0);
         at_parser_reset(priv->at.parser);
         errno = ETIMEDOUT;
         result = NULL;
@@ -286,12 +543,24 @@ static const char *_at_command(struct at_unix *priv, const void *data, size_t si
         /* Response arrived. */
         result = priv->response;
     }
+    at_stats_response(&priv->at, priv->waiting);
+
+    /* The prompt completes the command with an empty response; only this
+     * thread may send the payload that follows. */
+    if (priv->prompt && result && !*result) {
+        priv->payload_pending = true;
+        priv->payload_owner = pthread_self();
+    }
 
     /* Reset per-command settings. */
     priv->at.command_scanner = NULL;
+    priv->online_pending = false;
+    priv->prompt = false;
 
     pthread_mutex_unlock(&priv->mutex);
+    at_unlock(&priv->at);
 
+    at_probe2(command__done, &priv->at, result);
     return result;
 }
 
@@ -308,6 +577,7 @@ const char *at_command(struct at *at, const char *format, ...)
 
     /* Bail out if we run out of space. */
     if (len >= (int)(sizeof(line)-1)) {
+        at_stats_truncated(at);
         errno = ENOMEM;
         return NULL;
     }
@@ -330,6 +600,228 @@ const char *at_command_raw(struct at *at, const void *data, size_t size)
     return _at_command(priv, data, size);
 }
 
+static bool _at_send(struct at_unix *priv, const void *data, size_t size)
+{
+    /* Don't cut into another thread's command. */
+    at_lock(&priv->at);
+    pthread_mutex_lock(&priv->mutex);
+    if (!channel_writable(priv)) {
+        pthread_mutex_unlock(&priv->mutex);
+        at_unlock(&priv->at);
+        return false;
+    }
+    pthread_mutex_unlock(&priv->mutex);
+
+    /* Send the command. */
+    // FIXME: handle interrupts, short writes, errors, etc.
+    at_stats_write(&priv->at, size);
+    at_trace_log(&priv->at, AT_TRACE_TX, data, size);
+    write(priv->fd, data, size);
+    at_unlock(&priv->at);
+    return true;
+}
+
+bool at_send(struct at *at, const char *format, ...)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    /* Build command string. */
+    va_list ap;
+    va_start(ap, format);
+    char line[AT_COMMAND_LENGTH];
+    int len = vsnprintf(line, sizeof(line)-1, format, ap);
+    va_end(ap);
+
+    /* Bail out if we run out of space. */
+    if (len >= (int)(sizeof(line)-1)) {
+        at_stats_truncated(at);
+        errno = ENOMEM;
+        return false;
+    }
+
+    printf("> %s\n", line);
+
+    /* Append modem-style newline. */
+    line[len++] = '\r';
+
+    /* Send the command. */
+    return _at_send(priv, line, len);
+}
+
+bool at_send_raw(struct at *at, const void *data, size_t size)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    printf("> [%zu bytes]\n", size);
+
+    return _at_send(priv, data, size);
+}
+
+int at_defer(struct at *at, at_work_t work, void *arg)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    /* Takes its own lock: URC handlers run with priv->mutex held. */
+    pthread_mutex_lock(&priv->work_mutex);
+    if (priv->work_count == AT_WORK_QUEUE) {
+        pthread_mutex_unlock(&priv->work_mutex);
+        errno = ENOSPC;
+        return -1;
+    }
+    struct at_work *item = &priv->work[(priv->work_head + priv->work_count++) % AT_WORK_QUEUE];
+    item->work = work;
+    item->arg = arg;
+    pthread_cond_signal(&priv->work_cond);
+    pthread_mutex_unlock(&priv->work_mutex);
+
+    return 0;
+}
+
+void at_expect_online(struct at *at)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    pthread_mutex_lock(&priv->mutex);
+    priv->online_pending = true;
+    pthread_mutex_unlock(&priv->mutex);
+}
+
+bool at_is_online(struct at *at)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    pthread_mutex_lock(&priv->mutex);
+    bool online = priv->online;
+    pthread_mutex_unlock(&priv->mutex);
+
+    return online;
+}
+
+int at_online_read(struct at *at, void *buf, size_t len, int timeout)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    pthread_mutex_lock(&priv->mutex);
+    if (!priv->online) {
+        pthread_mutex_unlock(&priv->mutex);
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    /* Hand out data the reader thread consumed past the online switch. */
+    if (priv->stash_len > 0) {
+        size_t amount = len < priv->stash_len ? len : priv->stash_len;
+        memcpy(buf, priv->stash, amount);
+        memmove(priv->stash, priv->stash + amount, priv->stash_len - amount);
+        priv->stash_len -= amount;
+        pthread_mutex_unlock(&priv->mutex);
+        return amount;
+    }
+    pthread_mutex_unlock(&priv->mutex);
+
+    /* The reader thread stays off the descriptor while we're online. */
+    struct pollfd pfd = {
+        .fd = priv->fd,
+        .events = POLLIN,
+    };
+    int depth = lock_release(priv);
+    int result = poll(&pfd, 1, timeout);
+    lock_restore(priv, depth);
+    if (result <= 0)
+        return result;
+
+    result = read(priv->fd, buf, len);
+    if (result > 0)
+        at_stats_read(at, result, 0);
+    return result;
+}
+
+int at_online_write(struct at *at, const void *data, size_t size)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    if (!at_is_online(at)) {
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    size_t written = 0;
+    while (written < size) {
+        ssize_t result = write(priv->fd, (const char *) data + written, size - written);
+        if (result == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        written += result;
+    }
+    at_stats_write(at, written);
+
+    return written;
+}
+
+int at_online_escape(struct at *at)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    if (!at_is_online(at))
+        return 0;
+
+    printf("> +++\n");
+
+    /* The escape sequence must be surrounded by silence on the line. */
+    usleep(AT_ESCAPE_GUARD_MS * 1000);
+    write(priv->fd, "+++", 3);
+    usleep(AT_ESCAPE_GUARD_MS * 1000);
+
+    /* Drop whatever data was still in flight and hand the port back. */
+    pthread_mutex_lock(&priv->mutex);
+    tcflush(priv->fd, TCIFLUSH);
+    at_parser_reset(priv->at.parser);
+    priv->stash_len = 0;
+    priv->online = false;
+    pthread_cond_broadcast(&priv->cond);
+    at_trace_log(at, AT_TRACE_STATE, "offline", 7);
+    pthread_mutex_unlock(&priv->mutex);
+
+    /* Resynchronize; a late "OK" to the escape may complete the first probe. */
+    int timeout = priv->timeout;
+    at_set_timeout(at, 1);
+    for (int i=0; i<AT_ESCAPE_ATTEMPTS; i++) {
+        const char *response = at_command(at, "AT");
+        if (response && !strcmp(response, "")) {
+            at_set_timeout(at, timeout);
+            return 0;
+        }
+    }
+    at_set_timeout(at, timeout);
+
+    errno = ETIMEDOUT;
+    return -1;
+}
+
+/**
+ * Feed received data to the parser. If a response switches the channel to
+ * online mode midway, the rest of the chunk is kept for at_online_read().
+ * Called with the mutex held.
+ */
+static void reader_feed(struct at_unix *priv, const char *buf, size_t len)
+{
+    if (!priv->online_pending) {
+        at_parser_feed(priv->at.parser, buf, len);
+        return;
+    }
+
+    for (size_t i=0; i<len; i++) {
+        at_parser_feed(priv->at.parser, buf+i, 1);
+        if (priv->online) {
+            priv->stash_len = len-i-1;
+            memcpy(priv->stash, buf+i+1, priv->stash_len);
+            break;
+        }
+    }
+}
+
 void *at_reader_thread(void *arg)
 {
     struct at_unix *priv = (struct at_unix *)arg;
@@ -339,8 +831,8 @@ void *at_reader_thread(void *arg)
     while (true) {
         pthread_mutex_lock(&priv->mutex);
 
-        /* Wait for the port descriptor to be valid. */
-        while (priv->running && !priv->open)
+        /* Wait for the port descriptor to be valid and not in online mode. */
+        while (priv->running && (!priv->open || priv->online))
             pthread_cond_wait(&priv->cond, &priv->mutex);
 
         if (!priv->running) {
@@ -354,21 +846,23 @@ void *at_reader_thread(void *arg)
         pthread_mutex_unlock(&priv->mutex);
 
         /* Attempt to read some data. */
-        char ch;
-        int result = read(priv->fd, &ch, 1);
+        char buf[AT_READ_CHUNK];
+        int result = read(priv->fd, buf, sizeof(buf));
         int why = errno;
 
         pthread_mutex_lock(&priv->mutex);
         /* Unlock access to the port descriptor. */
         priv->busy = false;
         /* Notify at_close() that the port is now free. */
-        pthread_cond_signal(&priv->cond);
+        pthread_cond_broadcast(&priv->cond);
         pthread_mutex_unlock(&priv->mutex);
 
-        if (result == 1) {
+        if (result > 0) {
             /* Data received, feed the parser. */
             pthread_mutex_lock(&priv->mutex);
-            at_parser_feed(priv->at.parser, &ch, 1);
+            uint64_t started = stats_clock_us();
+            reader_feed(priv, buf, result);
+            at_stats_read(&priv->at, result, stats_clock_us() - started);
             pthread_mutex_unlock(&priv->mutex);
         } else if (result == -1) {
             printf("at_reader_thread[%s]: %s\n", priv->devpath, strerror(why));
@@ -387,4 +881,33 @@ void *at_reader_thread(void *arg)
     return NULL;
 }
 
+static void *at_worker_thread(void *arg)
+{
+    struct at_unix *priv = (struct at_unix *)arg;
+
+    while (true) {
+        pthread_mutex_lock(&priv->work_mutex);
+
+        while (priv->work_running && priv->work_count == 0)
+            pthread_cond_wait(&priv->work_cond, &priv->work_mutex);
+
+        if (!priv->work_running) {
+            pthread_mutex_unlock(&priv->work_mutex);
+            break;
+        }
+
+        struct at_work item = priv->work[priv->work_head];
+        priv->work_head = (priv->work_head + 1) % AT_WORK_QUEUE;
+        priv->work_count--;
+        pthread_mutex_unlock(&priv->work_mutex);
+
+        /* Keep the application's command sequences out of the item's. */
+        at_lock(&priv->at);
+        item.work(&priv->at, item.arg);
+        at_unlock(&priv->at);
+    }
+
+    return NULL;
+}
+
 /* vim: set ts=4 sw=4 et: */
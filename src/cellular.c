@@ -23,8 +23,15 @@ int cellular_attach(struct cellular *modem, struct at *at, const char *apn)
 
     /* Reset PDP failure counters. */
     cellular_pdp_success(modem);
+    modem->pdp_state = CELLULAR_PDP_UNKNOWN;
 
-    return modem->ops->attach ? modem->ops->attach(modem) : 0;
+    uint64_t start = at_monotonic_ms();
+    modem->attach_changed = 0;
+    int result = modem->ops->attach ? modem->ops->attach(modem) : 0;
+    modem->attach_ms = at_monotonic_ms() - start;
+    printf("attach: %d ms, %d settings changed\n", modem->attach_ms, modem->attach_changed);
+
+    return result;
 }
 
 int cellular_detach(struct cellular *modem)
@@ -6,9 +6,14 @@
  * published by Sam Hocevar. See the COPYING file for more details.
  */
 
+/* For struct timespec and gmtime_r(). */
+#define _POSIX_C_SOURCE 200112L
+
 #include <attentive/cellular.h>
 
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "at-common.h"
@@ -18,6 +23,17 @@
 #define PDP_RETRY_THRESHOLD_INITIAL     3
 #define PDP_RETRY_THRESHOLD_MULTIPLIER  2
 
+#define ACK_POLL_INTERVAL_INITIAL       50
+#define ACK_POLL_INTERVAL_MAX           1000
+
+/* Network state cache lifetime, in milliseconds. URC-maintained values only
+ * expire as a safety net against lost URCs. */
+#define NETSTATE_TTL_URC                60000
+#define NETSTATE_TTL_QUERY              2000
+
+/* How long a stale DNS entry is served while a background refresh runs. */
+#define DNS_REFRESH_GRACE               10000
+
 /*
  * PDP management logic.
  *
@@ -30,6 +46,13 @@
  *    data can be transmitted. Telit modems are especially prone to this if
  *    AT+CGDCONT is invoked while the context is active. Our logic should handle
  *    this after a few connection failures.
+ *
+ * 3. Opening a context takes several round trips even if it's already open,
+ *    so we track its state from command results and deactivation URCs and
+ *    skip pdp_open while it's known to be up. Any failure makes the state
+ *    unknown again, so a dead context gets noticed on the next request, and
+ *    a successful pdp_open resets the failure count so the context counts as
+ *    up again.
  */
 
 int cellular_pdp_request(struct cellular *modem)
@@ -37,14 +60,21 @@ int cellular_pdp_request(struct cellular *modem)
     if (modem->pdp_failures >= modem->pdp_threshold) {
         /* Possibly stuck PDP context; close it. */
         modem->ops->pdp_close(modem);
+        modem->pdp_state = CELLULAR_PDP_DOWN;
         /* Perform exponential backoff. */
         modem->pdp_threshold *= (1+PDP_RETRY_THRESHOLD_MULTIPLIER);
     }
 
+    /* Nothing to do if the context is known to be working. */
+    if (modem->pdp_state == CELLULAR_PDP_UP && modem->pdp_failures == 0)
+        return 0;
+
     if (modem->ops->pdp_open(modem, modem->apn) != 0) {
         cellular_pdp_failure(modem);
         return -1;
     }
+    modem->pdp_state = CELLULAR_PDP_UP;
+    cellular_pdp_success(modem);
 
     return 0;
 }
@@ -58,9 +88,189 @@ void cellular_pdp_success(struct cellular *modem)
 void cellular_pdp_failure(struct cellular *modem)
 {
     modem->pdp_failures++;
+    modem->pdp_state = CELLULAR_PDP_UNKNOWN;
+}
+
+
+/*
+ * PDP supervisor.
+ *
+ * Unlike the failure counting in cellular_pdp_request(), which only kicks in
+ * when the application tries to use the network, the supervisor notices a
+ * lost context right away and reopens it with a time-based backoff. Jitter
+ * keeps a fleet of devices from hammering a recovering network in unison.
+ */
+
+struct supervisor_wait {
+    struct cellular *modem;
+    struct cellular_supervisor *sup;
+};
+
+static bool creg_registered(int stat)
+{
+    return stat == CREG_REGISTERED_HOME || stat == CREG_REGISTERED_ROAMING;
+}
+
+static bool supervisor_pdp_lost(void *arg)
+{
+    struct cellular *modem = arg;
+    return modem->pdp_state != CELLULAR_PDP_UP;
+}
+
+static bool supervisor_retry_now(void *arg)
+{
+    struct supervisor_wait *wait = arg;
+    return wait->modem->pdp_state == CELLULAR_PDP_UP ||
+           (creg_registered(wait->modem->cgreg) && !creg_registered(wait->sup->cgreg));
+}
+
+static void supervisor_reset(struct cellular_supervisor *sup)
+{
+    sup->down_since = 0;
+    sup->retry_at = 0;
+    sup->backoff = sup->backoff_min;
+}
+
+void cellular_supervisor_init(struct cellular_supervisor *sup, int backoff_min, int backoff_max)
+{
+    memset(sup, 0, sizeof(*sup));
+    sup->backoff_min = backoff_min;
+    sup->backoff_max = backoff_max;
+    sup->backoff = backoff_min;
+}
+
+int cellular_supervise(struct cellular *modem, struct cellular_supervisor *sup, int timeout)
+{
+    /* Sleep until a URC tells us the context is gone. */
+    if (!at_wait_until(modem->at, supervisor_pdp_lost, modem, timeout))
+        return 0;
+
+    uint64_t now = at_monotonic_ms();
+    if (sup->down_since == 0)
+        sup->down_since = now;
+
+    /* Back off, but retry right away once the network takes us back. */
+    if (now < sup->retry_at) {
+        struct supervisor_wait wait = { modem, sup };
+        int remaining = sup->retry_at - now;
+        sup->cgreg = modem->cgreg;
+        if (!at_wait_until(modem->at, supervisor_retry_now, &wait,
+                           remaining < timeout ? remaining : timeout))
+        {
+            if (at_monotonic_ms() < sup->retry_at)
+                return -1;
+        }
+        if (modem->pdp_state == CELLULAR_PDP_UP) {
+            /* Someone else reopened it; not a reconnect of ours. */
+            supervisor_reset(sup);
+            return 0;
+        }
+    }
+
+    sup->attempts++;
+    if (cellular_pdp_request(modem) != 0) {
+        /* Equal jitter: wait between half and all of the backoff period. */
+        int half = sup->backoff / 2;
+        sup->retry_at = at_monotonic_ms() + half + (half > 0 ? rand() % half : 0);
+        sup->backoff *= 2;
+        if (sup->backoff > sup->backoff_max)
+            sup->backoff = sup->backoff_max;
+        return -1;
+    }
+
+    /* cellular_pdp_request() has reset the PDP failure counters, so the
+     * application's next op goes straight through. */
+    sup->last_latency = at_monotonic_ms() - sup->down_since;
+    if (sup->last_latency > sup->max_latency)
+        sup->max_latency = sup->last_latency;
+    sup->reconnects++;
+    supervisor_reset(sup);
+
+    return 0;
 }
 
 
+/*
+ * Socket ACK tracking.
+ *
+ * Waiting for ACKs used to mean one or two commands per socket per second.
+ * Instead, a single status poll refreshes the counters of all sockets and
+ * every waiter reuses the most recent poll issued after it started waiting.
+ * The poll interval starts short, since ACKs usually arrive within a network
+ * round trip, and backs off exponentially for slow links.
+ */
+
+int cellular_ack_poll(struct cellular *modem)
+{
+    if (!modem->ops->socket_ackpoll) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    unsigned issue = ++modem->ack_issued;
+    if (modem->ops->socket_ackpoll(modem) != 0)
+        return -1;
+    modem->ack_completed = issue;
+    modem->ack_polled = at_monotonic_ms();
+
+    return 0;
+}
+
+int cellular_socket_waitack(struct cellular *modem, int connid, int timeout)
+{
+    if (connid < 0 || connid >= CELLULAR_MAX_SOCKETS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Datagrams are fire and forget. */
+    if (modem->dgram[connid])
+        return 0;
+
+    uint64_t start = at_monotonic_ms();
+    uint64_t deadline = start + (uint64_t) timeout * 1000;
+    unsigned issued = modem->ack_issued;
+    int interval = ACK_POLL_INTERVAL_INITIAL;
+
+    while (true) {
+        /* Only polls issued after we started know about our data. Poll
+         * when the last one is older than the interval, backing off each
+         * time; wakeups in between don't count. */
+        bool fresh = (int) (modem->ack_completed - issued) > 0;
+        if (fresh && at_monotonic_ms() >= modem->ack_polled + interval) {
+            interval *= 2;
+            if (interval > ACK_POLL_INTERVAL_MAX)
+                interval = ACK_POLL_INTERVAL_MAX;
+            fresh = false;
+        }
+        if (!fresh) {
+            if (cellular_ack_poll(modem) != 0)
+                return -1;
+        }
+
+        if (modem->unacked[connid] < 0) {
+            errno = ECONNRESET;
+            return -1;
+        }
+        if (modem->unacked[connid] == 0)
+            return 0;
+
+        uint64_t now = at_monotonic_ms();
+        if (now >= deadline) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+
+        /* Sleep until the next poll is due, but wake up early on URCs;
+         * they often signal progress. */
+        uint64_t next_poll = modem->ack_polled + interval;
+        if (next_poll > deadline)
+            next_poll = deadline;
+        if (next_poll > now)
+            at_wait_until(modem->at, NULL, NULL, next_poll - now);
+    }
+}
+
 int cellular_op_imei(struct cellular *modem, char *buf, size_t len)
 {
     char fmt[16];
@@ -91,76 +301,789 @@ int cellular_op_iccid(struct cellular *modem, char *buf, size_t len)
     return 0;
 }
 
+static int identity_scan(const char *response, char *buf, size_t len)
+{
+    char fmt[16];
+    if (snprintf(fmt, sizeof(fmt), "%%[0-9]%ds", (int) len) >= (int) sizeof(fmt)) {
+        return -1;
+    }
+
+    /* Skip the "+CCID: " style prefix some modems add. */
+    const char *digits = strpbrk(response, "0123456789");
+    at_simple_scanf(digits, fmt, buf);
+    buf[len-1] = '\0';
+
+    return 0;
+}
+
+int cellular_identity(struct cellular *modem, const char *ccid,
+                      char *imei, size_t imei_len, char *iccid, size_t iccid_len)
+{
+    char imei_response[32], iccid_response[40];
+    struct at_batch cmds[] = {
+        { "+CGSN", imei_response, sizeof(imei_response), 0 },
+        { ccid, iccid_response, sizeof(iccid_response), 0 },
+    };
+
+    at_set_timeout(modem->at, 5);
+    if (at_command_batch(modem->at, cmds, 2, CELLULAR_LINE_LENGTH) != 0)
+        return -1;
+
+    if (identity_scan(imei_response, imei, imei_len) != 0)
+        return -1;
+    if (identity_scan(iccid_response, iccid, iccid_len) != 0)
+        return -1;
+
+    return 0;
+}
+
+int cellular_op_identity(struct cellular *modem, char *imei, size_t imei_len, char *iccid, size_t iccid_len)
+{
+    return cellular_identity(modem, "+CCID", imei, imei_len, iccid, iccid_len);
+}
+
+/*
+ * Streaming transfers.
+ */
+
+void cellular_transfer_begin(struct cellular_transfer *xfer, cellular_sink_t sink, void *arg,
+                             struct cellular_transfer_stats *stats)
+{
+    memset(xfer, 0, sizeof(*xfer));
+    xfer->sink = sink;
+    xfer->arg = arg;
+    xfer->stats = stats ? stats : &xfer->local;
+    memset(xfer->stats, 0, sizeof(*xfer->stats));
+    xfer->started = at_monotonic_ms();
+}
+
+void cellular_transfer_sink(const void *data, size_t len, void *arg)
+{
+    struct cellular_transfer *xfer = arg;
+
+    /* The modem keeps sending the rest of the chunk; swallow it. */
+    if (xfer->aborted)
+        return;
+
+    if (xfer->sink(data, len, xfer->arg) != 0)
+        xfer->aborted = true;
+    else
+        xfer->stats->bytes += len;
+}
+
+int cellular_transfer_end(struct cellular_transfer *xfer)
+{
+    xfer->stats->elapsed_ms = at_monotonic_ms() - xfer->started;
+
+    if (xfer->aborted) {
+        errno = ECANCELED;
+        return -1;
+    }
+
+    return 0;
+}
+
+int cellular_transfer_fail(struct cellular_transfer *xfer)
+{
+    int saved = errno;
+    cellular_transfer_end(xfer);
+    errno = saved;
+
+    return -1;
+}
+
+int cellular_stage_put(struct cellular *modem, struct cellular_stage *stage,
+                       const void *data, size_t len, cellular_flush_t flush)
+{
+    const char *p = data;
+
+    if (len == 0) {
+        size_t used = stage->used;
+        stage->used = 0;
+        return flush(modem, stage->buf, used, true);
+    }
+
+    while (len > 0) {
+        /* Skip the copy if there's a whole chunk (and then some) at hand. */
+        if (stage->used == 0 && len > stage->size) {
+            if (flush(modem, p, stage->size, false) != 0)
+                return -1;
+            p += stage->size;
+            len -= stage->size;
+            continue;
+        }
+
+        /* Full chunk with more data behind it; safe to send. */
+        if (stage->used == stage->size) {
+            stage->used = 0;
+            if (flush(modem, stage->buf, stage->size, false) != 0)
+                return -1;
+            continue;
+        }
+
+        size_t n = stage->size - stage->used;
+        if (n > len)
+            n = len;
+        memcpy(stage->buf + stage->used, p, n);
+        stage->used += n;
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/*
+ * Resumable downloads.
+ */
+
+uint32_t cellular_crc32(uint32_t crc, const void *data, size_t len)
+{
+    /* Nibble-wise table; small enough for any target. */
+    static const uint32_t table[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+        0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+        0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+    };
+    const uint8_t *p = data;
+
+    crc = ~crc;
+    while (len--) {
+        crc ^= *p++;
+        crc = (crc >> 4) ^ table[crc & 0x0f];
+        crc = (crc >> 4) ^ table[crc & 0x0f];
+    }
+    return ~crc;
+}
+
+struct download_sink {
+    struct cellular_download *dl;
+    cellular_sink_t sink;
+    void *arg;
+};
+
+static int download_sink(const void *data, size_t len, void *arg)
+{
+    struct download_sink *ctx = arg;
+
+    if (ctx->sink(data, len, ctx->arg) != 0)
+        return -1;
+
+    /* Only count what the application has actually taken. */
+    ctx->dl->crc32 = cellular_crc32(ctx->dl->crc32, data, len);
+    ctx->dl->offset += len;
+    return 0;
+}
+
+static void download_stats_add(struct cellular_transfer_stats *total,
+                               const struct cellular_transfer_stats *stats)
+{
+    total->bytes += stats->bytes;
+    total->chunks += stats->chunks;
+    total->stalls += stats->stalls;
+    total->elapsed_ms += stats->elapsed_ms;
+}
+
+static int download_attempt(struct cellular *modem, struct cellular_download *dl,
+                            struct download_sink *ctx)
+{
+    const struct cellular_ops *ops = modem->ops;
+
+    if (ops->ftp_open(modem, dl->host, dl->port, dl->username, dl->password, dl->passive) != 0)
+        return -1;
+
+    if (dl->offset > 0) {
+        if (ops->ftp_rest(modem, dl->offset) != 0)
+            return -1;
+        dl->resumes++;
+    }
+
+    if (ops->ftp_get(modem, dl->filename) != 0)
+        return -1;
+
+    struct cellular_transfer_stats stats;
+    int result = ops->ftp_download(modem, download_sink, ctx, &stats);
+    download_stats_add(&dl->stats, &stats);
+    return result;
+}
+
+int cellular_ftp_download(struct cellular *modem, struct cellular_download *dl,
+                          cellular_sink_t sink, void *arg)
+{
+    const struct cellular_ops *ops = modem->ops;
+    struct download_sink ctx = { dl, sink, arg };
+    int attempts = (dl->attempts > 0 ? dl->attempts : 1);
+
+    if (!ops->ftp_open || !ops->ftp_get || !ops->ftp_download || !ops->ftp_close ||
+        (!ops->ftp_rest && (dl->offset > 0 || attempts > 1)))
+    {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    for (int attempt=0; attempt<attempts; attempt++) {
+        int result = download_attempt(modem, dl, &ctx);
+        int saved = errno;
+        ops->ftp_close(modem);
+
+        if (result == 0) {
+            if (dl->check_crc32 && dl->crc32 != dl->expected_crc32) {
+                errno = EBADMSG;
+                return -1;
+            }
+            return 0;
+        }
+
+        /* The application said stop; don't argue. */
+        if (saved == ECANCELED) {
+            errno = saved;
+            return -1;
+        }
+        errno = saved;
+    }
+
+    return -1;
+}
+
+/*
+ * Clock cache.
+ */
+
+void cellular_clock_store(struct cellular *modem, const struct timespec *ts)
+{
+    uint64_t now = at_monotonic_ms();
+    modem->clock_offset = (int64_t) ts->tv_sec * 1000 + ts->tv_nsec / 1000000 - (int64_t) now;
+    /* Never zero, which means "no sync yet". */
+    modem->clock_updated = now ? now : 1;
+}
+
+time_t cellular_timegm(const struct tm *tm)
+{
+    /* Days from 1970-01-01 to the given date in the proleptic Gregorian
+     * calendar, counting years from March so leap days come last. */
+    int year = tm->tm_year + 1900 - (tm->tm_mon < 2);
+    int era = (year >= 0 ? year : year - 399) / 400;
+    int yoe = year - era * 400;
+    int doy = (153 * (tm->tm_mon + (tm->tm_mon < 2 ? 10 : -2)) + 2) / 5 + tm->tm_mday - 1;
+    int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    int64_t days = (int64_t) era * 146097 + doe - 719468;
+
+    return (time_t) (days * 86400 + tm->tm_hour * 3600 + tm->tm_min * 60 + tm->tm_sec);
+}
+
+int cellular_clock_gettime(struct cellular *modem, struct timespec *ts)
+{
+    uint64_t now = at_monotonic_ms();
+
+    if (!modem->clock_updated || now - modem->clock_updated >= CELLULAR_CLOCK_TTL) {
+        if (!modem->ops->clock_gettime) {
+            errno = ENOTSUP;
+            return -1;
+        }
+        /* Refills the cache. */
+        return modem->ops->clock_gettime(modem, ts);
+    }
+
+    int64_t unix_ms = (int64_t) now + modem->clock_offset;
+    ts->tv_sec = unix_ms / 1000;
+    ts->tv_nsec = (unix_ms % 1000) * 1000000;
+    return 0;
+}
+
+/*
+ * Location cache.
+ */
+
+static struct cellular_location_entry *locate_find(struct cellular *modem, unsigned lac, unsigned ci)
+{
+    for (int i=0; i<CELLULAR_LOCATE_CACHE; i++) {
+        struct cellular_location_entry *entry = &modem->locations[i];
+        if (entry->updated && entry->lac == lac && entry->ci == ci)
+            return entry;
+    }
+    return NULL;
+}
+
+void cellular_locate_done(struct cellular *modem, int status, const struct cellular_location *loc)
+{
+    /* Unknown cell; nothing to key the entry on. */
+    if (status == 0 && (modem->locate_lac || modem->locate_ci)) {
+        /* Reuse the cell's entry, or evict the oldest one. */
+        struct cellular_location_entry *entry = locate_find(modem, modem->locate_lac, modem->locate_ci);
+        for (int i=0; !entry && i<CELLULAR_LOCATE_CACHE; i++)
+            if (!modem->locations[i].updated)
+                entry = &modem->locations[i];
+        if (!entry) {
+            entry = &modem->locations[0];
+            for (int i=1; i<CELLULAR_LOCATE_CACHE; i++)
+                if (modem->locations[i].updated < entry->updated)
+                    entry = &modem->locations[i];
+        }
+
+        entry->lac = modem->locate_lac;
+        entry->ci = modem->locate_ci;
+        entry->loc = *loc;
+        entry->updated = at_monotonic_ms();
+    }
+
+    cellular_locate_cb_t cb = modem->locate_cb;
+    modem->locate_cb = NULL;
+    if (cb)
+        cb(modem, status, loc, modem->locate_arg);
+}
+
+int cellular_locate(struct cellular *modem, cellular_locate_cb_t cb, void *arg)
+{
+    if (modem->locate_cb) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    /* Cell IDs come from +CREG URCs; queried here only if they're off. */
+    if (!modem->lac && !modem->ci && modem->ops->creg)
+        modem->ops->creg(modem);
+
+    if (modem->lac || modem->ci) {
+        struct cellular_location_entry *entry = locate_find(modem, modem->lac, modem->ci);
+        if (entry && at_monotonic_ms() - entry->updated < CELLULAR_LOCATE_TTL) {
+            cb(modem, 0, &entry->loc, arg);
+            return 0;
+        }
+    }
+
+    if (!modem->ops->locate_async) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    modem->locate_cb = cb;
+    modem->locate_arg = arg;
+    modem->locate_lac = modem->lac;
+    modem->locate_ci = modem->ci;
+    if (modem->ops->locate_async(modem) != 0) {
+        at_urc_lock(modem->at);
+        modem->locate_cb = NULL;
+        at_urc_unlock(modem->at);
+        return -1;
+    }
+
+    return 0;
+}
+
+struct locate_wait {
+    bool done;
+    int status;
+    struct cellular_location loc;
+};
+
+static void locate_wait_cb(struct cellular *modem, int status, const struct cellular_location *loc, void *arg)
+{
+    struct locate_wait *wait = arg;
+    (void) modem;
+
+    wait->status = status;
+    if (status == 0)
+        wait->loc = *loc;
+    wait->done = true;
+}
+
+static bool locate_wait_done(void *arg)
+{
+    struct locate_wait *wait = arg;
+    return wait->done;
+}
+
+int cellular_op_locate(struct cellular *modem, float *latitude, float *longitude, float *altitude)
+{
+    struct locate_wait wait = { .done = false };
+
+    if (cellular_locate(modem, locate_wait_cb, &wait) != 0)
+        return -1;
+
+    if (!at_wait_until(modem->at, locate_wait_done, &wait, CELLULAR_LOCATE_TIMEOUT*1000)) {
+        /* A late result still gets cached, but mustn't touch our stack.
+         * The lock keeps the reader from being halfway through the call. */
+        at_urc_lock(modem->at);
+        bool done = wait.done;
+        if (!done)
+            modem->locate_cb = NULL;
+        at_urc_unlock(modem->at);
+        if (!done) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+    if (wait.status) {
+        errno = wait.status;
+        return -1;
+    }
+
+    *latitude = wait.loc.latitude;
+    *longitude = wait.loc.longitude;
+    *altitude = wait.loc.altitude;
+    return 0;
+}
+
+/*
+ * DNS cache.
+ */
+
+static bool dns_is_address(const char *host)
+{
+    int a, b, c, d;
+    char tail;
+    return sscanf(host, "%d.%d.%d.%d%c", &a, &b, &c, &d, &tail) == 4;
+}
+
+static struct cellular_dns_entry *dns_find(struct cellular *modem, const char *host)
+{
+    for (int i=0; i<CELLULAR_DNS_CACHE; i++)
+        if (modem->dns[i].updated && !strcmp(modem->dns[i].host, host))
+            return &modem->dns[i];
+    return NULL;
+}
+
+static int dns_copy(const char *address, char *ip, size_t len)
+{
+    if (snprintf(ip, len, "%s", address) >= (int) len) {
+        errno = ENOSPC;
+        return -1;
+    }
+    return 0;
+}
+
+void cellular_dns_store(struct cellular *modem, const char *host, const char *ip)
+{
+    if (strlen(host) >= CELLULAR_DNS_HOST_LENGTH || strlen(ip) >= CELLULAR_IP_LENGTH)
+        return;
+
+    /* Reuse the host's entry, or evict the oldest one. */
+    struct cellular_dns_entry *entry = dns_find(modem, host);
+    for (int i=0; !entry && i<CELLULAR_DNS_CACHE; i++)
+        if (!modem->dns[i].updated)
+            entry = &modem->dns[i];
+    if (!entry) {
+        entry = &modem->dns[0];
+        for (int i=1; i<CELLULAR_DNS_CACHE; i++)
+            if (modem->dns[i].updated < entry->updated)
+                entry = &modem->dns[i];
+    }
+
+    strcpy(entry->host, host);
+    strcpy(entry->ip, ip);
+    entry->updated = at_monotonic_ms();
+}
+
+void cellular_dns_forget(struct cellular *modem, const char *host)
+{
+    struct cellular_dns_entry *entry = dns_find(modem, host);
+    if (entry)
+        entry->updated = 0;
+}
+
+bool cellular_parse_dns(const char *line, char *host, size_t hostlen, char *ip, size_t iplen)
+{
+    /* No %[ here; it's missing from some embedded libcs. */
+    const char *start = strchr(line, '"');
+    const char *end = start ? strchr(start+1, '"') : NULL;
+    if (!end || (size_t) (end - start - 1) >= hostlen)
+        return false;
+    memcpy(host, start+1, end - start - 1);
+    host[end - start - 1] = '\0';
+
+    start = strchr(end+1, '"');
+    end = start ? strchr(start+1, '"') : NULL;
+    if (!end || (size_t) (end - start - 1) >= iplen)
+        return false;
+    memcpy(ip, start+1, end - start - 1);
+    ip[end - start - 1] = '\0';
+
+    return dns_is_address(ip);
+}
+
+int cellular_resolve(struct cellular *modem, const char *host, char *ip, size_t len)
+{
+    if (dns_is_address(host))
+        return dns_copy(host, ip, len);
+
+    struct cellular_dns_entry *entry = dns_find(modem, host);
+    uint64_t now = at_monotonic_ms();
+
+    if (entry && now - entry->updated < CELLULAR_DNS_TTL)
+        return dns_copy(entry->ip, ip, len);
+
+    /* Stale: serve it while the modem refreshes it in the background. Back
+     * the timestamp up so we don't ask again until the grace period ends. */
+    if (entry && modem->ops->resolve_async) {
+        modem->ops->resolve_async(modem, host);
+        entry->updated = now - CELLULAR_DNS_TTL + DNS_REFRESH_GRACE;
+        return dns_copy(entry->ip, ip, len);
+    }
+
+    char address[CELLULAR_IP_LENGTH];
+    if (modem->ops->resolve && modem->ops->resolve(modem, host, address, sizeof(address)) == 0) {
+        cellular_dns_store(modem, host, address);
+        return dns_copy(address, ip, len);
+    }
+
+    /* Better stale than nothing. */
+    if (entry)
+        return dns_copy(entry->ip, ip, len);
+
+    if (!modem->ops->resolve)
+        errno = ENOTSUP;
+    return -1;
+}
+
+/*
+ * Attach profiles.
+ */
+
+static bool setting_is_basic(const struct cellular_setting *setting)
+{
+    char c = setting->name[0];
+    return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || c == '&';
+}
+
+static bool setting_matches(const struct cellular_setting *setting, const char *response)
+{
+    char expect[48];
+    if (setting->expect)
+        snprintf(expect, sizeof(expect), "%s", setting->expect);
+    else
+        snprintf(expect, sizeof(expect), "%s: %s", setting->name, setting->value);
+
+    /* Queries often report more fields than are set, e.g. +CREG: 2,1,... */
+    size_t len = strlen(expect);
+    return !strncmp(response, expect, len) &&
+           (response[len] == '\0' || response[len] == ',' || response[len] == '\n');
+}
+
+int cellular_apply_profile(struct cellular *modem, const struct cellular_setting *settings,
+                           size_t count, const char *save, size_t maxlen)
+{
+    struct at_batch cmds[CELLULAR_PROFILE_MAX+1];
+    char commands[CELLULAR_PROFILE_MAX][48];
+    char responses[CELLULAR_PROFILE_MAX][48];
+    bool apply[CELLULAR_PROFILE_MAX];
+
+    if (count > CELLULAR_PROFILE_MAX) {
+        errno = E2BIG;
+        return -1;
+    }
+
+    /* Read back everything that can be queried. */
+    size_t queries = 0;
+    for (size_t i=0; i<count; i++) {
+        apply[i] = true;
+        if (settings[i].write_only || setting_is_basic(&settings[i]))
+            continue;
+        snprintf(commands[queries], sizeof(commands[queries]), "%s?", settings[i].name);
+        cmds[queries] = (struct at_batch) {
+            .command = commands[queries],
+            .response = responses[queries],
+            .size = sizeof(responses[queries]),
+        };
+        queries++;
+    }
+    if (queries > 0 && at_command_batch(modem->at, cmds, queries, maxlen) == 0) {
+        for (size_t i=0, q=0; i<count; i++) {
+            if (settings[i].write_only || setting_is_basic(&settings[i]))
+                continue;
+            apply[i] = !setting_matches(&settings[i], responses[q++]);
+        }
+    }
+
+    /* Apply the differences. */
+    size_t writes = 0;
+    bool dirty = false;
+    for (size_t i=0; i<count; i++) {
+        if (!apply[i])
+            continue;
+        snprintf(commands[writes], sizeof(commands[writes]),
+                 setting_is_basic(&settings[i]) ? "%s%s" : "%s=%s",
+                 settings[i].name, settings[i].value);
+        cmds[writes] = (struct at_batch) { .command = commands[writes] };
+        dirty |= settings[i].persistent;
+        writes++;
+    }
+    modem->attach_changed += writes;
+    if (dirty && save)
+        cmds[writes++] = (struct at_batch) { .command = save };
+
+    if (writes > 0 && at_command_batch(modem->at, cmds, writes, maxlen) != 0)
+        return -1;
+
+    return 0;
+}
+
+/*
+ * Network state cache.
+ *
+ * Monitoring loops call creg()/rssi() all the time. With unsolicited
+ * reporting enabled at attach (AT+CREG=2, AT+CGREG=2 and signal URCs where
+ * the modem has them) the URC handlers keep the cache current and queries
+ * are only needed once it goes stale.
+ */
+
+bool cellular_is_network_urc(const char *line)
+{
+    int n, stat;
+
+    /* URC: "+CREG: <stat>[,<lac>,<ci>]", response: "+CREG: <n>,<stat>[,...]" */
+    if (!strncmp(line, "+CREG: ", strlen("+CREG: ")))
+        return sscanf(line, "+CREG: %d,%d", &n, &stat) != 2;
+    if (!strncmp(line, "+CGREG: ", strlen("+CGREG: ")))
+        return sscanf(line, "+CGREG: %d,%d", &n, &stat) != 2;
+    if (!strncmp(line, "+CSQN: ", strlen("+CSQN: ")))
+        return true;
+
+    return false;
+}
+
+bool cellular_handle_network_urc(struct cellular *modem, const char *line)
+{
+    int stat, rssi;
+    unsigned lac, ci;
+
+    if (sscanf(line, "+CREG: %d", &stat) == 1) {
+        modem->creg = stat;
+        if (sscanf(line, "+CREG: %*d,\"%x\",\"%x\"", &lac, &ci) == 2) {
+            modem->lac = lac;
+            modem->ci = ci;
+        }
+        modem->creg_updated = at_monotonic_ms();
+        return true;
+    }
+
+    if (sscanf(line, "+CGREG: %d", &stat) == 1) {
+        modem->cgreg = stat;
+        /* Losing GPRS registration takes the PDP context with it. */
+        if (!creg_registered(stat))
+            modem->pdp_state = CELLULAR_PDP_DOWN;
+        return true;
+    }
+
+    if (sscanf(line, "+CSQN: %d", &rssi) == 1) {
+        modem->rssi = rssi;
+        modem->rssi_updated = at_monotonic_ms();
+        return true;
+    }
+
+    return false;
+}
+
+static bool cellular_cache_fresh(uint64_t updated, bool urc)
+{
+    if (!updated)
+        return false;
+
+    return at_monotonic_ms() - updated < (urc ? NETSTATE_TTL_URC : NETSTATE_TTL_QUERY);
+}
+
 int cellular_op_creg(struct cellular *modem)
 {
+    if (cellular_cache_fresh(modem->creg_updated, modem->creg_urc))
+        return modem->creg;
+
     int creg;
+    unsigned lac, ci;
 
     at_set_timeout(modem->at, 1);
     const char *response = at_command(modem->at, "AT+CREG?");
     at_simple_scanf(response, "+CREG: %*d,%d", &creg);
 
+    modem->creg = creg;
+    if (sscanf(response, "+CREG: %*d,%*d,\"%x\",\"%x\"", &lac, &ci) == 2) {
+        modem->lac = lac;
+        modem->ci = ci;
+    }
+    modem->creg_updated = at_monotonic_ms();
+
     return creg;
 }
 
 int cellular_op_rssi(struct cellular *modem)
 {
+    if (cellular_cache_fresh(modem->rssi_updated, modem->rssi_urc))
+        return modem->rssi;
+
     int rssi;
 
     at_set_timeout(modem->at, 1);
     const char *response = at_command(modem->at, "AT+CSQ");
     at_simple_scanf(response, "+CSQ: %d,%*d", &rssi);
 
+    modem->rssi = rssi;
+    modem->rssi_updated = at_monotonic_ms();
+
     return rssi;
 }
 
-//int cellular_op_clock_gettime(struct cellular *modem, struct timespec *ts)
-//{
-//    struct tm tm;
-
-//    at_set_timeout(modem->at, 1);
-//    const char *response = at_command(modem->at, "AT+CCLK?");
-//    memset(&tm, 0, sizeof(struct tm));
-//    at_simple_scanf(response, "+CCLK: \"%d/%d/%d,%d:%d:%d%*d\"",
-//            &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
-//            &tm.tm_hour, &tm.tm_min, &tm.tm_sec);
-
-//    /* Most modems report some starting date way in the past when they have
-//     * no date/time estimation. */
-//    if (tm.tm_year < 14) {
-//        return 1;
-//    }
-
-//    /* Adjust values and perform conversion. */
-//    tm.tm_year += 2000 - 1900;
-//    tm.tm_mon -= 1;
-//    time_t unix_time = timegm(&tm);
-//    if (unix_time == -1) {
-//        return -1;
-//    }
-
-//    /* All good. Return the result. */
-//    ts->tv_sec = unix_time;
-//    ts->tv_nsec = 0;
-//    return 0;
-//}
-
-//int cellular_op_clock_settime(struct cellular *modem, const struct timespec *ts)
-//{
-//    /* Convert time_t to broken-down UTC time. */
-//    struct tm tm;
-//    gmtime_r(&ts->tv_sec, &tm);
-
-//    /* Adjust values to match 3GPP TS 27.007. */
-//    tm.tm_year += 1900 - 2000;
-//    tm.tm_mon += 1;
-
-//    /* Set the time. */
-//    at_set_timeout(modem->at, 1);
-//    at_command_simple(modem->at, "AT+CCLK=\"%02d/%02d/%02d,%02d:%02d:%02d+00\"",
-//            tm.tm_year, tm.tm_mon, tm.tm_mday,
-//            tm.tm_hour, tm.tm_min, tm.tm_sec);
-
-//    return 0;
-//}
+int cellular_op_clock_gettime(struct cellular *modem, struct timespec *ts)
+{
+    struct tm tm;
+    int offset = 0;
+
+    at_set_timeout(modem->at, 1);
+    const char *response = at_command(modem->at, "AT+CCLK?");
+    memset(&tm, 0, sizeof(struct tm));
+    if (response == NULL)
+        return -1;
+    if (sscanf(response, "+CCLK: \"%d/%d/%d,%d:%d:%d%d\"",
+            &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+            &tm.tm_hour, &tm.tm_min, &tm.tm_sec,
+            &offset) < 6)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Most modems report some starting date way in the past when they have
+     * no date/time estimation. */
+    if (tm.tm_year < 14) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    /* Adjust values and perform conversion. */
+    tm.tm_year += 2000 - 1900;
+    tm.tm_mon -= 1;
+    if (tm.tm_mon < 0 || tm.tm_mon > 11) {
+        errno = EINVAL;
+        return -1;
+    }
+    time_t unix_time = cellular_timegm(&tm);
+
+    /* The RTC keeps local time; the suffix is the zone in quarter-hours. */
+    unix_time -= 15*60*offset;
+
+    /* All good. Return the result. */
+    ts->tv_sec = unix_time;
+    ts->tv_nsec = 0;
+    cellular_clock_store(modem, ts);
+    return 0;
+}
+
+int cellular_op_clock_settime(struct cellular *modem, const struct timespec *ts)
+{
+    /* Convert time_t to broken-down UTC time. */
+    struct tm tm;
+    gmtime_r(&ts->tv_sec, &tm);
+
+    /* Adjust values to match 3GPP TS 27.007. */
+    tm.tm_year += 1900 - 2000;
+    tm.tm_mon += 1;
+
+    /* Set the time. */
+    at_set_timeout(modem->at, 1);
+    at_command_simple(modem->at, "AT+CCLK=\"%02d/%02d/%02d,%02d:%02d:%02d+00\"",
+            tm.tm_year, tm.tm_mon, tm.tm_mday,
+            tm.tm_hour, tm.tm_min, tm.tm_sec);
+
+    cellular_clock_store(modem, ts);
+    return 0;
+}
 
 /* vim: set ts=4 sw=4 et: */
@@ -47,16 +47,221 @@ void cellular_pdp_failure(struct cellular *modem);
         }                                                                   \
     } while (0)
 
+/**
+ * Wait until all data sent on a socket is acknowledged. Polls the shared
+ * socket status adaptively, starting fast and backing off, and piggybacks
+ * on polls issued by other waiters or cellular_ack_poll().
+ *
+ * @param timeout Timeout in seconds.
+ * @returns Zero on success, -1 and sets errno on failure.
+ */
+int cellular_socket_waitack(struct cellular *modem, int connid, int timeout);
+
+/**
+ * Streaming transfer in progress. cellular_transfer_sink() adapts the
+ * application's sink to at_set_rawdata_sink(), so payload goes straight
+ * from the parser to the application without a copy in between.
+ */
+struct cellular_transfer {
+    cellular_sink_t sink;
+    void *arg;
+    struct cellular_transfer_stats *stats;
+    struct cellular_transfer_stats local;
+    uint64_t started;
+    bool aborted;
+};
+
+/**
+ * Start a transfer. Stats may be NULL.
+ */
+void cellular_transfer_begin(struct cellular_transfer *xfer, cellular_sink_t sink, void *arg,
+                             struct cellular_transfer_stats *stats);
+
+/**
+ * Raw data sink for at_set_rawdata_sink(); the argument is the transfer.
+ */
+void cellular_transfer_sink(const void *data, size_t len, void *arg);
+
+/**
+ * Finish a transfer and fill in the elapsed time.
+ *
+ * @returns Zero if the transfer wasn't aborted by the sink, -1 and sets
+ *          errno otherwise.
+ */
+int cellular_transfer_end(struct cellular_transfer *xfer);
+
+/**
+ * Finish a failed transfer. Fills in the elapsed time like
+ * cellular_transfer_end(), but keeps errno.
+ *
+ * @returns -1.
+ */
+int cellular_transfer_fail(struct cellular_transfer *xfer);
+
+/**
+ * Staging buffer for uploads. Collects data into full chunks; the last
+ * chunk is held back until more data or the end of the stream arrives, so
+ * the final one can carry an end-of-file flag.
+ */
+struct cellular_stage {
+    char *buf;
+    size_t size;                /**< Chunk size, at most the buffer size. */
+    size_t used;
+};
+
+/** Send one chunk of staged data. */
+typedef int (*cellular_flush_t)(struct cellular *modem, const void *data, size_t len, bool eof);
+
+/**
+ * Feed data through a staging buffer. Chunks are sent straight from the
+ * caller's buffer when nothing is staged. A zero length flushes the rest
+ * with the end-of-file flag set.
+ *
+ * @returns Zero on success, -1 and sets errno on failure.
+ */
+int cellular_stage_put(struct cellular *modem, struct cellular_stage *stage,
+                       const void *data, size_t len, cellular_flush_t flush);
+
+/**
+ * DNS cache entry lifetime, in milliseconds. Modems don't report record TTLs.
+ */
+#define CELLULAR_DNS_TTL 300000
+
+/**
+ * Clock cache lifetime, in milliseconds. Bounds the drift of the local
+ * clock against the modem's RTC.
+ */
+#define CELLULAR_CLOCK_TTL 3600000
+
+/**
+ * Default server for clock_ntptime().
+ */
+#define CELLULAR_NTP_SERVER "pool.ntp.org"
+
+/**
+ * Store a known date and time in the clock cache.
+ */
+void cellular_clock_store(struct cellular *modem, const struct timespec *ts);
+
+/**
+ * Convert broken-down UTC time to seconds since the epoch, like the
+ * non-standard timegm(). Fields must be in their normal ranges.
+ */
+time_t cellular_timegm(const struct tm *tm);
+
+/**
+ * Location cache entry lifetime, in milliseconds. Cells don't move, but
+ * their IDs do get reassigned now and then.
+ */
+#define CELLULAR_LOCATE_TTL 86400000
+
+/**
+ * Timeout for the blocking locate() op, in seconds.
+ */
+#define CELLULAR_LOCATE_TIMEOUT 150
+
+/**
+ * Complete the pending location lookup: cache the result and fire the
+ * callback. Called from the URC handler.
+ *
+ * @param status Zero on success, an errno value on failure.
+ */
+void cellular_locate_done(struct cellular *modem, int status, const struct cellular_location *loc);
+
+/**
+ * Store a lookup result in the DNS cache.
+ */
+void cellular_dns_store(struct cellular *modem, const char *host, const char *ip);
+
+/**
+ * Drop a host from the DNS cache, e.g. after connecting to it failed.
+ */
+void cellular_dns_forget(struct cellular *modem, const char *host);
+
+/**
+ * Parse the <"host","ip"> tail of a DNS lookup response.
+ *
+ * @returns True on success.
+ */
+bool cellular_parse_dns(const char *line, char *host, size_t hostlen, char *ip, size_t iplen);
+
+/**
+ * Shortest command line every V.250 modem must accept.
+ */
+#define CELLULAR_LINE_LENGTH 40
+
+/**
+ * Read IMEI (AT+CGSN) and ICCID in one batch. Vendors disagree on the ICCID
+ * command, so it's passed in without the "AT" prefix.
+ *
+ * @returns Zero on success, -1 on failure.
+ */
+int cellular_identity(struct cellular *modem, const char *ccid,
+                      char *imei, size_t imei_len, char *iccid, size_t iccid_len);
+
+/**
+ * One entry of a declarative attach profile.
+ */
+struct cellular_setting {
+    const char *name;           /**< Command name, e.g. "+CMEE" or "&K". */
+    const char *value;          /**< Value to set, e.g. "2". */
+    const char *expect;         /**< Query response prefix when already set; NULL for "<name>: <value>". */
+    bool persistent;            /**< Stored in NVM by the save command. */
+    bool write_only;            /**< Can't be queried; always applied. */
+};
+
+/** Maximum number of settings in a profile. */
+#define CELLULAR_PROFILE_MAX 16
+
+/**
+ * Bring modem settings in line with a profile. Current values are read back
+ * in one batch and only the differing settings are applied, in another one.
+ * The save command (e.g. "&W0") is appended only if a persistent setting
+ * changed. Basic syntax settings can't be queried and are always applied;
+ * if the read-back fails, everything is.
+ *
+ * @param save Save command without the "AT" prefix, or NULL.
+ * @param maxlen Maximum command line length; see at_command_batch().
+ * @returns Zero on success, -1 and sets errno on failure.
+ */
+int cellular_apply_profile(struct cellular *modem, const struct cellular_setting *settings,
+                           size_t count, const char *save, size_t maxlen);
+
+/**
+ * Check if a line is a network state URC (+CREG, +CGREG, +CSQN). Query
+ * responses in the same format are told apart by their leading <n> field.
+ */
+bool cellular_is_network_urc(const char *line);
+
+/**
+ * Update the network state cache from a URC.
+ *
+ * @returns True if the line was a network state URC.
+ */
+bool cellular_handle_network_urc(struct cellular *modem, const char *line);
+
+/**
+ * Route a modem's ops through wrappers holding the AT channel lock for the
+ * whole op, firing the socket__start and socket__done USDT probes and doing
+ * the per-op accounting. Call after setting the ops table.
+ *
+ * @param wrapped Storage for the wrapped table; may be shared by all modems
+ *                of a driver.
+ */
+void cellular_wrap_ops(struct cellular *modem, struct cellular_ops *wrapped);
+
 /*
  * 3GPP TS 27.007 compatible operations.
  */
 
 int cellular_op_imei(struct cellular *modem, char *buf, size_t len);
 int cellular_op_iccid(struct cellular *modem, char *buf, size_t len);
+int cellular_op_identity(struct cellular *modem, char *imei, size_t imei_len, char *iccid, size_t iccid_len);
 int cellular_op_creg(struct cellular *modem);
 int cellular_op_rssi(struct cellular *modem);
-//int cellular_op_clock_gettime(struct cellular *modem, struct timespec *ts);
-//int cellular_op_clock_settime(struct cellular *modem, const struct timespec *ts);
+int cellular_op_locate(struct cellular *modem, float *latitude, float *longitude, float *altitude);
+int cellular_op_clock_gettime(struct cellular *modem, struct timespec *ts);
+int cellular_op_clock_settime(struct cellular *modem, const struct timespec *ts);
 
 #endif
 
@@ -0,0 +1,225 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#include <attentive/cellular.h>
+
+#include <stddef.h>
+#include <string.h>
+
+#include "at-common.h"
+#include "../at-probes.h"
+
+/*
+ * Op wrappers. Every op of the driver's table is routed through one of
+ * these, so each op's command sequences run with the channel locked (see
+ * at_lock(); its blocking waits let go of it), and probes and accounting
+ * see each op of each driver without the drivers having to mark all of
+ * their return paths.
+ */
+
+#ifdef CELLULAR_ACCOUNTING
+/* Fail the build if CELLULAR_ACCOUNT_OPS is too small. */
+typedef char cellular_account_ops_check[
+    sizeof(struct cellular_ops) / sizeof(void (*)(void)) <= CELLULAR_ACCOUNT_OPS ? 1 : -1];
+
+static void account_enter(struct cellular *modem)
+{
+    /* Ops calling other ops are accounted to the outermost one. */
+    if (modem->account_depth++ > 0)
+        return;
+
+    modem->account_commands = modem->at->stats.commands;
+    modem->account_writes = modem->at->stats.writes;
+    modem->account_timeouts = modem->at->stats.timeouts;
+    modem->account_started = at_monotonic_ms();
+}
+
+static void account_leave(struct cellular *modem, size_t index, const char *name)
+{
+    if (--modem->account_depth > 0)
+        return;
+
+    struct cellular_op_account *account = &modem->accounts[index];
+    unsigned commands = modem->at->stats.commands - modem->account_commands;
+    unsigned writes = modem->at->stats.writes - modem->account_writes;
+    unsigned ms = at_monotonic_ms() - modem->account_started;
+
+    account->name = name;
+    account->calls++;
+    account->commands += commands;
+    account->writes += writes;
+    account->timeouts += modem->at->stats.timeouts - modem->account_timeouts;
+    account->total_ms += ms;
+    if (commands > account->max_commands)
+        account->max_commands = commands;
+    if (writes > account->max_writes)
+        account->max_writes = writes;
+    if (ms > account->max_ms)
+        account->max_ms = ms;
+}
+#else
+#define account_enter(modem) do {} while (0)
+#define account_leave(modem, index, name) do {} while (0)
+#endif
+
+#define OP_INDEX(op) (offsetof(struct cellular_ops, op) / sizeof(void (*)(void)))
+
+#define WRAP_OP(type, op, params, args)                                     \
+    static type wrap_##op params                                            \
+    {                                                                       \
+        at_lock(modem->at);                                                 \
+        account_enter(modem);                                               \
+        type result = modem->driver_ops->op args;                           \
+        account_leave(modem, OP_INDEX(op), #op);                            \
+        at_unlock(modem->at);                                               \
+        return result;                                                      \
+    }
+
+#define WRAP_SOCKET_OP(type, op, connid, params, args)                      \
+    static type wrap_##op params                                            \
+    {                                                                       \
+        at_probe3(socket__start, #op, modem, connid);                       \
+        at_lock(modem->at);                                                 \
+        account_enter(modem);                                               \
+        type result = modem->driver_ops->op args;                           \
+        account_leave(modem, OP_INDEX(op), #op);                            \
+        at_unlock(modem->at);                                               \
+        at_probe4(socket__done, #op, modem, connid, (long) result);         \
+        return result;                                                      \
+    }
+
+WRAP_OP(int, attach, (struct cellular *modem), (modem))
+WRAP_OP(int, detach, (struct cellular *modem), (modem))
+WRAP_OP(int, pdp_open, (struct cellular *modem, const char *apn), (modem, apn))
+WRAP_OP(int, pdp_close, (struct cellular *modem), (modem))
+WRAP_OP(int, imei, (struct cellular *modem, char *buf, size_t len), (modem, buf, len))
+WRAP_OP(int, meid, (struct cellular *modem, char *buf, size_t len), (modem, buf, len))
+WRAP_OP(int, iccid, (struct cellular *modem, char *buf, size_t len), (modem, buf, len))
+WRAP_OP(int, identity, (struct cellular *modem, char *imei, size_t imei_len, char *iccid, size_t iccid_len),
+        (modem, imei, imei_len, iccid, iccid_len))
+WRAP_OP(int, creg, (struct cellular *modem), (modem))
+WRAP_OP(int, rssi, (struct cellular *modem), (modem))
+WRAP_OP(int, clock_gettime, (struct cellular *modem, struct timespec *ts), (modem, ts))
+WRAP_OP(int, clock_settime, (struct cellular *modem, const struct timespec *ts), (modem, ts))
+WRAP_OP(int, clock_ntptime, (struct cellular *modem, struct timespec *ts), (modem, ts))
+WRAP_OP(int, resolve, (struct cellular *modem, const char *host, char *ip, size_t len), (modem, host, ip, len))
+WRAP_OP(int, resolve_async, (struct cellular *modem, const char *host), (modem, host))
+WRAP_SOCKET_OP(int, socket_connect, connid, (struct cellular *modem, int connid, const char *host, uint16_t port),
+               (modem, connid, host, port))
+WRAP_SOCKET_OP(int, socket_connect_udp, connid, (struct cellular *modem, int connid, const char *host, uint16_t port),
+               (modem, connid, host, port))
+WRAP_SOCKET_OP(int, socket_connect_tls, connid, (struct cellular *modem, int connid, const char *host, uint16_t port),
+               (modem, connid, host, port))
+WRAP_OP(int, tls_cert, (struct cellular *modem, enum cellular_cert_type type, const void *data, size_t len),
+        (modem, type, data, len))
+WRAP_SOCKET_OP(ssize_t, socket_send, connid, (struct cellular *modem, int connid, const void *buffer, size_t amount, int flags),
+               (modem, connid, buffer, amount, flags))
+WRAP_SOCKET_OP(ssize_t, socket_recv, connid, (struct cellular *modem, int connid, void *buffer, size_t length, int flags),
+               (modem, connid, buffer, length, flags))
+WRAP_SOCKET_OP(int, socket_waitack, connid, (struct cellular *modem, int connid), (modem, connid))
+WRAP_SOCKET_OP(int, socket_close, connid, (struct cellular *modem, int connid), (modem, connid))
+WRAP_SOCKET_OP(int, socket_ackpoll, -1, (struct cellular *modem), (modem))
+WRAP_SOCKET_OP(int, socket_online, connid, (struct cellular *modem, int connid, const char *host, uint16_t port),
+               (modem, connid, host, port))
+WRAP_OP(int, ftp_open, (struct cellular *modem, const char *host, uint16_t port, const char *username, const char *password, bool passive),
+        (modem, host, port, username, password, passive))
+WRAP_OP(int, ftp_get, (struct cellular *modem, const char *filename), (modem, filename))
+WRAP_OP(int, ftp_rest, (struct cellular *modem, size_t offset), (modem, offset))
+WRAP_OP(int, ftp_getdata, (struct cellular *modem, char *buffer, size_t length), (modem, buffer, length))
+WRAP_OP(int, ftp_download, (struct cellular *modem, cellular_sink_t sink, void *arg, struct cellular_transfer_stats *stats),
+        (modem, sink, arg, stats))
+WRAP_OP(int, ftp_put, (struct cellular *modem, const char *filename), (modem, filename))
+WRAP_OP(int, ftp_putdata, (struct cellular *modem, const void *buffer, size_t length), (modem, buffer, length))
+WRAP_OP(int, ftp_close, (struct cellular *modem), (modem))
+WRAP_OP(int, http, (struct cellular *modem, struct cellular_http_request *req,
+                    cellular_sink_t sink, void *arg, struct cellular_transfer_stats *stats),
+        (modem, req, sink, arg, stats))
+WRAP_OP(int, locate, (struct cellular *modem, float *latitude, float *longitude, float *altitude),
+        (modem, latitude, longitude, altitude))
+WRAP_OP(int, locate_async, (struct cellular *modem), (modem))
+
+void cellular_wrap_ops(struct cellular *modem, struct cellular_ops *wrapped)
+{
+    const struct cellular_ops *ops = modem->ops;
+
+#define WRAP(op) wrapped->op = ops->op ? wrap_##op : NULL
+    WRAP(attach);
+    WRAP(detach);
+    WRAP(pdp_open);
+    WRAP(pdp_close);
+    WRAP(imei);
+    WRAP(meid);
+    WRAP(iccid);
+    WRAP(identity);
+    WRAP(creg);
+    WRAP(rssi);
+    WRAP(clock_gettime);
+    WRAP(clock_settime);
+    WRAP(clock_ntptime);
+    WRAP(resolve);
+    WRAP(resolve_async);
+    WRAP(socket_connect);
+    WRAP(socket_connect_udp);
+    WRAP(socket_connect_tls);
+    WRAP(tls_cert);
+    WRAP(socket_send);
+    WRAP(socket_recv);
+    WRAP(socket_waitack);
+    WRAP(socket_close);
+    WRAP(socket_ackpoll);
+    WRAP(socket_online);
+    WRAP(ftp_open);
+    WRAP(ftp_get);
+    WRAP(ftp_rest);
+    WRAP(ftp_getdata);
+    WRAP(ftp_download);
+    WRAP(ftp_put);
+    WRAP(ftp_putdata);
+    WRAP(ftp_close);
+    WRAP(http);
+    WRAP(locate);
+    WRAP(locate_async);
+#undef WRAP
+
+    modem->driver_ops = ops;
+    modem->ops = wrapped;
+}
+
+#ifdef CELLULAR_ACCOUNTING
+
+const struct cellular_op_account *cellular_account(struct cellular *modem, const char *op)
+{
+    for (int i=0; i<CELLULAR_ACCOUNT_OPS; i++)
+        if (modem->accounts[i].name && !strcmp(modem->accounts[i].name, op))
+            return &modem->accounts[i];
+
+    return NULL;
+}
+
+void cellular_account_reset(struct cellular *modem)
+{
+    memset(modem->accounts, 0, sizeof(modem->accounts));
+}
+
+int cellular_account_check(struct cellular *modem, const struct cellular_budget *budgets, size_t count)
+{
+    int overruns = 0;
+
+    for (size_t i=0; i<count; i++) {
+        const struct cellular_op_account *account = cellular_account(modem, budgets[i].op);
+        if (account && (account->max_commands > budgets[i].commands ||
+                        account->max_writes > budgets[i].writes))
+            overruns++;
+    }
+
+    return overruns;
+}
+
+#endif
+
+/* vim: set ts=4 sw=4 et: */
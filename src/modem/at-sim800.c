@@ -6,14 +6,15 @@
  * published by Sam Hocevar. See the COPYING file for more details.
  */
 
+/* For struct timespec. */
+#define _POSIX_C_SOURCE 200112L
+
 #include <attentive/cellular.h>
 
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
 
-#include "FreeRTOS.h"
-#include "task.h"
-
 #include "at-common.h"
 #define printf(...)
 
@@ -35,9 +36,18 @@
 #define SIM800_AUTOBAUD_ATTEMPTS 10
 #define SIM800_WAITACK_TIMEOUT   40
 #define SIM800_FTP_TIMEOUT       60
+#define SIM800_LINE_LENGTH       556
+#define SIM800_FTPGET_MAX        1460
+#define SIM800_FTPPUT_MAX        1360
+#define SIM800_HTTPREAD_MAX      4096
+#define SIM800_CIPSEND_MAX       1460
+#define SIM800_RECV_TIMEOUT      60
+#define SIM800_DNS_TIMEOUT       30
+#define SIM800_NTP_TIMEOUT       30
+#define SIM800_HTTP_TIMEOUT      120
+#define SIM800_LOCATE_TIMEOUT    70
 #define SET_TIMEOUT              10
 #define GET_TIMEOUT              2
-#define NTP_BUF_SIZE             4
 
 enum sim800_socket_status {
     SIM800_SOCKET_STATUS_ERROR = -1,
@@ -61,6 +71,12 @@ static const char *const sim800_urc_responses[] = {
     "+BTSPPMAN: ",      /* incoming BT SPP data notification */
     "+CIPRXGET: 1,",    /* incoming socket data notification */
     "+FTPGET: 1,",      /* FTP state change notification */
+    "+FTPPUT: 1,",      /* FTP upload state change notification */
+    "+HTTPACTION: ",    /* HTTP request completed */
+    "+SSLSETCERT: ",    /* Client certificate import result */
+    "+CDNSGIP: ",       /* DNS lookup result */
+    "+CNTP: ",          /* Network time sync result */
+    "+CIPGSMLOC: ",     /* Location lookup result */
     "+PDP: DEACT",      /* PDP disconnected */
     "+SAPBR 1: DEACT",  /* PDP disconnected (for SAPBR apps) */
     "*PSNWID: ",        /* AT+CLTS network name */
@@ -84,11 +100,31 @@ struct cellular_sim800 {
     struct cellular dev;
 
     int ftpget1_status;
+    unsigned ftpget1_ready;
+    int ftpput1_status;
+    int ftpput1_maxlength;
+    bool ftpput1_ready;
+    struct cellular_stage ftpput;
+    char ftpput_buf[SIM800_FTPPUT_MAX];
+    int http_status;
+    int http_length;
     enum sim800_socket_status socket_status[SIM800_NSOCKETS];
     enum sim800_socket_status spp_status;
     int spp_connid;
+    bool online;
+    bool online_ssl;
+    int online_connid;
+    int sslsetcert_status;
+    int cdnsgip_status;                         /**< Result of the lookup of cdnsgip_host. */
+    int cdnsgip_pending;                        /**< Lookups without a result yet. */
+    char cdnsgip_host[CELLULAR_DNS_HOST_LENGTH];/**< Host sim800_resolve() waits for, or empty. */
+    char cdnsgip_ip[CELLULAR_IP_LENGTH];
+    int cntp_status;
 };
 
+/* Fail the build if CELLULAR_SIM800_SIZE is too small. */
+typedef char cellular_sim800_size_check[sizeof(struct cellular_sim800) <= CELLULAR_SIM800_SIZE ? 1 : -1];
+
 static enum at_response_type scan_line(const char *line, size_t len, void *arg)
 {
     (void) len;
@@ -96,6 +132,8 @@ static enum at_response_type scan_line(const char *line, size_t len, void *arg)
 
     if (at_prefix_in_table(line, sim800_urc_responses))
         return AT_RESPONSE_URC;
+    if (cellular_is_network_urc(line))
+        return AT_RESPONSE_URC;
 
     /* Socket status notifications in form of "%d, <status>". */
     if (line[0] >= '0' && line[0] <= '0'+SIM800_NSOCKETS &&
@@ -121,18 +159,40 @@ static enum at_response_type scan_line(const char *line, size_t len, void *arg)
     return AT_RESPONSE_UNKNOWN;
 }
 
+/* BT requests are answered from the channel's work queue, where they go
+ * through at_command() like any other command instead of racing it. */
+static void sim800_bt_pair(struct at *at, void *arg)
+{
+    (void) arg;
+    at_command(at, "AT+BTPAIR=1,1");
+}
+
+static void sim800_bt_accept(struct at *at, void *arg)
+{
+    (void) arg;
+    at_command(at, "AT+BTACPT=1");
+}
+
 static void handle_urc(const char *line, size_t len, void *arg)
 {
+    (void) len;
+
     struct cellular_sim800 *priv = arg;
+    int cdnsgip;
 
     printf("[sim800@%p] urc: %.*s\n", priv, (int) len, line);
-    if(sscanf(line, "=>%s", &spp_recv_buf[0]) == 1) {
+    if (cellular_handle_network_urc(&priv->dev, line)) {
+
+    } else if (!strncmp(line, "+PDP: DEACT", strlen("+PDP: DEACT")) ||
+               !strncmp(line, "+SAPBR 1: DEACT", strlen("+SAPBR 1: DEACT"))) {
+      priv->dev.pdp_state = CELLULAR_PDP_DOWN;
+    } else if(sscanf(line, "=>%s", &spp_recv_buf[0]) == 1) {
 
     } else if (!strncmp(line, "+BTPAIRING: \"Druid_Tech\"", strlen("+BTPAIRING: \"Druid_Tech\""))) {
-      at_send(priv->dev.at, "AT+BTPAIR=1,1");
+      at_defer(priv->dev.at, sim800_bt_pair, priv);
     } else if(!strncmp(line, "+BTCONNECTING: ", strlen("+BTCONNECTING: "))) {
       if(strstr(line, "\"SPP\"")) {
-        at_send(priv->dev.at, "AT+BTACPT=1");
+        at_defer(priv->dev.at, sim800_bt_accept, priv);
       }
     } else if(sscanf(line, "+BTCONNECT: %d,\"Druid_Tech\",%*s,\"SPP\"", &priv->spp_connid) == 1) {
       priv->spp_status = SIM800_SOCKET_STATUS_PENDING;
@@ -141,7 +201,57 @@ static void handle_urc(const char *line, size_t len, void *arg)
     } else if(!strncmp(line, "+BTDISCONN: \"Druid_Tech\"", strlen("+BTDISCONN: \"Druid_Tech\""))) {
       priv->spp_status = SIM800_SOCKET_STATUS_UNKNOWN;
     } else if (sscanf(line, "+FTPGET: 1,%d", &priv->ftpget1_status) == 1) {
+      /* "+FTPGET: 1,1" is repeated whenever more data becomes available. */
+      if (priv->ftpget1_status == 1)
+        priv->ftpget1_ready++;
+    } else if (sscanf(line, "+HTTPACTION: %*d,%d,%d", &priv->http_status, &priv->http_length) == 2) {
+
+    } else if (sscanf(line, "+SSLSETCERT: %d", &priv->sslsetcert_status) == 1) {
+
+    } else if (sscanf(line, "+CDNSGIP: %d", &cdnsgip) == 1) {
+      /* Lookups are asynchronous and may overlap; results go straight to the
+       * cache, and only a result for its own host ends sim800_resolve().
+       * Errors don't name the host, so one is only taken as its result when
+       * no other lookup is outstanding. */
+      char host[CELLULAR_DNS_HOST_LENGTH], ip[CELLULAR_IP_LENGTH];
+      if (priv->cdnsgip_pending > 0)
+        priv->cdnsgip_pending--;
+      if (cdnsgip == 1 && cellular_parse_dns(line, host, sizeof(host), ip, sizeof(ip))) {
+        cellular_dns_store(&priv->dev, host, ip);
+        if (priv->cdnsgip_host[0] && !strcmp(host, priv->cdnsgip_host)) {
+          strcpy(priv->cdnsgip_ip, ip);
+          priv->cdnsgip_status = 1;
+        }
+      } else if (cdnsgip != 1 && priv->cdnsgip_host[0] && priv->cdnsgip_pending == 0) {
+        priv->cdnsgip_status = cdnsgip;
+      }
 
+    } else if (!strncmp(line, "+CIPGSMLOC: ", strlen("+CIPGSMLOC: "))) {
+      /* "+CIPGSMLOC: 0,<longitude>,<latitude>,<date>,<time>" on success. */
+      struct cellular_location loc = { .altitude = 0 };
+      int code;
+      if (sscanf(line, "+CIPGSMLOC: %d,%f,%f", &code, &loc.longitude, &loc.latitude) == 3 && code == 0)
+        cellular_locate_done(&priv->dev, 0, &loc);
+      else
+        cellular_locate_done(&priv->dev, ECONNABORTED, NULL);
+    } else if (sscanf(line, "+CNTP: %d", &priv->cntp_status) == 1) {
+
+    } else if (!strncmp(line, "*PSUTTZ: ", strlen("*PSUTTZ: "))) {
+      /* Network time is UTC; worth keeping if AT+CLTS is ever enabled. */
+      struct tm tm;
+      memset(&tm, 0, sizeof(tm));
+      if (sscanf(line, "*PSUTTZ: %d,%d,%d,%d,%d,%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+                 &tm.tm_hour, &tm.tm_min, &tm.tm_sec) == 6 &&
+          tm.tm_mon >= 1 && tm.tm_mon <= 12) {
+        tm.tm_year -= 1900;
+        tm.tm_mon -= 1;
+        struct timespec ts = { .tv_sec = cellular_timegm(&tm) };
+        cellular_clock_store(&priv->dev, &ts);
+      }
+    } else if (sscanf(line, "+FTPPUT: 1,%d,%d", &priv->ftpput1_status, &priv->ftpput1_maxlength) >= 1) {
+      /* "+FTPPUT: 1,1,<maxlength>" grants the next chunk. */
+      if (priv->ftpput1_status == 1)
+        priv->ftpput1_ready = true;
     }
 
     return;
@@ -180,13 +290,28 @@ static int sim800_config(struct cellular *modem, const char *option, const char
         if (!strcmp(response, expected))
             return 0;
 
-        vTaskDelay(pdMS_TO_TICKS(1000));
+        at_wait_until(modem->at, NULL, NULL, 1000);
     }
 
     return -1;
 }
 
 
+static const struct cellular_setting sim800_profile[] = {
+//    { "+IPR", "0", NULL, true, false },                 /* Enable autobauding if not already enabled. */
+    { "+IFC", "0,0", NULL, true, false },               /* Disable hardware flow control. */
+    { "+CMEE", "2", NULL, true, false },                /* Enable extended error reporting. */
+    { "+CLTS", "0", NULL, true, false },                /* Don't sync RTC with network time, it's broken. */
+    { "+CIURC", "0", NULL, true, false },               /* Disable "Call Ready" URC. */
+    { "+CREG", "2", NULL, false, false },               /* Report registration and cell changes. */
+    { "+CGREG", "2", NULL, false, false },              /* Report GPRS registration changes. */
+    { "+EXUNSOL", "\"SQ\",1", NULL, false, true },      /* Report signal quality changes (+CSQN). */
+    { "+BTSPPCFG", "\"TT\",1", NULL, false, false },
+    { "+BTPAIRCFG", "0", NULL, false, false },
+    { "+BTSPPGET", "1", NULL, false, false },
+    { "+BTPOWER", "1", NULL, false, false },
+};
+
 static int sim800_attach(struct cellular *modem)
 {
     at_set_callbacks(modem->at, &sim800_callbacks, (void *) modem);
@@ -207,22 +332,14 @@ static int sim800_attach(struct cellular *modem)
     /* Disable local echo again; make sure it was disabled successfully. */
     at_command_simple(modem->at, "ATE0");
 
-    /* Initialize modem. */
-    static const char *const init_strings[] = {
-//        "AT+IPR=0",                     /* Enable autobauding if not already enabled. */
-        "AT+IFC=0,0",                   /* Disable hardware flow control. */
-        "AT+CMEE=2",                    /* Enable extended error reporting. */
-        "AT+CLTS=0",                    /* Don't sync RTC with network time, it's broken. */
-        "AT+CIURC=0",                   /* Disable "Call Ready" URC. */
-        "AT&W0",                        /* Save configuration. */
-        "AT+BTSPPCFG=\"TT\",1",
-        "AT+BTPAIRCFG=0",
-        "AT+BTSPPGET=1",
-        "AT+BTPOWER=1",
-        NULL
-    };
-    for (const char *const *command=init_strings; *command; command++)
-        at_command_simple(modem->at, "%s", *command);
+    /* Initialize modem. Only settings that differ are sent; AT&W0 only if
+     * something persistent changed. */
+    if (cellular_apply_profile(modem, sim800_profile,
+                               sizeof(sim800_profile)/sizeof(*sim800_profile),
+                               "&W0", SIM800_LINE_LENGTH) != 0)
+        return -1;
+    modem->creg_urc = true;
+    modem->rssi_urc = true;
 
     /* Configure IP application. */
 
@@ -245,78 +362,38 @@ static int sim800_detach(struct cellular *modem)
     return 0;
 }
 
-//static int sim800_clock_gettime(struct cellular *modem, struct timespec *ts)
-//{
-//    /* TODO: See CYC-1255. */
-//    return -1;
-//}
-
-//static int sim800_clock_settime(struct cellular *modem, const struct timespec *ts)
-//{
-//    /* TODO: See CYC-1255. */
-//    return -1;
-//}
-
-//static int sim800_clock_ntptime(struct cellular *modem, struct timespec *ts)
-//{
-//    /* network stuff. */
-//    int socket = 2;
-
-//    if (modem->ops->socket_connect(modem, socket, "time-nw.nist.gov", 37) == 0) {
-//        printf("sim800: connect successful\n");
-//    } else {
-//        perror("sim800: connect failed");
-//        goto close_conn;
-//    }
-
-//    int len = 0;
-//    char buf[NTP_BUF_SIZE];
-//    while ((len = modem->ops->socket_recv(modem, socket, buf, NTP_BUF_SIZE, 0)) >= 0)
-//    {
-//        if (len > 0)
-//        {
-//            printf("Received: >\x1b[1m");
-//            for (int i = 0; i<len; i++)
-//            {
-//                printf("%02x", buf[i]);
-//            }
-//            printf("\x1b[0m<\n");
-
-//            if (len == 4)
-//            {
-//                ts->tv_sec = 0;
-//                for (int i = 0; i<4; i++)
-//                {
-//                    ts->tv_sec = (long int)buf[i] + ts->tv_sec*256;
-//                }
-//                printf("sim800: catched UTC timestamp -> %d\n", ts->tv_sec);
-//                ts->tv_sec -= 2208988800L;        //UTC to UNIX time conversion
-//                printf("sim800: final UNIX timestamp -> %d\n", ts->tv_sec);
-//                goto close_conn;
-//            }
-
-//            len = 0;
-//        }
-//        else
-//            vTaskDelay(pdMS_TO_TICKS(1000));
-//    }
-
-//#if 0
-//    // FIXME: It's wrong. It should be removed
-//    while (modem->ops->socket_recv(modem, socket, NULL, 1, 0) != 0)
-//    {} //flush
-//#endif
-
-//close_conn:
-//    if (modem->ops->socket_close(modem, socket) == 0)
-//    {
-//        printf("sim800: close successful\n");
-//    } else {
-//        perror("sim800: close");
-//    }
-
-//    return 0;
-//}
+static bool sim800_cntp_done(void *arg)
+{
+    struct cellular_sim800 *priv = arg;
+    return priv->cntp_status != -1;
+}
+
+static int sim800_clock_ntptime(struct cellular *modem, struct timespec *ts)
+{
+    struct cellular_sim800 *priv = (struct cellular_sim800 *) modem;
+
+    /* AT+CNTP goes out through the SAPBR bearer. */
+    if (cellular_pdp_request(modem) != 0)
+        return -1;
+
+    /* Sync the RTC to UTC; the result comes in a "+CNTP: " URC. */
+    at_set_timeout(modem->at, SET_TIMEOUT);
+    at_command_simple(modem->at, "AT+CNTPCID=1");
+    at_command_simple(modem->at, "AT+CNTP=\"%s\",0", CELLULAR_NTP_SERVER);
+    priv->cntp_status = -1;
+    at_command_simple(modem->at, "AT+CNTP");
+
+    if (!at_wait_until(modem->at, sim800_cntp_done, priv, SIM800_NTP_TIMEOUT*1000)) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    if (priv->cntp_status != 1) {
+        errno = EIO;
+        return -1;
+    }
+
+    return cellular_op_clock_gettime(modem, ts);
+}
 
 static enum at_response_type scanner_cipstatus(const char *line, size_t len, void *arg)
 {
@@ -414,12 +491,115 @@ static int sim800_pdp_close(struct cellular *modem)
 {
     at_set_timeout(modem->at, SET_TIMEOUT);
     at_set_command_scanner(modem->at, scanner_cipshut);
+    modem->pdp_state = CELLULAR_PDP_UNKNOWN;
     at_command_simple(modem->at, "AT+CIPSHUT");
+    modem->pdp_state = CELLULAR_PDP_DOWN;
 
     return 0;
 }
 
 
+static int sim800_resolve_async(struct cellular *modem, const char *host)
+{
+    struct cellular_sim800 *priv = (struct cellular_sim800 *) modem;
+
+    if (cellular_pdp_request(modem) != 0)
+        return -1;
+
+    /* Counted before sending; the result may beat the OK. */
+    at_set_timeout(modem->at, SET_TIMEOUT);
+    priv->cdnsgip_pending++;
+    const char *response = at_command(modem->at, "AT+CDNSGIP=\"%s\"", host);
+    if (response == NULL || strcmp(response, "")) {
+        if (priv->cdnsgip_pending > 0)
+            priv->cdnsgip_pending--;
+        cellular_pdp_failure(modem);
+        return -1;
+    }
+    cellular_pdp_success(modem);
+
+    return 0;
+}
+
+static bool sim800_cdnsgip_done(void *arg)
+{
+    struct cellular_sim800 *priv = arg;
+    return priv->cdnsgip_status != -1;
+}
+
+static int sim800_resolve(struct cellular *modem, const char *host, char *ip, size_t len)
+{
+    struct cellular_sim800 *priv = (struct cellular_sim800 *) modem;
+
+    if (strlen(host) >= sizeof(priv->cdnsgip_host)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    /* Set up before sending, so the result can't slip past us. */
+    strcpy(priv->cdnsgip_host, host);
+    priv->cdnsgip_status = -1;
+    if (sim800_resolve_async(modem, host) != 0) {
+        priv->cdnsgip_host[0] = '\0';
+        return -1;
+    }
+
+    /* "+CDNSGIP: 1,..." copies the address before setting the status. */
+    bool done = at_wait_until(modem->at, sim800_cdnsgip_done, priv, SIM800_DNS_TIMEOUT*1000);
+    priv->cdnsgip_host[0] = '\0';
+    if (!done) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    if (priv->cdnsgip_status != 1) {
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+
+    if (snprintf(ip, len, "%s", priv->cdnsgip_ip) >= (int) len) {
+        errno = ENOSPC;
+        return -1;
+    }
+    return 0;
+}
+
+static int sim800_cipstart(struct cellular *modem, int connid, const char *proto, const char *host, uint16_t port)
+{
+    struct cellular_sim800 *priv = (struct cellular_sim800 *) modem;
+
+    /* Send connection request. */
+    at_set_timeout(modem->at, SET_TIMEOUT);
+    priv->socket_status[connid] = SIM800_SOCKET_STATUS_UNKNOWN;
+    cellular_command_simple_pdp(modem, "AT+CIPSTART=%d,%s,\"%s\",%d", connid, proto, host, port);
+
+    /* Wait for socket status URC. */
+    for (int i=0; i<SIM800_CONNECT_TIMEOUT; i++) {
+        if (priv->socket_status[connid] == SIM800_SOCKET_STATUS_CONNECTED) {
+            return 0;
+        } else if (priv->socket_status[connid] == SIM800_SOCKET_STATUS_ERROR) {
+            return -1;
+        }
+        at_wait_until(modem->at, NULL, NULL, 1000);
+    }
+
+    return -1;
+}
+
+static int sim800_socket_open(struct cellular *modem, int connid, const char *proto, const char *host, uint16_t port)
+{
+    /* Connect by address if we know it; saves a lookup over the air. */
+    char ip[CELLULAR_IP_LENGTH];
+    bool resolved = (cellular_resolve(modem, host, ip, sizeof(ip)) == 0);
+
+    if (sim800_cipstart(modem, connid, proto, resolved ? ip : host, port) == 0)
+        return 0;
+
+    /* The server may have moved; look it up afresh next time. */
+    if (resolved)
+        cellular_dns_forget(modem, host);
+    return -1;
+}
+
 static int sim800_socket_connect(struct cellular *modem, int connid, const char *host, uint16_t port)
 {
     struct cellular_sim800 *priv = (struct cellular_sim800 *) modem;
@@ -427,25 +607,25 @@ static int sim800_socket_connect(struct cellular *modem, int connid, const char
     if(connid == SIM800_NSOCKETS) {
       return !(SIM800_SOCKET_STATUS_CONNECTED == priv->spp_status);
     } else if(connid < SIM800_NSOCKETS) {
-      /* Send connection request. */
-      at_set_timeout(modem->at, SET_TIMEOUT);
-      priv->socket_status[connid] = SIM800_SOCKET_STATUS_UNKNOWN;
-      cellular_command_simple_pdp(modem, "AT+CIPSTART=%d,TCP,\"%s\",%d", connid, host, port);
-
-      /* Wait for socket status URC. */
-      for (int i=0; i<SIM800_CONNECT_TIMEOUT; i++) {
-          if (priv->socket_status[connid] == SIM800_SOCKET_STATUS_CONNECTED) {
-              return 0;
-          } else if (priv->socket_status[connid] == SIM800_SOCKET_STATUS_ERROR) {
-              return -1;
-          }
-          vTaskDelay(pdMS_TO_TICKS(1000));
-      }
+      modem->dgram[connid] = false;
+      return sim800_socket_open(modem, connid, "TCP", host, port);
     }
 
     return -1;
 }
 
+static int sim800_socket_connect_udp(struct cellular *modem, int connid, const char *host, uint16_t port)
+{
+    if (connid < 0 || connid >= SIM800_NSOCKETS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* "CONNECT OK" just means the local socket is bound; UDP has no handshake. */
+    modem->dgram[connid] = true;
+    return sim800_socket_open(modem, connid, "UDP", host, port);
+}
+
 static enum at_response_type scanner_cipsend(const char *line, size_t len, void *arg)
 {
     (void) len;
@@ -470,7 +650,10 @@ static ssize_t sim800_socket_send(struct cellular *modem, int connid, const void
 {
     struct cellular_sim800 *priv = (struct cellular_sim800 *) modem;
     (void) flags;
-    if(connid == SIM800_NSOCKETS) {
+    if (priv->online && connid == priv->online_connid) {
+      /* Transparent or TLS connection; no framing needed. */
+      return at_online_write(modem->at, buffer, amount);
+    } else if(connid == SIM800_NSOCKETS) {
       if(priv->spp_status != SIM800_SOCKET_STATUS_CONNECTED) {
         return -1;
       }
@@ -484,7 +667,12 @@ static ssize_t sim800_socket_send(struct cellular *modem, int connid, const void
       if(priv->socket_status[connid] != SIM800_SOCKET_STATUS_CONNECTED) {
         return -1;
       }
-      amount = amount > 1460 ? 1460 : amount;
+      /* Splitting a datagram would change its meaning. */
+      if (modem->dgram[connid] && amount > SIM800_CIPSEND_MAX) {
+        errno = EMSGSIZE;
+        return -1;
+      }
+      amount = amount > SIM800_CIPSEND_MAX ? SIM800_CIPSEND_MAX : amount;
       /* Request transmission. */
       at_set_timeout(modem->at, SET_TIMEOUT);
       at_expect_dataprompt(modem->at);
@@ -513,12 +701,51 @@ static enum at_response_type scanner_ciprxget(const char *line, size_t len, void
     return AT_RESPONSE_UNKNOWN;
 }
 
+struct sim800_recv {
+    char *buffer;
+    size_t length;
+    size_t cnt;
+};
+
+static void sink_ciprxget(const void *data, size_t len, void *arg)
+{
+    struct sim800_recv *recv = arg;
+
+    if (len > recv->length - recv->cnt)
+        len = recv->length - recv->cnt;
+    memcpy(recv->buffer + recv->cnt, data, len);
+    recv->cnt += len;
+}
+
+/**
+ * Read one datagram. It goes straight into the caller's buffer, so the AT
+ * response buffer doesn't limit its size.
+ */
+static ssize_t sim800_socket_recv_dgram(struct cellular *modem, int connid, void *buffer, size_t length)
+{
+    struct sim800_recv recv = { buffer, length, 0 };
+    size_t chunk = length > SIM800_CIPSEND_MAX ? SIM800_CIPSEND_MAX : length;
+
+    at_set_timeout(modem->at, SET_TIMEOUT);
+    at_set_command_scanner(modem->at, scanner_ciprxget);
+    at_set_rawdata_sink(modem->at, sink_ciprxget, &recv);
+    const char *response = at_command(modem->at, "AT+CIPRXGET=2,%d,%zu", connid, chunk);
+
+    int requested, confirmed;
+    at_simple_scanf(response, "+CIPRXGET: 2,%*d,%d,%d", &requested, &confirmed);
+
+    return recv.cnt;
+}
+
 static ssize_t sim800_socket_recv(struct cellular *modem, int connid, void *buffer, size_t length, int flags)
 {
     struct cellular_sim800 *priv = (struct cellular_sim800 *) modem;
-    (void) flags;
 
     int cnt = 0;
+    if (priv->online && connid == priv->online_connid) {
+      int timeout = (flags & CELLULAR_MSG_WAIT) ? SIM800_RECV_TIMEOUT*1000 : 0;
+      return at_online_read(modem->at, buffer, length, timeout);
+    }
     // TODO its dumb and exceptions should be handled in other right way
     // FIXME: It has to be changed. Leave for now
     if(connid == SIM800_NSOCKETS) {
@@ -538,6 +765,8 @@ static ssize_t sim800_socket_recv(struct cellular *modem, int connid, void *buff
       if(priv->socket_status[connid] != SIM800_SOCKET_STATUS_CONNECTED) {
         return -1;
       }
+      if (modem->dgram[connid])
+        return sim800_socket_recv_dgram(modem, connid, buffer, length);
       char tries = 4;
       while ( (cnt < (int) length) && tries-- ){
           int chunk = (int) length - cnt;
@@ -583,27 +812,39 @@ static ssize_t sim800_socket_recv(struct cellular *modem, int connid, void *buff
     return cnt;
 }
 
-static int sim800_socket_waitack(struct cellular *modem, int connid)
+static int sim800_socket_ackpoll(struct cellular *modem)
 {
-    const char *response;
-    if(connid == SIM800_NSOCKETS) {
-      return 0;
-    } else if(connid < SIM800_NSOCKETS) {
-      at_set_timeout(modem->at, 5);
-      for (int i=0; i<SIM800_WAITACK_TIMEOUT; i++) {
-          /* Read number of bytes waiting. */
-          int nacklen;
-          response = at_command(modem->at, "AT+CIPACK=%d", connid);
-          at_simple_scanf(response, "+CIPACK: %*d,%*d,%d", &nacklen);
-
-          /* Return if all bytes were acknowledged. */
-          if (nacklen == 0)
-              return 0;
-
-          vTaskDelay(pdMS_TO_TICKS(1000));
-      }
+    struct cellular_sim800 *priv = (struct cellular_sim800 *) modem;
+
+    /* There is no all-sockets form of AT+CIPACK; query connected ones only. */
+    at_set_timeout(modem->at, 5);
+    for (int connid=0; connid<SIM800_NSOCKETS; connid++) {
+        if (priv->socket_status[connid] != SIM800_SOCKET_STATUS_CONNECTED) {
+            modem->unacked[connid] = -1;
+            continue;
+        }
+
+        /* Read number of bytes waiting. */
+        int nacklen;
+        const char *response = at_command(modem->at, "AT+CIPACK=%d", connid);
+        at_simple_scanf(response, "+CIPACK: %*d,%*d,%d", &nacklen);
+        modem->unacked[connid] = nacklen;
     }
-    return -1;
+
+    return 0;
+}
+
+static int sim800_socket_waitack(struct cellular *modem, int connid)
+{
+    struct cellular_sim800 *priv = (struct cellular_sim800 *) modem;
+
+    /* SPP and transparent connections have no ACK query. */
+    if (connid == SIM800_NSOCKETS || (priv->online && connid == priv->online_connid))
+        return 0;
+    if (connid > SIM800_NSOCKETS)
+        return -1;
+
+    return cellular_socket_waitack(modem, connid, SIM800_WAITACK_TIMEOUT);
 }
 
 static enum at_response_type scanner_cipclose(const char *line, size_t len, void *arg)
@@ -615,16 +856,182 @@ static enum at_response_type scanner_cipclose(const char *line, size_t len, void
     char last;
     if (sscanf(line, "%d, CLOSE O%c", &connid, &last) == 2 && last == 'K')
         return AT_RESPONSE_FINAL_OK;
+    if (!strcmp(line, "CLOSE OK"))
+        return AT_RESPONSE_FINAL_OK;
     return AT_RESPONSE_UNKNOWN;
 }
 
+static enum at_response_type scanner_cipstart_online(const char *line, size_t len, void *arg)
+{
+    (void) len;
+    (void) arg;
+
+    /* Swallow the intermediate OK so a successful response stays empty. */
+    if (!strcmp(line, "OK"))
+        return AT_RESPONSE_URC;
+    if (!strcmp(line, "CONNECT"))
+        return AT_RESPONSE_FINAL_OK;
+    if (!strcmp(line, "CONNECT FAIL") ||
+        !strcmp(line, "ALREADY CONNECT"))
+        return AT_RESPONSE_FINAL;
+    return AT_RESPONSE_UNKNOWN;
+}
+
+/**
+ * Transparent mode (AT+CIPMODE=1) only works in single connection mode, and
+ * AT+CIPMUX can only be changed with the IP application shut down. Switching
+ * back and forth is therefore expensive; use it for bulk transfers only.
+ *
+ * AT+CIPSSL is limited to single connection mode as well, so TLS sockets
+ * are run the same way. It is only ever set while a TLS socket is up, and
+ * firmware without TLS support rejects it.
+ */
+static int sim800_socket_multiplex(struct cellular *modem, bool ssl)
+{
+    /* Restore multiple connections mode. */
+    sim800_pdp_close(modem);
+    if (ssl)
+        at_command(modem->at, "AT+CIPSSL=0");
+    if (sim800_config(modem, "CIPMODE", "0", SIM800_CIPCFG_RETRIES) != 0)
+        return -1;
+    if (sim800_config(modem, "CIPMUX", "1", SIM800_CIPCFG_RETRIES) != 0)
+        return -1;
+
+    return 0;
+}
+
+static int sim800_socket_transparent(struct cellular *modem, int connid, const char *host, uint16_t port, bool ssl)
+{
+    struct cellular_sim800 *priv = (struct cellular_sim800 *) modem;
+    const char *response;
+
+    sim800_pdp_close(modem);
+    if (sim800_config(modem, "CIPMUX", "0", SIM800_CIPCFG_RETRIES) != 0)
+        goto fail;
+    if (sim800_config(modem, "CIPMODE", "1", SIM800_CIPCFG_RETRIES) != 0)
+        goto fail;
+    if (ssl) {
+        response = at_command(modem->at, "AT+CIPSSL=1");
+        if (response == NULL)
+            goto fail;
+        if (strcmp(response, "")) {
+            errno = ENOTSUP;
+            goto fail;
+        }
+    }
+
+    if (cellular_pdp_request(modem) != 0)
+        goto fail;
+
+    /* Modem switches to data mode right after "CONNECT". */
+    at_set_timeout(modem->at, SIM800_CONNECT_TIMEOUT);
+    at_set_command_scanner(modem->at, scanner_cipstart_online);
+    at_expect_online(modem->at);
+    response = at_command(modem->at, "AT+CIPSTART=\"TCP\",\"%s\",%d", host, port);
+    if (response == NULL || strcmp(response, "")) {
+        cellular_pdp_failure(modem);
+        goto fail;
+    }
+    cellular_pdp_success(modem);
+    priv->online = true;
+    priv->online_ssl = ssl;
+    priv->online_connid = connid;
+
+    return 0;
+
+fail:
+    {
+        /* Don't leave the modem in single connection mode. */
+        int saved = errno;
+        sim800_socket_multiplex(modem, ssl);
+        errno = saved;
+        return -1;
+    }
+}
+
+static int sim800_socket_online(struct cellular *modem, int connid, const char *host, uint16_t port)
+{
+    return sim800_socket_transparent(modem, connid, host, port, false);
+}
+
+static int sim800_socket_connect_tls(struct cellular *modem, int connid, const char *host, uint16_t port)
+{
+    return sim800_socket_transparent(modem, connid, host, port, true);
+}
+
+static bool sim800_sslsetcert_done(void *arg)
+{
+    struct cellular_sim800 *priv = arg;
+    return priv->sslsetcert_status != -1;
+}
+
+/**
+ * The SIM800 TLS stack only takes a client certificate, as a PKCS#12 file
+ * with an empty password. There's no way to install a CA, so the server
+ * certificate isn't verified.
+ */
+static int sim800_tls_cert(struct cellular *modem, enum cellular_cert_type type, const void *data, size_t len)
+{
+    struct cellular_sim800 *priv = (struct cellular_sim800 *) modem;
+    static const char file[] = "C:\\USER\\client.p12";
+
+    if (type != CELLULAR_CERT_CLIENT) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    /* Replace the certificate file. */
+    at_set_timeout(modem->at, SET_TIMEOUT);
+    at_command(modem->at, "AT+FSDEL=%s", file);
+    at_command_simple(modem->at, "AT+FSCREATE=%s", file);
+    at_expect_dataprompt(modem->at);
+    at_command_simple(modem->at, "AT+FSWRITE=%s,0,%zu,%d", file, len, SET_TIMEOUT);
+    at_command_raw_simple(modem->at, data, len);
+
+    /* Import it; the result is reported with "+SSLSETCERT: <status>". */
+    priv->sslsetcert_status = -1;
+    at_command_simple(modem->at, "AT+SSLSETCERT=\"%s\",\"\"", file);
+    if (!at_wait_until(modem->at, sim800_sslsetcert_done, priv, SET_TIMEOUT*1000)) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    if (priv->sslsetcert_status != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int sim800_socket_offline(struct cellular *modem)
+{
+    struct cellular_sim800 *priv = (struct cellular_sim800 *) modem;
+
+    /* Leave data mode; the connection stays open until closed. */
+    if (at_online_escape(modem->at) != 0)
+        return -1;
+
+    at_set_timeout(modem->at, SET_TIMEOUT);
+    at_set_command_scanner(modem->at, scanner_cipclose);
+    at_command(modem->at, "AT+CIPCLOSE");
+
+    bool ssl = priv->online_ssl;
+    priv->online = false;
+    priv->online_ssl = false;
+
+    return sim800_socket_multiplex(modem, ssl);
+}
+
 int sim800_socket_close(struct cellular *modem, int connid)
 {
     struct cellular_sim800 *priv = (struct cellular_sim800 *) modem;
 
-    if(connid == SIM800_NSOCKETS) {
+    if (priv->online) {
+        return sim800_socket_offline(modem);
+    } else if(connid == SIM800_NSOCKETS) {
       at_command_simple(modem->at, "AT+BTDISCONN=%d", priv->spp_connid);
     } else if(connid < SIM800_NSOCKETS) {
+      modem->dgram[connid] = false;
       at_set_timeout(modem->at, SET_TIMEOUT);
       at_set_command_scanner(modem->at, scanner_cipclose);
       at_command_simple(modem->at, "AT+CIPCLOSE=%d", connid);
@@ -667,12 +1074,19 @@ static int sim800_ftp_get(struct cellular *modem, const char *filename)
             return -1;
         }
 
-        vTaskDelay(pdMS_TO_TICKS(1000));
+        at_wait_until(modem->at, NULL, NULL, 1000);
     }
 
     return -1;
 }
 
+static int sim800_ftp_rest(struct cellular *modem, size_t offset)
+{
+    at_command_simple(modem->at, "AT+FTPREST=%zu", offset);
+
+    return 0;
+}
+
 static enum at_response_type scanner_ftpget2(const char *line, size_t len, void *arg)
 {
     (void) len;
@@ -706,7 +1120,7 @@ retry:
             if (++retries >= SIM800_FTP_TIMEOUT) {
                 return -1;
             }
-            vTaskDelay(pdMS_TO_TICKS(1000));
+            at_wait_until(modem->at, NULL, NULL, 1000);
             goto retry;
         }
 
@@ -728,6 +1142,176 @@ retry:
     }
 }
 
+struct sim800_ftp_wait {
+    struct cellular_sim800 *priv;
+    unsigned ready;
+};
+
+static bool sim800_ftp_progress(void *arg)
+{
+    struct sim800_ftp_wait *wait = arg;
+    return wait->priv->ftpget1_ready != wait->ready || wait->priv->ftpget1_status != 1;
+}
+
+static int sim800_ftp_download(struct cellular *modem, cellular_sink_t sink, void *arg,
+                               struct cellular_transfer_stats *stats)
+{
+    struct cellular_sim800 *priv = (struct cellular_sim800 *) modem;
+    struct cellular_transfer xfer;
+
+    cellular_transfer_begin(&xfer, sink, arg, stats);
+
+    while (!xfer.aborted) {
+        /* Any data-ready URC from now on means it's worth asking again. */
+        struct sim800_ftp_wait wait = { priv, priv->ftpget1_ready };
+
+        at_set_timeout(modem->at, SET_TIMEOUT);
+        at_set_command_scanner(modem->at, scanner_ftpget2);
+        at_set_rawdata_sink(modem->at, cellular_transfer_sink, &xfer);
+        const char *response = at_command(modem->at, "AT+FTPGET=2,%d", SIM800_FTPGET_MAX);
+        if (response == NULL)
+            goto fail;
+        xfer.stats->chunks++;
+
+        int cnflength;
+        if (sscanf(response, "+FTPGET: 2,%d", &cnflength) != 1) {
+            /* FTPGET=2 errors out once the session is over. */
+            if (priv->ftpget1_status == 0)
+                break;
+            errno = EPROTO;
+            goto fail;
+        }
+        if (cnflength > 0)
+            continue;
+
+        /* Nothing buffered. Finished, failed or just slow? */
+        if (priv->ftpget1_status == 0)
+            break;
+        if (priv->ftpget1_status != 1) {
+            errno = ECONNABORTED;
+            goto fail;
+        }
+        xfer.stats->stalls++;
+        if (!at_wait_until(modem->at, sim800_ftp_progress, &wait, SIM800_FTP_TIMEOUT*1000)) {
+            errno = ETIMEDOUT;
+            goto fail;
+        }
+    }
+
+    return cellular_transfer_end(&xfer);
+
+fail:
+    return cellular_transfer_fail(&xfer);
+}
+
+static bool sim800_ftpput_progress(void *arg)
+{
+    struct cellular_sim800 *priv = arg;
+    return priv->ftpput1_ready || (priv->ftpput1_status != -1 && priv->ftpput1_status != 1);
+}
+
+/**
+ * Wait until the modem is ready for the next chunk.
+ */
+static int sim800_ftpput_wait(struct cellular_sim800 *priv)
+{
+    if (!at_wait_until(priv->dev.at, sim800_ftpput_progress, priv, SIM800_FTP_TIMEOUT*1000)) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    if (!priv->ftpput1_ready) {
+        errno = ECONNABORTED;
+        return -1;
+    }
+    priv->ftpput1_ready = false;
+    return 0;
+}
+
+static int sim800_ftp_put(struct cellular *modem, const char *filename)
+{
+    struct cellular_sim800 *priv = (struct cellular_sim800 *) modem;
+
+    /* Configure filename. */
+    at_command_simple(modem->at, "AT+FTPPUTPATH=\"/\"");
+    at_command_simple(modem->at, "AT+FTPPUTNAME=\"%s\"", filename);
+
+    /* Try to open the connection. */
+    priv->ftpput1_status = -1;
+    priv->ftpput1_ready = false;
+    cellular_command_simple_pdp(modem, "AT+FTPPUT=1");
+
+    /* Wait for the first credit; it tells the chunk size. Don't consume it. */
+    if (sim800_ftpput_wait(priv) != 0)
+        return -1;
+    priv->ftpput1_ready = true;
+
+    priv->ftpput.buf = priv->ftpput_buf;
+    priv->ftpput.size = sizeof(priv->ftpput_buf);
+    if (priv->ftpput1_maxlength > 0 && priv->ftpput1_maxlength < (int) priv->ftpput.size)
+        priv->ftpput.size = priv->ftpput1_maxlength;
+    priv->ftpput.used = 0;
+
+    return 0;
+}
+
+static enum at_response_type scanner_ftpput2(const char *line, size_t len, void *arg)
+{
+    (void) len;
+    (void) arg;
+
+    /* The modem takes the payload right after this line; there's no prompt. */
+    int cnflength;
+    if (sscanf(line, "+FTPPUT: 2,%d", &cnflength) == 1)
+        return AT_RESPONSE_FINAL;
+    return AT_RESPONSE_UNKNOWN;
+}
+
+static int sim800_ftpput_flush(struct cellular *modem, const void *data, size_t len, bool eof)
+{
+    struct cellular_sim800 *priv = (struct cellular_sim800 *) modem;
+
+    if (len > 0) {
+        if (sim800_ftpput_wait(priv) != 0)
+            return -1;
+
+        at_set_timeout(modem->at, SET_TIMEOUT);
+        at_set_command_scanner(modem->at, scanner_ftpput2);
+        const char *response = at_command(modem->at, "AT+FTPPUT=2,%zu", len);
+        int cnflength;
+        at_simple_scanf(response, "+FTPPUT: 2,%d", &cnflength);
+        if (cnflength != (int) len) {
+            errno = EPROTO;
+            return -1;
+        }
+        at_command_raw_simple(modem->at, data, len);
+    }
+
+    if (eof) {
+        /* Closing the data connection is reported with "+FTPPUT: 1,0". */
+        if (sim800_ftpput_wait(priv) != 0)
+            return -1;
+        priv->ftpput1_status = -1;
+        at_command_simple(modem->at, "AT+FTPPUT=2,0");
+        if (!at_wait_until(modem->at, sim800_ftpput_progress, priv, SIM800_FTP_TIMEOUT*1000)) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if (priv->ftpput1_status != 0) {
+            errno = ECONNABORTED;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int sim800_ftp_putdata(struct cellular *modem, const void *buffer, size_t length)
+{
+    struct cellular_sim800 *priv = (struct cellular_sim800 *) modem;
+
+    return cellular_stage_put(modem, &priv->ftpput, buffer, length, sim800_ftpput_flush);
+}
+
 static int sim800_ftp_close(struct cellular *modem)
 {
     /* Requires fairly recent SIM800 firmware. */
@@ -736,6 +1320,133 @@ static int sim800_ftp_close(struct cellular *modem)
     return 0;
 }
 
+static enum at_response_type scanner_httpdata(const char *line, size_t len, void *arg)
+{
+    (void) len;
+    (void) arg;
+
+    /* The modem takes the body right after this line. */
+    if (!strcmp(line, "DOWNLOAD"))
+        return AT_RESPONSE_FINAL_OK;
+    return AT_RESPONSE_UNKNOWN;
+}
+
+static enum at_response_type scanner_httpread(const char *line, size_t len, void *arg)
+{
+    (void) len;
+    (void) arg;
+
+    int length;
+    if (sscanf(line, "+HTTPREAD: %d", &length) == 1)
+        return AT_RESPONSE_RAWDATA_FOLLOWS(length);
+    return AT_RESPONSE_UNKNOWN;
+}
+
+static bool sim800_http_done(void *arg)
+{
+    struct cellular_sim800 *priv = arg;
+    return priv->http_status != -1;
+}
+
+static int sim800_http_request(struct cellular *modem, struct cellular_http_request *req)
+{
+    struct cellular_sim800 *priv = (struct cellular_sim800 *) modem;
+
+    at_set_timeout(modem->at, SET_TIMEOUT);
+    at_command_simple(modem->at, "AT+HTTPINIT");
+    at_command_simple(modem->at, "AT+HTTPPARA=\"CID\",1");
+
+    /* URLs easily overflow the command buffer; send the line in pieces. */
+    static const char url_head[] = "AT+HTTPPARA=\"URL\",\"";
+    if (!at_send_raw(modem->at, url_head, strlen(url_head)) ||
+        !at_send_raw(modem->at, req->url, strlen(req->url)))
+        return -1;
+    at_command_raw_simple(modem->at, "\"\r", 2);
+
+    if (req->method == CELLULAR_HTTP_POST && req->body_len > 0) {
+        if (req->content_type)
+            at_command_simple(modem->at, "AT+HTTPPARA=\"CONTENT\",\"%s\"", req->content_type);
+        at_set_command_scanner(modem->at, scanner_httpdata);
+        at_command_simple(modem->at, "AT+HTTPDATA=%zu,%d", req->body_len, SET_TIMEOUT*1000);
+        at_command_raw_simple(modem->at, req->body, req->body_len);
+    }
+
+    /* Completion is signalled with "+HTTPACTION: <method>,<status>,<length>". */
+    priv->http_status = -1;
+    cellular_command_simple_pdp(modem, "AT+HTTPACTION=%d", (int) req->method);
+    if (!at_wait_until(modem->at, sim800_http_done, priv, SIM800_HTTP_TIMEOUT*1000)) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    req->status = priv->http_status;
+    req->length = priv->http_length;
+
+    return 0;
+}
+
+static int sim800_http_read(struct cellular *modem, struct cellular_http_request *req,
+                            struct cellular_transfer *xfer)
+{
+    size_t offset = 0;
+    while (offset < req->length && !xfer->aborted) {
+        size_t chunk = req->length - offset;
+        if (chunk > SIM800_HTTPREAD_MAX)
+            chunk = SIM800_HTTPREAD_MAX;
+
+        at_set_timeout(modem->at, SET_TIMEOUT);
+        at_set_command_scanner(modem->at, scanner_httpread);
+        at_set_rawdata_sink(modem->at, cellular_transfer_sink, xfer);
+        const char *response = at_command(modem->at, "AT+HTTPREAD=%zu,%zu", offset, chunk);
+        xfer->stats->chunks++;
+
+        int length;
+        at_simple_scanf(response, "+HTTPREAD: %d", &length);
+        if (length <= 0) {
+            errno = EPROTO;
+            return -1;
+        }
+        offset += length;
+    }
+
+    return 0;
+}
+
+static int sim800_http(struct cellular *modem, struct cellular_http_request *req,
+                       cellular_sink_t sink, void *arg, struct cellular_transfer_stats *stats)
+{
+    struct cellular_transfer xfer;
+
+    cellular_transfer_begin(&xfer, sink, arg, stats);
+
+    /* Clean up after an earlier request that didn't finish. */
+    at_set_timeout(modem->at, SET_TIMEOUT);
+    at_command(modem->at, "AT+HTTPTERM");
+
+    int result = sim800_http_request(modem, req);
+    if (result == 0 && sink)
+        result = sim800_http_read(modem, req, &xfer);
+
+    int saved = errno;
+    at_command(modem->at, "AT+HTTPTERM");
+    errno = saved;
+
+    if (result != 0)
+        return cellular_transfer_fail(&xfer);
+    if (cellular_transfer_end(&xfer) != 0)
+        return -1;
+    return req->status;
+}
+
+static int sim800_locate_async(struct cellular *modem)
+{
+    /* The fix comes in a "+CIPGSMLOC: " line, handled as a URC. The modem
+     * only sends OK after it, so this holds the channel for the lookup. */
+    at_set_timeout(modem->at, SIM800_LOCATE_TIMEOUT);
+    cellular_command_simple_pdp(modem, "AT+CIPGSMLOC=1,1");
+
+    return 0;
+}
+
 static const struct cellular_ops sim800_ops = {
     .attach = sim800_attach,
     .detach = sim800_detach,
@@ -745,31 +1456,56 @@ static const struct cellular_ops sim800_ops = {
 
     .imei = cellular_op_imei,
     .iccid = cellular_op_iccid,
+    .identity = cellular_op_identity,
     .creg = cellular_op_creg,
     .rssi = cellular_op_rssi,
-//    .clock_gettime = sim800_clock_gettime,
-//    .clock_settime = sim800_clock_settime,
-//    .clock_ntptime = sim800_clock_ntptime,
+    .clock_gettime = cellular_op_clock_gettime,
+    .clock_settime = cellular_op_clock_settime,
+    .clock_ntptime = sim800_clock_ntptime,
+    .resolve = sim800_resolve,
+    .resolve_async = sim800_resolve_async,
     .socket_connect = sim800_socket_connect,
+    .socket_connect_udp = sim800_socket_connect_udp,
     .socket_send = sim800_socket_send,
     .socket_recv = sim800_socket_recv,
     .socket_waitack = sim800_socket_waitack,
     .socket_close = sim800_socket_close,
+    .socket_ackpoll = sim800_socket_ackpoll,
+    .socket_online = sim800_socket_online,
+    .socket_connect_tls = sim800_socket_connect_tls,
+    .tls_cert = sim800_tls_cert,
     .ftp_open = sim800_ftp_open,
     .ftp_get = sim800_ftp_get,
+    .ftp_rest = sim800_ftp_rest,
     .ftp_getdata = sim800_ftp_getdata,
+    .ftp_download = sim800_ftp_download,
+    .ftp_put = sim800_ftp_put,
+    .ftp_putdata = sim800_ftp_putdata,
     .ftp_close = sim800_ftp_close,
+    .http = sim800_http,
+    .locate = cellular_op_locate,
+    .locate_async = sim800_locate_async,
 };
 
+static struct cellular_ops sim800_wrapped_ops;
+
 struct cellular *cellular_sim800_alloc(void)
 {
     struct cellular_sim800 *modem = malloc(sizeof(struct cellular_sim800));
     if (modem == NULL) {
         return NULL;
     }
+
+    return cellular_sim800_init(modem);
+}
+
+struct cellular *cellular_sim800_init(void *storage)
+{
+    struct cellular_sim800 *modem = storage;
     memset(modem, 0, sizeof(*modem));
 
     modem->dev.ops = &sim800_ops;
+    cellular_wrap_ops(&modem->dev, &sim800_wrapped_ops);
 
     return (struct cellular *) modem;
 }
@@ -18,15 +18,21 @@ struct cellular_generic {
     struct cellular dev;
 };
 
+/* Fail the build if CELLULAR_GENERIC_SIZE is too small. */
+typedef char cellular_generic_size_check[sizeof(struct cellular_generic) <= CELLULAR_GENERIC_SIZE ? 1 : -1];
+
 static const struct cellular_ops generic_ops = {
     .imei = cellular_op_imei,
     .iccid = cellular_op_iccid,
+    .identity = cellular_op_identity,
     .creg = cellular_op_creg,
     .rssi = cellular_op_rssi,
-//    .clock_gettime = cellular_op_clock_gettime,
-//    .clock_settime = cellular_op_clock_settime,
+    .clock_gettime = cellular_op_clock_gettime,
+    .clock_settime = cellular_op_clock_settime,
 };
 
+static struct cellular_ops generic_wrapped_ops;
+
 
 struct cellular *cellular_generic_alloc(void)
 {
@@ -35,7 +41,16 @@ struct cellular *cellular_generic_alloc(void)
         return NULL;
     }
 
+    return cellular_generic_init(modem);
+}
+
+struct cellular *cellular_generic_init(void *storage)
+{
+    struct cellular_generic *modem = storage;
+    memset(modem, 0, sizeof(*modem));
+
     modem->dev.ops = &generic_ops;
+    cellular_wrap_ops(&modem->dev, &generic_wrapped_ops);
 
     return (struct cellular *) modem;
 }
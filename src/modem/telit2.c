@@ -8,16 +8,28 @@
 
 #include <attentive/cellular.h>
 
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
-#include <unistd.h>
 
-#include "common.h"
+#include "at-common.h"
 
 
+#define TELIT2_NSOCKETS 6
+#define TELIT2_LINE_LENGTH 80
+#define TELIT2_SRECV_MAX 1500
+#define TELIT2_SSENDEXT_MAX 1500
+#define TELIT2_SSLRECV_MAX 1000
+#define TELIT2_SSLID 1
+#define TELIT2_DNS_TIMEOUT 30
+#define TELIT2_NTP_TIMEOUT 20
+#define TELIT2_RECV_TIMEOUT 60
 #define TELIT2_WAITACK_TIMEOUT 60
 #define TELIT2_FTP_TIMEOUT 60
-#define TELIT2_LOCATE_TIMEOUT 150
+#define TELIT2_FTPRECV_MAX 3000
+#define TELIT2_FTPAPPEXT_MAX 1500
+#define TELIT2_FTP_POLL_INITIAL 50
+#define TELIT2_FTP_POLL_MAX 1000
 
 static const char *const telit2_urc_responses[] = {
     "SRING: ",
@@ -28,10 +40,23 @@ static const char *const telit2_urc_responses[] = {
 struct cellular_telit2 {
     struct cellular dev;
 
-    int locate_status;
-    float latitude, longitude, altitude;
+    /* Bytes waiting in the modem, as reported by SRING. -1 if unknown. */
+    int pending[TELIT2_NSOCKETS+1];
+
+    struct cellular_stage ftpput;
+    char ftpput_buf[TELIT2_FTPAPPEXT_MAX];
+
+    /* The only TLS socket (SSId 1) maps to this connId; 0 if none. */
+    int ssl_connid;
+    bool ssl_ca;
+
+    /* The all-socket #SI;#SS reply overflowed the parser; poll per socket. */
+    bool ackpoll_split;
 };
 
+/* Fail the build if CELLULAR_TELIT2_SIZE is too small. */
+typedef char cellular_telit2_size_check[sizeof(struct cellular_telit2) <= CELLULAR_TELIT2_SIZE ? 1 : -1];
+
 static enum at_response_type scan_line(const char *line, size_t len, void *arg)
 {
     (void) line;
@@ -42,6 +67,8 @@ static enum at_response_type scan_line(const char *line, size_t len, void *arg)
 
     if (at_prefix_in_table(line, telit2_urc_responses))
         return AT_RESPONSE_URC;
+    if (cellular_is_network_urc(line))
+        return AT_RESPONSE_URC;
 
     return AT_RESPONSE_UNKNOWN;
 }
@@ -50,10 +77,29 @@ static void handle_urc(const char *line, size_t len, void *arg)
 {
     struct cellular_telit2 *priv = arg;
 
+    if (cellular_handle_network_urc(&priv->dev, line))
+        return;
+
+    /* Data pending notification; srMode 1 reports the amount received. It
+     * adds to what socket_recv() hasn't read yet. */
+    int connid, amount;
+    int fields = sscanf(line, "SRING: %d,%d", &connid, &amount);
+    if (fields >= 1 && connid >= 1 && connid <= TELIT2_NSOCKETS) {
+        if (fields == 2 && priv->pending[connid] >= 0)
+            priv->pending[connid] += amount;
+        else
+            priv->pending[connid] = -1;
+        return;
+    }
+
     int status;
     if (sscanf(line, "#AGPSRING: %d", &status) == 1) {
-        priv->locate_status = status;
-        sscanf(line, "#AGPSRING: %*d,%f,%f,%f", &priv->latitude, &priv->longitude, &priv->altitude);
+        struct cellular_location loc = { .altitude = 0 };
+        if (status == 200 &&
+            sscanf(line, "#AGPSRING: %*d,%f,%f,%f", &loc.latitude, &loc.longitude, &loc.altitude) >= 2)
+            cellular_locate_done(&priv->dev, 0, &loc);
+        else
+            cellular_locate_done(&priv->dev, ECONNABORTED, NULL);
         return;
     }
 
@@ -65,6 +111,14 @@ static const struct at_callbacks telit2_callbacks = {
     .handle_urc = handle_urc,
 };
 
+static const struct cellular_setting telit2_profile[] = {
+    { "&K", "0", NULL, false, true },                   /* Disable hardware flow control. */
+    { "#SELINT", "2", NULL, false, false },             /* Set Telit module compatibility level. */
+    { "+CMEE", "2", NULL, false, false },               /* Enable extended error reporting. */
+    { "+CREG", "2", NULL, false, false },               /* Report registration and cell changes. */
+    { "+CGREG", "2", NULL, false, false },              /* Report GPRS registration changes. */
+};
+
 static int telit2_attach(struct cellular *modem)
 {
     at_set_callbacks(modem->at, &telit2_callbacks, (void *) modem);
@@ -73,15 +127,13 @@ static int telit2_attach(struct cellular *modem)
     at_command(modem->at, "AT");        /* Aid autobauding. Always a good idea. */
     at_command(modem->at, "ATE0");      /* Disable local echo. */
 
-    /* Initialize modem. */
-    static const char *const init_strings[] = {
-        "AT&K0",                        /* Disable hardware flow control. */
-        "AT#SELINT=2",                  /* Set Telit module compatibility level. */
-        "AT+CMEE=2",                    /* Enable extended error reporting. */
-        NULL
-    };
-    for (const char *const *command=init_strings; *command; command++)
-        at_command_simple(modem->at, "%s", *command);
+    /* Initialize modem. Only settings that differ are sent. */
+    if (cellular_apply_profile(modem, telit2_profile,
+                               sizeof(telit2_profile)/sizeof(*telit2_profile),
+                               NULL, TELIT2_LINE_LENGTH) != 0)
+        return -1;
+    /* No signal strength URC in SELINT 2; rssi() falls back to queries. */
+    modem->creg_urc = true;
 
     return 0;
 }
@@ -115,7 +167,9 @@ static int telit2_pdp_open(struct cellular *modem, const char *apn)
 static int telit2_pdp_close(struct cellular *modem)
 {
     at_set_timeout(modem->at, 150);
+    modem->pdp_state = CELLULAR_PDP_UNKNOWN;
     at_command_simple(modem->at, "AT#SGACT=1,0");
+    modem->pdp_state = CELLULAR_PDP_DOWN;
 
     return 0;
 }
@@ -136,62 +190,205 @@ static int telit2_op_iccid(struct cellular *modem, char *buf, size_t len)
     return 0;
 }
 
-static int telit2_op_clock_gettime(struct cellular *modem, struct timespec *ts)
+static int telit2_op_identity(struct cellular *modem, char *imei, size_t imei_len, char *iccid, size_t iccid_len)
+{
+    return cellular_identity(modem, "#CCID", imei, imei_len, iccid, iccid_len);
+}
+
+static int telit2_clock_ntptime(struct cellular *modem, struct timespec *ts)
 {
-    struct tm tm;
-    int offset;
+    if (cellular_pdp_request(modem) != 0)
+        return -1;
 
-    at_set_timeout(modem->at, 1);
-    const char *response = at_command(modem->at, "AT+CCLK?");
-    memset(&tm, 0, sizeof(struct tm));
-    at_simple_scanf(response, "+CCLK: \"%d/%d/%d,%d:%d:%d%d\"",
-            &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
-            &tm.tm_hour, &tm.tm_min, &tm.tm_sec,
-            &offset);
-
-    /* Most modems report some starting date way in the past when they have
-     * no date/time estimation. */
-    if (tm.tm_year < 14) {
+    /* Query the server and update the RTC with the result. */
+    at_set_timeout(modem->at, TELIT2_NTP_TIMEOUT);
+    const char *response = at_command(modem->at, "AT#NTP=\"%s\",123,1,10", CELLULAR_NTP_SERVER);
+    if (response == NULL)
+        return -1;
+    if (strncmp(response, "#NTP: ", 6)) {
+        errno = EIO;
+        return -1;
+    }
+
+    return cellular_op_clock_gettime(modem, ts);
+}
+
+static int telit2_resolve(struct cellular *modem, const char *host, char *ip, size_t len)
+{
+    if (cellular_pdp_request(modem) != 0)
+        return -1;
+
+    at_set_timeout(modem->at, TELIT2_DNS_TIMEOUT);
+    const char *response = at_command(modem->at, "AT#QDNS=\"%s\"", host);
+    if (response == NULL)
+        return -1;
+
+    /* Expected response: #QDNS: "<host>","<ip>" */
+    char name[CELLULAR_DNS_HOST_LENGTH];
+    if (strncmp(response, "#QDNS: ", 7) ||
+        !cellular_parse_dns(response, name, sizeof(name), ip, len))
+    {
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int telit2_sd(struct cellular *modem, int connid, int proto, const char *host, uint16_t port)
+{
+    cellular_command_simple_pdp(modem, "AT#SD=%d,%d,%d,%s,0,0,1", connid, proto, port, host);
+
+    return 0;
+}
+
+/**
+ * Open a socket. Protocol 0 is TCP, 1 is UDP.
+ */
+static int telit2_socket_open(struct cellular *modem, int connid, int proto, const char *host, uint16_t port)
+{
+    struct cellular_telit2 *priv = (struct cellular_telit2 *) modem;
+
+    if (connid < 1 || connid > TELIT2_NSOCKETS) {
         errno = EINVAL;
-        return 1;
+        return -1;
     }
+    priv->pending[connid] = 0;
+    modem->unacked[connid] = 0;
+    modem->dgram[connid] = (proto == 1);
+
+    /* Reset socket configuration to default, except for SRING which should
+     * report the amount of data pending (srMode 1). */
+    at_set_timeout(modem->at, 5);
+    at_command_simple(modem->at, "AT#SCFGEXT=%d,1,0,0,0,0", connid);
+    at_command_simple(modem->at, "AT#SCFGEXT2=%d,0,0,0,0,0", connid);
+
+    /* Connect by address if we know it; saves a lookup over the air. */
+    char ip[CELLULAR_IP_LENGTH];
+    bool resolved = (cellular_resolve(modem, host, ip, sizeof(ip)) == 0);
+
+    if (telit2_sd(modem, connid, proto, resolved ? ip : host, port) == 0)
+        return 0;
+
+    /* The server may have moved; look it up afresh next time. */
+    if (resolved)
+        cellular_dns_forget(modem, host);
+    return -1;
+}
+
+static int telit2_socket_connect(struct cellular *modem, int connid, const char *host, uint16_t port)
+{
+    return telit2_socket_open(modem, connid, 0, host, port);
+}
+
+static int telit2_socket_connect_udp(struct cellular *modem, int connid, const char *host, uint16_t port)
+{
+    return telit2_socket_open(modem, connid, 1, host, port);
+}
+
+/*
+ * TLS sockets. The module supports a single one, SSId 1, with its own set of
+ * commands; socket ops dispatch to it by connId.
+ */
+
+static int telit2_socket_connect_tls(struct cellular *modem, int connid, const char *host, uint16_t port)
+{
+    struct cellular_telit2 *priv = (struct cellular_telit2 *) modem;
 
-    /* Adjust values and perform conversion. */
-    tm.tm_year += 2000 - 1900;
-    tm.tm_mon -= 1;
-    time_t unix_time = timegm(&tm);
-    if (unix_time == -1) {
+    if (connid < 1 || connid > TELIT2_NSOCKETS) {
         errno = EINVAL;
         return -1;
     }
+    if (priv->ssl_connid != 0 && priv->ssl_connid != connid) {
+        errno = EBUSY;
+        return -1;
+    }
 
-    /* Telit modems return local date/time instead of UTC (as defined in 3GPP
-     * 27.007). Remove the timezone shift. */
-    unix_time -= 15*60*offset;
+    /* Verify the server only if we have something to verify it against. */
+    at_set_timeout(modem->at, 5);
+    at_command_simple(modem->at, "AT#SSLEN=%d,1", TELIT2_SSLID);
+    at_command_simple(modem->at, "AT#SSLSECCFG=%d,0,%d", TELIT2_SSLID, priv->ssl_ca ? 1 : 0);
+
+    /* Open connection in command mode. */
+    at_set_timeout(modem->at, 150);
+    cellular_command_simple_pdp(modem, "AT#SSLD=%d,%d,\"%s\",0,1", TELIT2_SSLID, port, host);
+    priv->ssl_connid = connid;
 
-    /* All good. Return the result. */
-    ts->tv_sec = unix_time;
-    ts->tv_nsec = 0;
     return 0;
 }
 
-static int telit2_socket_connect(struct cellular *modem, int connid, const char *host, uint16_t port)
+static int telit2_tls_cert(struct cellular *modem, enum cellular_cert_type type, const void *data, size_t len)
 {
-    /* Reset socket configuration to default. */
+    struct cellular_telit2 *priv = (struct cellular_telit2 *) modem;
+
+    /* #SSLSECDATA data types: 0 client cert, 1 CA cert, 2 private key. */
+    int datatype;
+    switch (type) {
+        case CELLULAR_CERT_CLIENT: datatype = 0; break;
+        case CELLULAR_CERT_CA: datatype = 1; break;
+        case CELLULAR_CERT_KEY: datatype = 2; break;
+        default:
+            errno = EINVAL;
+            return -1;
+    }
+
+    /* Security data can only be written with the SSL socket enabled. */
     at_set_timeout(modem->at, 5);
-    at_command_simple(modem->at, "AT#SCFGEXT=%d,0,0,0,0,0", connid);
-    at_command_simple(modem->at, "AT#SCFGEXT2=%d,0,0,0,0,0", connid);
+    at_command_simple(modem->at, "AT#SSLEN=%d,1", TELIT2_SSLID);
+    at_expect_dataprompt(modem->at);
+    at_command_simple(modem->at, "AT#SSLSECDATA=%d,1,%d,%zu", TELIT2_SSLID, datatype, len);
+    at_command_raw_simple(modem->at, data, len);
 
-    /* Open connection. */
-    cellular_command_simple_pdp(modem, "AT#SD=%d,0,%d,%s,0,0,1", connid, port, host);
+    if (type == CELLULAR_CERT_CA)
+        priv->ssl_ca = true;
 
     return 0;
 }
 
+static ssize_t telit2_ssl_send(struct cellular *modem, const void *buffer, size_t amount)
+{
+    if (amount > TELIT2_SSENDEXT_MAX)
+        amount = TELIT2_SSENDEXT_MAX;
+
+    at_set_timeout(modem->at, 150);
+    at_expect_dataprompt(modem->at);
+    at_command_simple(modem->at, "AT#SSLSENDEXT=%d,%zu", TELIT2_SSLID, amount);
+    at_command_raw_simple(modem->at, buffer, amount);
+
+    return amount;
+}
+
+static enum at_response_type scanner_sslrecv(const char *line, size_t len, void *arg)
+{
+    (void) len;
+    (void) arg;
+
+    int bytes;
+    if (sscanf(line, "#SSLRECV: %d", &bytes) == 1)
+        return AT_RESPONSE_RAWDATA_FOLLOWS(bytes);
+    /* Nothing arrived within the timeout. */
+    if (!strcmp(line, "TIMEOUT"))
+        return AT_RESPONSE_INTERMEDIATE;
+
+    return AT_RESPONSE_UNKNOWN;
+}
+
 static ssize_t telit2_socket_send(struct cellular *modem, int connid, const void *buffer, size_t amount, int flags)
 {
+    struct cellular_telit2 *priv = (struct cellular_telit2 *) modem;
     (void) flags;
 
+    if (priv->ssl_connid != 0 && connid == priv->ssl_connid)
+        return telit2_ssl_send(modem, buffer, amount);
+
+    /* One send is one datagram; it can't be split. */
+    if (connid >= 1 && connid <= TELIT2_NSOCKETS &&
+        modem->dgram[connid] && amount > TELIT2_SSENDEXT_MAX)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
     /* Request transmission. */
     at_set_timeout(modem->at, 150);
     at_expect_dataprompt(modem->at);
@@ -215,82 +412,271 @@ static enum at_response_type scanner_srecv(const char *line, size_t len, void *a
     return AT_RESPONSE_UNKNOWN;
 }
 
+struct telit2_recv {
+    struct cellular_telit2 *priv;
+    int connid;
+    char *buffer;
+    size_t length;
+    size_t cnt;
+};
+
+static void sink_srecv(const void *data, size_t len, void *arg)
+{
+    struct telit2_recv *recv = arg;
+
+    /* Never trust the modem to stick to the requested size. */
+    if (len > recv->length - recv->cnt)
+        len = recv->length - recv->cnt;
+    memcpy(recv->buffer + recv->cnt, data, len);
+    recv->cnt += len;
+}
+
+static ssize_t telit2_ssl_recv(struct cellular *modem, void *buffer, size_t length, int flags)
+{
+    struct telit2_recv recv = {
+        .buffer = buffer,
+        .length = length,
+    };
+
+    /* #SSLRECV blocks in the module itself, for up to the given timeout. */
+    int timeout = (flags & CELLULAR_MSG_WAIT) ? TELIT2_RECV_TIMEOUT : 1;
+    int chunk = length > TELIT2_SSLRECV_MAX ? TELIT2_SSLRECV_MAX : (int) length;
+
+    at_set_timeout(modem->at, timeout + 5);
+    at_set_command_scanner(modem->at, scanner_sslrecv);
+    at_set_rawdata_sink(modem->at, sink_srecv, &recv);
+    const char *response = at_command(modem->at, "AT#SSLRECV=%d,%d,%d", TELIT2_SSLID, chunk, timeout);
+    if (response == NULL)
+        return -1;
+    if (!strcmp(response, "TIMEOUT"))
+        return 0;
+
+    int bytes;
+    at_simple_scanf(response, "#SSLRECV: %d", &bytes);
+
+    return recv.cnt;
+}
+
+static bool telit2_data_pending(void *arg)
+{
+    struct telit2_recv *recv = arg;
+
+    return recv->priv->pending[recv->connid] != 0;
+}
+
 static ssize_t telit2_socket_recv(struct cellular *modem, int connid, void *buffer, size_t length, int flags)
 {
-    (void) flags;
+    struct cellular_telit2 *priv = (struct cellular_telit2 *) modem;
+
+    if (connid < 1 || connid > TELIT2_NSOCKETS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (priv->ssl_connid != 0 && connid == priv->ssl_connid)
+        return telit2_ssl_recv(modem, buffer, length, flags);
+
+    struct telit2_recv recv = {
+        .priv = priv,
+        .connid = connid,
+        .buffer = buffer,
+        .length = length,
+    };
 
-    int cnt = 0;
-    while (cnt < (int) length) {
-        int chunk = (int) length - cnt;
-        /* Limit read size to avoid overflowing AT response buffer. */
-        if (chunk > 128)
-            chunk = 128;
+    /* SRING tells us when there's something to read; don't poll for it. */
+    if ((flags & CELLULAR_MSG_WAIT) && !telit2_data_pending(&recv)) {
+        if (!at_wait_until(modem->at, telit2_data_pending, &recv, TELIT2_RECV_TIMEOUT*1000)) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+
+    while (recv.cnt < length && priv->pending[connid] != 0) {
+        /* SRINGs keep arriving while we read; remember what we started
+         * from so they aren't lost below. */
+        at_urc_lock(modem->at);
+        int pending = priv->pending[connid];
+        at_urc_unlock(modem->at);
+
+        /* Read as much as is pending; the payload bypasses the AT response
+         * buffer so the modem maximum is the only limit. */
+        int chunk = (int) (length - recv.cnt);
+        if (pending > 0 && chunk > pending)
+            chunk = pending;
+        if (chunk > TELIT2_SRECV_MAX)
+            chunk = TELIT2_SRECV_MAX;
 
         /* Perform the read. */
         at_set_timeout(modem->at, 150);
         at_set_command_scanner(modem->at, scanner_srecv);
+        at_set_rawdata_sink(modem->at, sink_srecv, &recv);
         const char *response = at_command(modem->at, "AT#SRECV=%d,%d", connid, chunk);
         if (response == NULL)
             return -1;
 
-        /* Find the header line. */
-        int bytes;
-        at_simple_scanf(response, "#SRECV: %*d,%d", &bytes);
+        /* Out of data if this fails. Message is misleading. */
+        int bytes = 0;
+        if (strcmp(response, "+CME ERROR: activation failed"))
+            at_simple_scanf(response, "#SRECV: %*d,%d", &bytes);
+
+        at_urc_lock(modem->at);
+        if (bytes < chunk && priv->pending[connid] == pending) {
+            /* Short read and no SRING since: the modem buffer is drained. */
+            priv->pending[connid] = 0;
+        } else if (priv->pending[connid] > bytes) {
+            priv->pending[connid] -= bytes;
+        } else {
+            /* Reported amount consumed; more may have arrived meanwhile
+             * without another SRING. Probe once before trusting it. */
+            priv->pending[connid] = -1;
+        }
+        at_urc_unlock(modem->at);
 
-        /* Bail out if we're out of data. Message is misleading. */
-        /* FIXME: We should maybe block until we receive something? */
-        if (!strcmp(response, "+CME ERROR: activation failed"))
+        /* Keep datagram boundaries: one read, one datagram. */
+        if (modem->dgram[connid])
             break;
+    }
 
-        /* Locate the payload. */
-        const char *data = strchr(response, '\n');
-        if (data == NULL) {
-            errno = EPROTO;
+    return recv.cnt;
+}
+
+/**
+ * Send #SI and #SS in one round trip and update the ACK counters from the
+ * replies. Fails with EMSGSIZE if the reply didn't fit the parser buffer.
+ */
+static int telit2_ackpoll_batch(struct cellular *modem, const char *si_cmd, const char *ss_cmd)
+{
+    char si[TELIT2_NSOCKETS*40], ss[TELIT2_NSOCKETS*48];
+    struct at_batch cmds[] = {
+        { si_cmd, si, sizeof(si), 0 },
+        { ss_cmd, ss, sizeof(ss), 0 },
+    };
+    unsigned truncations = at_parser_truncations(modem->at->parser);
+    at_set_timeout(modem->at, 5);
+    int result = at_command_batch(modem->at, cmds, 2, TELIT2_LINE_LENGTH);
+
+    /* A truncated reply loses the #SS lines, and with them the closes. */
+    if (at_parser_truncations(modem->at->parser) != truncations) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (result != 0)
+        return -1;
+
+    for (const char *line = si; line; line = strchr(line, '\n')) {
+        int connid, ack_waiting;
+        if (*line == '\n')
+            line++;
+        if (sscanf(line, "#SI: %d,%*d,%*d,%*d,%d", &connid, &ack_waiting) == 2 &&
+            connid >= 1 && connid <= TELIT2_NSOCKETS)
+            modem->unacked[connid] = ack_waiting;
+    }
+
+    /* ack_waiting is meaningless if socket is not connected. Check this. */
+    for (const char *line = ss; line; line = strchr(line, '\n')) {
+        int connid, socket_status;
+        if (*line == '\n')
+            line++;
+        if (sscanf(line, "#SS: %d,%d", &connid, &socket_status) == 2 &&
+            connid >= 1 && connid <= TELIT2_NSOCKETS && socket_status == 0)
+            modem->unacked[connid] = -1;
+    }
+
+    return 0;
+}
+
+static int telit2_socket_ackpoll(struct cellular *modem)
+{
+    struct cellular_telit2 *priv = (struct cellular_telit2 *) modem;
+
+    /* Without a connId, #SI and #SS report all sockets at once. */
+    if (!priv->ackpoll_split) {
+        if (telit2_ackpoll_batch(modem, "#SI", "#SS") == 0)
+            return 0;
+        if (errno != EMSGSIZE)
             return -1;
-        }
-        data += 1;
+        priv->ackpoll_split = true;
+    }
 
-        /* Copy payload to result buffer. */
-        memcpy((char *)buffer + cnt, data, bytes);
-        cnt += bytes;
+    /* The parser buffer is too small for that; ask about each open socket. */
+    for (int connid=1; connid<=TELIT2_NSOCKETS; connid++) {
+        if (modem->unacked[connid] < 0)
+            continue;
+        char si_cmd[8], ss_cmd[8];
+        snprintf(si_cmd, sizeof(si_cmd), "#SI=%d", connid);
+        snprintf(ss_cmd, sizeof(ss_cmd), "#SS=%d", connid);
+        if (telit2_ackpoll_batch(modem, si_cmd, ss_cmd) != 0)
+            return -1;
     }
 
-    return cnt;
+    return 0;
 }
 
 static int telit2_socket_waitack(struct cellular *modem, int connid)
 {
-    const char *response;
+    struct cellular_telit2 *priv = (struct cellular_telit2 *) modem;
+
+    /* #SI doesn't cover the TLS socket. */
+    if (priv->ssl_connid != 0 && connid == priv->ssl_connid)
+        return 0;
+
+    return cellular_socket_waitack(modem, connid, TELIT2_WAITACK_TIMEOUT);
+}
+
+static enum at_response_type scanner_sd_online(const char *line, size_t len, void *arg)
+{
+    (void) len;
+    (void) arg;
+
+    if (!strcmp(line, "CONNECT"))
+        return AT_RESPONSE_FINAL_OK;
+    return AT_RESPONSE_UNKNOWN;
+}
 
+static int telit2_socket_online(struct cellular *modem, int connid, const char *host, uint16_t port)
+{
+    /* Reset socket configuration to default. */
     at_set_timeout(modem->at, 5);
-    for (int i=0; i<TELIT2_WAITACK_TIMEOUT; i++) {
-        /* Read number of bytes waiting. */
-        int ack_waiting;
-        response = at_command(modem->at, "AT#SI=%d", connid);
-        at_simple_scanf(response, "#SI: %*d,%*d,%*d,%*d,%d", &ack_waiting);
-
-        /* ack_waiting is meaningless if socket is not connected. Check this. */
-        int socket_status;
-        response = at_command(modem->at, "AT#SS=%d", connid);
-        at_simple_scanf(response, "#SS: %*d,%d", &socket_status);
-        if (socket_status == 0) {
-            errno = ECONNRESET;
-            return -1;
-        }
+    at_command_simple(modem->at, "AT#SCFGEXT=%d,0,0,0,0,0", connid);
+    at_command_simple(modem->at, "AT#SCFGEXT2=%d,0,0,0,0,0", connid);
 
-        /* Return if all bytes were acknowledged. */
-        if (ack_waiting == 0)
-            return 0;
+    if (cellular_pdp_request(modem) != 0)
+        return -1;
 
-        sleep(1);
+    /* Open connection in online mode (connMode 0). */
+    at_set_timeout(modem->at, 150);
+    at_set_command_scanner(modem->at, scanner_sd_online);
+    at_expect_online(modem->at);
+    const char *response = at_command(modem->at, "AT#SD=%d,0,%d,%s,0,0,0", connid, port, host);
+    if (response == NULL || strcmp(response, "")) {
+        cellular_pdp_failure(modem);
+        return -1;
     }
+    cellular_pdp_success(modem);
 
-    errno = ETIMEDOUT;
-    return -1;
+    return 0;
 }
 
 static int telit2_socket_close(struct cellular *modem, int connid)
 {
+    struct cellular_telit2 *priv = (struct cellular_telit2 *) modem;
+
+    if (connid >= 1 && connid <= TELIT2_NSOCKETS) {
+        priv->pending[connid] = 0;
+        modem->dgram[connid] = false;
+    }
+
+    if (priv->ssl_connid != 0 && connid == priv->ssl_connid) {
+        priv->ssl_connid = 0;
+        at_set_timeout(modem->at, 150);
+        at_command_simple(modem->at, "AT#SSLH=%d", TELIT2_SSLID);
+        return 0;
+    }
+
+    /* Escaping suspends the socket; it can be closed normally afterwards. */
+    if (at_is_online(modem->at) && at_online_escape(modem->at) != 0)
+        return -1;
+
     at_set_timeout(modem->at, 150);
     at_command_simple(modem->at, "AT#SH=%d", connid);
 
@@ -312,6 +698,57 @@ static int telit2_ftp_get(struct cellular *modem, const char *filename)
     return 0;
 }
 
+static int telit2_ftp_rest(struct cellular *modem, size_t offset)
+{
+    at_set_timeout(modem->at, 5);
+    at_command_simple(modem->at, "AT#FTPREST=%zu", offset);
+
+    return 0;
+}
+
+static int telit2_ftp_put(struct cellular *modem, const char *filename)
+{
+    struct cellular_telit2 *priv = (struct cellular_telit2 *) modem;
+
+    /* Command mode: data goes through #FTPAPPEXT, not the data connection. */
+    at_set_timeout(modem->at, 90);
+    at_command_simple(modem->at, "AT#FTPPUT=\"%s\",1", filename);
+
+    priv->ftpput.buf = priv->ftpput_buf;
+    priv->ftpput.size = sizeof(priv->ftpput_buf);
+    priv->ftpput.used = 0;
+
+    return 0;
+}
+
+static int telit2_ftpput_flush(struct cellular *modem, const void *data, size_t len, bool eof)
+{
+    /* Nothing to carry the EOF flag; ftp_close() ends the transfer. */
+    if (len == 0)
+        return 0;
+
+    at_set_timeout(modem->at, 150);
+    at_expect_dataprompt(modem->at);
+    at_command_simple(modem->at, "AT#FTPAPPEXT=%zu,%d", len, (int) eof);
+
+    const char *response = at_command_raw(modem->at, data, len);
+    int sent;
+    at_simple_scanf(response, "#FTPAPPEXT: %d", &sent);
+    if (sent != (int) len) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int telit2_ftp_putdata(struct cellular *modem, const void *buffer, size_t length)
+{
+    struct cellular_telit2 *priv = (struct cellular_telit2 *) modem;
+
+    return cellular_stage_put(modem, &priv->ftpput, buffer, length, telit2_ftpput_flush);
+}
+
 static enum at_response_type scanner_ftprecv(const char *line, size_t len, void *arg)
 {
     (void) len;
@@ -323,6 +760,38 @@ static enum at_response_type scanner_ftprecv(const char *line, size_t len, void
     return AT_RESPONSE_UNKNOWN;
 }
 
+/**
+ * Check if the whole file has been received.
+ *
+ * @returns 1 on EOF, 0 if more data is coming, -1 on failure.
+ */
+static int telit2_ftp_eof(struct cellular *modem)
+{
+    int eof;
+    const char *response = at_command(modem->at, "AT#FTPGETPKT?");
+    /* Expected response: #FTPGETPKT: <remotefile>,<viewMode>,<eof> */
+#if 0
+    /* The %[] specifier is not supported on some embedded systems. */
+    at_simple_scanf(response, "#FTPGETPKT: %*[^,],%*d,%d", &eof);
+#else
+    /* Parse manually. */
+    if (response == NULL)
+        return -1;
+    errno = EPROTO;
+    /* Check the initial part of the response. */
+    if (strncmp(response, "#FTPGETPKT: ", 12))
+        return -1;
+    /* Skip the filename. */
+    response = strchr(response, ',');
+    if (response == NULL)
+        return -1;
+    response++;
+    at_simple_scanf(response, "%*d,%d", &eof);
+#endif
+
+    return eof == 1;
+}
+
 static int telit2_ftp_getdata(struct cellular *modem, char *buffer, size_t length)
 {
     /* FIXME: This function's flow is really ugly. */
@@ -344,7 +813,7 @@ retry:
                 errno = ETIMEDOUT;
                 return -1;
             }
-            sleep(1);
+            at_wait_until(modem->at, NULL, NULL, 1000);
             goto retry;
         }
 
@@ -362,58 +831,66 @@ retry:
     }
 
     /* Error or EOF? */
-    int eof;
-    response = at_command(modem->at, "AT#FTPGETPKT?");
-    /* Expected response: #FTPGETPKT: <remotefile>,<viewMode>,<eof> */
-#if 0
-    /* The %[] specifier is not supported on some embedded systems. */
-    at_simple_scanf(response, "#FTPGETPKT: %*[^,],%*d,%d", &eof);
-#else
-    /* Parse manually. */
-    if (response == NULL)
-        return -1;
-    errno = EPROTO;
-    /* Check the initial part of the response. */
-    if (strncmp(response, "#FTPGETPKT: ", 12))
-        return -1;
-    /* Skip the filename. */
-    response = strchr(response, ',');
-    if (response == NULL)
-        return -1;
-    response++;
-    at_simple_scanf(response, "%*d,%d", &eof);
-#endif
-
-    if (eof == 1)
-        return 0;
-
-    return -1;
+    return telit2_ftp_eof(modem) == 1 ? 0 : -1;
 }
 
-static int telit2_locate(struct cellular *modem, float *latitude, float *longitude, float *altitude)
+static int telit2_ftp_download(struct cellular *modem, cellular_sink_t sink, void *arg,
+                               struct cellular_transfer_stats *stats)
 {
-    struct cellular_telit2 *priv = (struct cellular_telit2 *) modem;
+    struct cellular_transfer xfer;
+    int interval = TELIT2_FTP_POLL_INITIAL;
+    uint64_t deadline = at_monotonic_ms() + TELIT2_FTP_TIMEOUT*1000;
 
-    priv->locate_status = -1;
-    at_set_timeout(modem->at, 150);
-    cellular_command_simple_pdp(modem, "AT#AGPSSND");
+    cellular_transfer_begin(&xfer, sink, arg, stats);
 
-    for (int i=0; i<TELIT2_LOCATE_TIMEOUT; i++) {
-        sleep(1);
-        if (priv->locate_status == 200) {
-            *latitude = priv->latitude;
-            *longitude = priv->longitude;
-            *altitude = priv->altitude;
-            return 0;
+    while (!xfer.aborted) {
+        at_set_timeout(modem->at, 150);
+        at_set_command_scanner(modem->at, scanner_ftprecv);
+        at_set_rawdata_sink(modem->at, cellular_transfer_sink, &xfer);
+        const char *response = at_command(modem->at, "AT#FTPRECV=%d", TELIT2_FTPRECV_MAX);
+        if (response == NULL)
+            goto fail;
+        xfer.stats->chunks++;
+
+        int bytes;
+        if (sscanf(response, "#FTPRECV: %d", &bytes) == 1 && bytes > 0) {
+            interval = TELIT2_FTP_POLL_INITIAL;
+            deadline = at_monotonic_ms() + TELIT2_FTP_TIMEOUT*1000;
+            continue;
         }
-        if (priv->locate_status != -1) {
-            errno = ECONNABORTED;
-            return -1;
+
+        /* Nothing buffered, or an error. Either way, check for EOF. */
+        int eof = telit2_ftp_eof(modem);
+        if (eof == 1)
+            break;
+        if (eof != 0)
+            goto fail;
+
+        /* There's no data-ready URC; poll with backoff instead. */
+        xfer.stats->stalls++;
+        if (at_monotonic_ms() >= deadline) {
+            errno = ETIMEDOUT;
+            goto fail;
         }
+        at_wait_until(modem->at, NULL, NULL, interval);
+        interval *= 2;
+        if (interval > TELIT2_FTP_POLL_MAX)
+            interval = TELIT2_FTP_POLL_MAX;
     }
 
-    errno = ETIMEDOUT;
-    return -1;
+    return cellular_transfer_end(&xfer);
+
+fail:
+    return cellular_transfer_fail(&xfer);
+}
+
+static int telit2_locate_async(struct cellular *modem)
+{
+    /* The fix comes in an "#AGPSRING: " URC. */
+    at_set_timeout(modem->at, 150);
+    cellular_command_simple_pdp(modem, "AT#AGPSSND");
+
+    return 0;
 }
 
 static int telit2_ftp_close(struct cellular *modem)
@@ -433,22 +910,37 @@ static const struct cellular_ops telit2_ops = {
 
     .imei = cellular_op_imei,
     .iccid = telit2_op_iccid,
+    .identity = telit2_op_identity,
     .creg = cellular_op_creg,
     .rssi = cellular_op_rssi,
-    .clock_gettime = telit2_op_clock_gettime,
+    .clock_gettime = cellular_op_clock_gettime,
     .clock_settime = cellular_op_clock_settime,
+    .clock_ntptime = telit2_clock_ntptime,
+    .resolve = telit2_resolve,
     .socket_connect = telit2_socket_connect,
+    .socket_connect_udp = telit2_socket_connect_udp,
     .socket_send = telit2_socket_send,
     .socket_recv = telit2_socket_recv,
     .socket_waitack = telit2_socket_waitack,
     .socket_close = telit2_socket_close,
+    .socket_ackpoll = telit2_socket_ackpoll,
+    .socket_online = telit2_socket_online,
+    .socket_connect_tls = telit2_socket_connect_tls,
+    .tls_cert = telit2_tls_cert,
     .ftp_open = telit2_ftp_open,
     .ftp_get = telit2_ftp_get,
+    .ftp_rest = telit2_ftp_rest,
     .ftp_getdata = telit2_ftp_getdata,
+    .ftp_download = telit2_ftp_download,
+    .ftp_put = telit2_ftp_put,
+    .ftp_putdata = telit2_ftp_putdata,
     .ftp_close = telit2_ftp_close,
-    .locate = telit2_locate,
+    .locate = cellular_op_locate,
+    .locate_async = telit2_locate_async,
 };
 
+static struct cellular_ops telit2_wrapped_ops;
+
 struct cellular *cellular_telit2_alloc(void)
 {
     struct cellular_telit2 *modem = malloc(sizeof(struct cellular_telit2));
@@ -456,9 +948,17 @@ struct cellular *cellular_telit2_alloc(void)
         errno = ENOMEM;
         return NULL;
     }
+
+    return cellular_telit2_init(modem);
+}
+
+struct cellular *cellular_telit2_init(void *storage)
+{
+    struct cellular_telit2 *modem = storage;
     memset(modem, 0, sizeof(*modem));
 
     modem->dev.ops = &telit2_ops;
+    cellular_wrap_ops(&modem->dev, &telit2_wrapped_ops);
 
     return (struct cellular *) modem;
 }
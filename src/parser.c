@@ -12,6 +12,8 @@
 #include <string.h>
 #define printf(...)
 
+#include "at-probes.h"
+
 enum at_parser_state {
     STATE_IDLE,
     STATE_READLINE,
@@ -23,10 +25,14 @@ enum at_parser_state {
 struct at_parser {
     const struct at_parser_callbacks *cbs;
     at_character_handler_t character_handler;
+    at_rawdata_sink_t rawdata_sink;
+    void *rawdata_arg;
     void *priv;
 
     enum at_parser_state state;
     bool expect_dataprompt;
+    bool overflow;
+    unsigned truncations;
     size_t data_left;
     int nibble;
 
@@ -36,6 +42,9 @@ struct at_parser {
     size_t buf_current;
 };
 
+/* Fail the build if AT_PARSER_SIZE is too small. */
+typedef char at_parser_size_check[sizeof(struct at_parser) <= AT_PARSER_SIZE ? 1 : -1];
+
 static const char *const final_ok_responses[] = {
     "OK",
     NULL
@@ -64,14 +73,25 @@ struct at_parser *at_parser_alloc(const struct at_parser_callbacks *cbs, size_t
     }
 
     /* Allocate response buffer. */
-    parser->buf = malloc(bufsize);
-    if (parser->buf == NULL) {
+    char *buf = malloc(bufsize);
+    if (buf == NULL) {
         free(parser);
         return NULL;
     }
+
+    return at_parser_init(parser, cbs, buf, bufsize, priv);
+}
+
+struct at_parser *at_parser_init(void *storage, const struct at_parser_callbacks *cbs,
+                                 char *buf, size_t bufsize, void *priv)
+{
+    struct at_parser *parser = storage;
+
+    parser->buf = buf;
     parser->cbs = cbs;
     parser->buf_size = bufsize;
     parser->priv = priv;
+    parser->truncations = 0;
 
     /* Prepare instance. */
     at_parser_reset(parser);
@@ -83,10 +103,13 @@ void at_parser_reset(struct at_parser *parser)
 {
     parser->state = STATE_IDLE;
     parser->expect_dataprompt = false;
+    parser->overflow = false;
     parser->buf_used = 0;
     parser->buf_current = 0;
     parser->data_left = 0;
     parser->character_handler = NULL;
+    parser->rawdata_sink = NULL;
+    parser->rawdata_arg = NULL;
 }
 
 void at_parser_set_character_handler(struct at_parser *parser, at_character_handler_t handler)
@@ -94,6 +117,12 @@ void at_parser_set_character_handler(struct at_parser *parser, at_character_hand
     parser->character_handler = handler;
 }
 
+void at_parser_set_rawdata_sink(struct at_parser *parser, at_rawdata_sink_t sink, void *arg)
+{
+    parser->rawdata_sink = sink;
+    parser->rawdata_arg = arg;
+}
+
 void at_parser_expect_dataprompt(struct at_parser *parser)
 {
     parser->expect_dataprompt = true;
@@ -113,6 +142,11 @@ bool at_prefix_in_table(const char *line, const char *const table[])
     return false;
 }
 
+unsigned at_parser_truncations(struct at_parser *parser)
+{
+    return parser->truncations;
+}
+
 static enum at_response_type generic_line_scanner(const char *line, size_t len, struct at_parser *parser)
 {
     (void) len;
@@ -133,8 +167,13 @@ static enum at_response_type generic_line_scanner(const char *line, size_t len,
 
 static void parser_append(struct at_parser *parser, char ch)
 {
-    if (parser->buf_used < parser->buf_size-1)
+    if (parser->buf_used < parser->buf_size-1) {
         parser->buf[parser->buf_used++] = ch;
+    } else if (!parser->overflow) {
+        /* Count each truncated line once. */
+        parser->overflow = true;
+        parser->truncations++;
+    }
 }
 
 static void parser_include_line(struct at_parser *parser)
@@ -144,12 +183,14 @@ static void parser_include_line(struct at_parser *parser)
 
     /* Advance the current command pointer to the new position. */
     parser->buf_current = parser->buf_used;
+    parser->overflow = false;
 }
 
 static void parser_discard_line(struct at_parser *parser)
 {
     /* Rewind the end pointer back to the previous position. */
     parser->buf_used = parser->buf_current;
+    parser->overflow = false;
 }
 
 static void parser_finalize(struct at_parser *parser)
@@ -187,11 +228,13 @@ static void parser_handle_line(struct at_parser *parser)
         type = parser->cbs->scan_line(line, len, parser->priv);
     if (!type)
         type = generic_line_scanner(line, len, parser);
+    at_probe4(line, parser->priv, line, len, (int) type);
 
     /* Expected URCs and all unexpected lines are sent to URC handler. */
     if (type == AT_RESPONSE_URC || parser->state == STATE_IDLE)
     {
         /* Fire the callback on the URC line. */
+        at_probe3(urc, parser->priv, line, len);
         parser->cbs->handle_urc(parser->buf + parser->buf_current,
                                 parser->buf_used - parser->buf_current,
                                 parser->priv);
@@ -230,6 +273,7 @@ static void parser_handle_line(struct at_parser *parser)
             /* Switch parser state to rawdata mode. */
             parser->data_left = (int)type >> 8;
             parser->state = STATE_RAWDATA;
+            at_probe2(rawdata__start, parser->priv, parser->data_left);
         }
         break;
 
@@ -239,6 +283,7 @@ static void parser_handle_line(struct at_parser *parser)
             parser->data_left = (int)type >> 8;
             parser->nibble = -1;
             parser->state = STATE_HEXDATA;
+            at_probe2(rawdata__start, parser->priv, parser->data_left);
         }
         break;
 
@@ -300,14 +345,23 @@ void at_parser_feed(struct at_parser *parser, const void *data, size_t len)
             break;
 
             case STATE_RAWDATA: {
-                if (parser->data_left > 0) {
+                if (parser->data_left > 0 && parser->rawdata_sink) {
+                    /* Hand over the whole run of payload bytes at once. */
+                    size_t run = parser->data_left < len+1 ? parser->data_left : len+1;
+                    parser->rawdata_sink(buf-1, run, parser->rawdata_arg);
+                    buf += run-1; len -= run-1;
+                    parser->data_left -= run;
+                } else if (parser->data_left > 0) {
                     parser_append(parser, ch);
                     parser->data_left--;
                 }
 
                 if (parser->data_left == 0) {
-                    parser_include_line(parser);
+                    /* Sunk payload leaves only the header in the response. */
+                    if (!parser->rawdata_sink)
+                        parser_include_line(parser);
                     parser->state = STATE_READLINE;
+                    at_probe1(rawdata__done, parser->priv);
                 }
             } break;
 
@@ -320,15 +374,23 @@ void at_parser_feed(struct at_parser *parser, const void *data, size_t len)
                         } else {
                             value |= (parser->nibble << 4);
                             parser->nibble = -1;
-                            parser_append(parser, value);
+                            if (parser->rawdata_sink) {
+                                uint8_t byte = value;
+                                parser->rawdata_sink(&byte, 1, parser->rawdata_arg);
+                            } else {
+                                parser_append(parser, value);
+                            }
                             parser->data_left--;
                         }
                     }
                 }
 
                 if (parser->data_left == 0) {
-                    parser_include_line(parser);
+                    /* Sunk payload leaves only the header in the response. */
+                    if (!parser->rawdata_sink)
+                        parser_include_line(parser);
                     parser->state = STATE_READLINE;
+                    at_probe1(rawdata__done, parser->priv);
                 }
             } break;
         }
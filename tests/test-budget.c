@@ -0,0 +1,634 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+/*
+ * AT command budgets of cellular ops, checked against a simulated modem.
+ * Build with AT_STATS and CELLULAR_ACCOUNTING. An op going over its budget
+ * means a change added round trips to it; raise the budget only if that
+ * was intended. The DNS cache is tested the same way, by counting the
+ * lookups that reach the modem.
+ *
+ * Only the Telit driver is covered so far; SIM800 budgets are left to a
+ * target build.
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <check.h>
+
+#include <attentive/cellular.h>
+
+#include "../src/modem/at-common.h"
+
+
+/*
+ * Simulated modem. Implements the AT channel API on top of a script of
+ * exchanges; each one answers the first command starting with its prefix
+ * and is then used up. Commands without a script entry get "OK". Every
+ * exchange takes SIM_ROUND_TRIP ms of simulated time. Responses go through
+ * a real parser with the Unix buffer size; one that overflows it times out,
+ * as its final "OK" is lost.
+ */
+
+#define SIM_ROUND_TRIP 20
+#define SIM_PARSER_BUFFER 256
+
+struct sim_exchange {
+    const char *command;        /**< Command prefix, without "AT". */
+    const char *response;       /**< Response; NULL to time out. */
+    const char *data;           /**< Raw data for the rawdata sink, or NULL. */
+};
+
+static struct {
+    struct at at;
+    const struct sim_exchange *script;
+    size_t count;
+    bool used[16];
+    bool prompt;                /**< Next command expects a dataprompt. */
+    bool payload;               /**< Next raw write is the payload. */
+    at_rawdata_sink_t sink;
+    void *sink_arg;
+    uint64_t now;
+    void *parser[AT_PARSER_SIZE/sizeof(void *)];
+    char parser_buf[SIM_PARSER_BUFFER];
+} sim;
+
+static void sim_ignore(const char *line, size_t len, void *priv)
+{
+    (void) line;
+    (void) len;
+    (void) priv;
+}
+
+static const struct at_parser_callbacks sim_parser_callbacks = {
+    .handle_response = sim_ignore,
+    .handle_urc = sim_ignore,
+};
+
+static void sim_reset(void)
+{
+    memset(&sim, 0, sizeof(sim));
+    sim.at.parser = at_parser_init(sim.parser, &sim_parser_callbacks,
+                                   sim.parser_buf, sizeof(sim.parser_buf), NULL);
+}
+
+/* Pass a response through the parser; false if it didn't fit. */
+static bool sim_parse(const char *response)
+{
+    unsigned truncations = at_parser_truncations(sim.at.parser);
+
+    at_parser_await_response(sim.at.parser);
+    for (const char *line = response; *line; ) {
+        size_t len = strcspn(line, "\n");
+        at_parser_feed(sim.at.parser, line, len);
+        at_parser_feed(sim.at.parser, "\r\n", 2);
+        line += len + (line[len] == '\n');
+    }
+    at_parser_feed(sim.at.parser, "OK\r\n", 4);
+    at_parser_reset(sim.at.parser);
+
+    return at_parser_truncations(sim.at.parser) == truncations;
+}
+
+static void sim_start(const struct sim_exchange *script, size_t count)
+{
+    ck_assert(count <= sizeof(sim.used)/sizeof(*sim.used));
+    sim.script = script;
+    sim.count = count;
+    memset(sim.used, 0, sizeof(sim.used));
+}
+
+static void sim_urc(const char *line)
+{
+    sim.at.cbs->handle_urc(line, strlen(line), sim.at.arg);
+}
+
+static const char *sim_exchange(const char *line)
+{
+    const char *response = "";
+    const char *data = NULL;
+
+    sim.at.stats.commands++;
+    sim.now += SIM_ROUND_TRIP;
+
+    if (sim.payload) {
+        /* Raw data after a dataprompt. */
+        sim.payload = false;
+    } else {
+        if (!strncmp(line, "AT", 2))
+            line += 2;
+        for (size_t i=0; i<sim.count; i++) {
+            if (!sim.used[i] && !strncmp(line, sim.script[i].command, strlen(sim.script[i].command))) {
+                sim.used[i] = true;
+                response = sim.script[i].response;
+                data = sim.script[i].data;
+                break;
+            }
+        }
+        sim.payload = sim.prompt && response && !strcmp(response, "");
+        if (response && !sim_parse(response))
+            response = NULL;
+    }
+
+    if (data && sim.sink)
+        sim.sink(data, strlen(data), sim.sink_arg);
+
+    /* Reset per-command settings. */
+    sim.prompt = false;
+    sim.sink = NULL;
+    sim.at.command_scanner = NULL;
+
+    if (!response) {
+        sim.at.stats.timeouts++;
+        errno = ETIMEDOUT;
+    }
+    return response;
+}
+
+const char *at_command(struct at *at, const char *format, ...)
+{
+    (void) at;
+
+    char line[256];
+    va_list ap;
+    va_start(ap, format);
+    vsnprintf(line, sizeof(line), format, ap);
+    va_end(ap);
+
+    return sim_exchange(line);
+}
+
+const char *at_command_raw(struct at *at, const void *data, size_t size)
+{
+    (void) at;
+
+    char line[256];
+    if (size >= sizeof(line))
+        size = sizeof(line)-1;
+    memcpy(line, data, size);
+    line[size] = '\0';
+    line[strcspn(line, "\r")] = '\0';
+
+    return sim_exchange(line);
+}
+
+void at_set_callbacks(struct at *at, const struct at_callbacks *cbs, void *arg)
+{
+    at->cbs = cbs;
+    at->arg = arg;
+}
+
+void at_set_command_scanner(struct at *at, at_line_scanner_t scanner)
+{
+    at->command_scanner = scanner;
+}
+
+void at_set_rawdata_sink(struct at *at, at_rawdata_sink_t sink, void *arg)
+{
+    (void) at;
+    sim.sink = sink;
+    sim.sink_arg = arg;
+}
+
+void at_expect_dataprompt(struct at *at)
+{
+    (void) at;
+    sim.prompt = true;
+}
+
+void at_expect_online(struct at *at)
+{
+    (void) at;
+}
+
+bool at_is_online(struct at *at)
+{
+    (void) at;
+    return false;
+}
+
+bool at_send_raw(struct at *at, const void *data, size_t size)
+{
+    (void) data;
+    (void) size;
+    at->stats.writes++;
+    return true;
+}
+
+int at_online_escape(struct at *at)
+{
+    (void) at;
+    return 0;
+}
+
+void at_set_timeout(struct at *at, int timeout)
+{
+    (void) at;
+    (void) timeout;
+}
+
+bool at_wait_until(struct at *at, at_condition_t cond, void *arg, int timeout)
+{
+    (void) at;
+
+    /* Nothing happens on its own; URCs are injected with sim_urc(). */
+    if (cond && cond(arg))
+        return true;
+    sim.now += timeout;
+    return false;
+}
+
+void at_lock(struct at *at)
+{
+    (void) at;
+}
+
+void at_unlock(struct at *at)
+{
+    (void) at;
+}
+
+void at_urc_lock(struct at *at)
+{
+    (void) at;
+}
+
+void at_urc_unlock(struct at *at)
+{
+    (void) at;
+}
+
+uint64_t at_monotonic_ms(void)
+{
+    return sim.now;
+}
+
+
+/*
+ * Budgets.
+ */
+
+static const struct cellular_budget telit2_budgets[] = {
+    { "attach", 4, 0 },         /* AT, ATE0, profile read-back, &K0. */
+    { "pdp_open", 2, 0 },
+    { "socket_connect", 5, 0 }, /* Socket config (2), PDP context (2), #SD. */
+    { "socket_send", 2, 0 },    /* #SSENDEXT and the payload. */
+    { "socket_recv", 2, 0 },    /* #SRECV and one probe for more. */
+    { "socket_waitack", 1, 0 }, /* #SI and #SS in one batch. */
+    { "socket_close", 1, 0 },
+};
+
+static struct cellular *telit2_start(void)
+{
+    static const struct sim_exchange script[] = {
+        { "#SELINT?", "#SELINT: 2\n+CMEE: 2\n+CREG: 2,1\n+CGREG: 2,1", NULL },
+    };
+
+    sim_reset();
+    sim_start(script, sizeof(script)/sizeof(*script));
+
+    struct cellular *modem = cellular_telit2_alloc();
+    ck_assert(modem != NULL);
+    ck_assert_int_eq(cellular_attach(modem, &sim.at, "internet"), 0);
+
+    return modem;
+}
+
+START_TEST(test_budget_telit2)
+{
+    printf(":: test_budget_telit2\n");
+
+    static const struct sim_exchange script[] = {
+        { "#SGACT=1,1", "#SGACT: 10.0.0.1", NULL },
+        { "#SRECV=1,5", "#SRECV: 1,5", "hello" },
+        { "#SRECV=1,", "+CME ERROR: activation failed", NULL },
+        { "#SI;#SS", "#SI: 1,5,0,5,0\n#SS: 1,2,10.0.0.1,1024,1.2.3.4,80", NULL },
+    };
+
+    struct cellular *modem = telit2_start();
+    sim_start(script, sizeof(script)/sizeof(*script));
+
+    char buf[16];
+    ck_assert_int_eq(modem->ops->socket_connect(modem, 1, "1.2.3.4", 80), 0);
+    ck_assert_int_eq(modem->ops->socket_send(modem, 1, "hello", 5, 0), 5);
+    ck_assert_int_eq(modem->ops->socket_waitack(modem, 1), 0);
+    sim_urc("SRING: 1,5");
+    ck_assert_int_eq(modem->ops->socket_recv(modem, 1, buf, sizeof(buf), 0), 5);
+    ck_assert_int_eq(modem->ops->socket_close(modem, 1), 0);
+
+    /* The context is known to be up now. */
+    ck_assert_int_eq(modem->ops->socket_connect(modem, 2, "1.2.3.4", 80), 0);
+
+    ck_assert_int_eq(cellular_account_check(modem, telit2_budgets,
+                     sizeof(telit2_budgets)/sizeof(*telit2_budgets)), 0);
+
+    cellular_telit2_free(modem);
+}
+END_TEST
+
+START_TEST(test_budget_accounting)
+{
+    printf(":: test_budget_accounting\n");
+
+    static const struct sim_exchange script[] = {
+        { "#SGACT=1,1", "#SGACT: 10.0.0.1", NULL },
+    };
+
+    struct cellular *modem = telit2_start();
+    sim_start(script, sizeof(script)/sizeof(*script));
+
+    const struct cellular_op_account *account = cellular_account(modem, "attach");
+    ck_assert(account != NULL);
+    ck_assert_int_eq(account->calls, 1);
+    ck_assert_int_eq(account->commands, 4);
+    ck_assert_int_eq(account->total_ms, 4*SIM_ROUND_TRIP);
+
+    /* The nested pdp_open is charged to socket_connect alone. */
+    ck_assert_int_eq(modem->ops->socket_connect(modem, 1, "1.2.3.4", 80), 0);
+    ck_assert_int_eq(modem->ops->socket_connect(modem, 2, "1.2.3.4", 80), 0);
+    account = cellular_account(modem, "socket_connect");
+    ck_assert(account != NULL);
+    ck_assert_int_eq(account->calls, 2);
+    ck_assert_int_eq(account->commands, 8);
+    ck_assert_int_eq(account->max_commands, 5);
+    ck_assert_int_eq(account->max_ms, 5*SIM_ROUND_TRIP);
+    ck_assert(cellular_account(modem, "pdp_open") == NULL);
+
+    /* A tighter budget is caught. */
+    static const struct cellular_budget tight[] = {
+        { "socket_connect", 3, 0 },
+        { "socket_send", 0, 0 },
+    };
+    ck_assert_int_eq(cellular_account_check(modem, tight, 2), 1);
+
+    cellular_account_reset(modem);
+    ck_assert(cellular_account(modem, "socket_connect") == NULL);
+
+    cellular_telit2_free(modem);
+}
+END_TEST
+
+START_TEST(test_budget_timeout)
+{
+    printf(":: test_budget_timeout\n");
+
+    static const struct sim_exchange script[] = {
+        { "+CGDCONT", NULL, NULL },
+    };
+
+    struct cellular *modem = telit2_start();
+    sim_start(script, sizeof(script)/sizeof(*script));
+
+    ck_assert_int_eq(modem->ops->pdp_open(modem, "internet"), -1);
+    const struct cellular_op_account *account = cellular_account(modem, "pdp_open");
+    ck_assert(account != NULL);
+    ck_assert_int_eq(account->commands, 1);
+    ck_assert_int_eq(account->timeouts, 1);
+
+    cellular_telit2_free(modem);
+}
+END_TEST
+
+START_TEST(test_budget_waitack_backoff)
+{
+    printf(":: test_budget_waitack_backoff\n");
+
+    /* The ACK arrives with the third poll. */
+    static const struct sim_exchange script[] = {
+        { "#SGACT=1,1", "#SGACT: 10.0.0.1", NULL },
+        { "#SI;#SS", "#SI: 1,5,0,0,5\n#SS: 1,2,10.0.0.1,1024,1.2.3.4,80", NULL },
+        { "#SI;#SS", "#SI: 1,5,0,0,5\n#SS: 1,2,10.0.0.1,1024,1.2.3.4,80", NULL },
+        { "#SI;#SS", "#SI: 1,5,0,0,0\n#SS: 1,2,10.0.0.1,1024,1.2.3.4,80", NULL },
+    };
+
+    struct cellular *modem = telit2_start();
+    sim_start(script, sizeof(script)/sizeof(*script));
+
+    ck_assert_int_eq(modem->ops->socket_connect(modem, 1, "1.2.3.4", 80), 0);
+    ck_assert_int_eq(modem->ops->socket_send(modem, 1, "hello", 5, 0), 5);
+
+    uint64_t started = sim.now;
+    ck_assert_int_eq(modem->ops->socket_waitack(modem, 1), 0);
+    const struct cellular_op_account *account = cellular_account(modem, "socket_waitack");
+    ck_assert(account != NULL);
+    ck_assert_int_eq(account->commands, 3);
+
+    /* Polls back off from 50 ms: 50 and 100 ms of sleep in between. */
+    ck_assert_int_eq(sim.now - started, 3*SIM_ROUND_TRIP + 50 + 100);
+
+    cellular_telit2_free(modem);
+}
+END_TEST
+
+START_TEST(test_budget_ackpoll_split)
+{
+    printf(":: test_budget_ackpoll_split\n");
+
+    /* Six sockets don't fit the parser buffer; poll them one by one. */
+    static const struct sim_exchange script[] = {
+        { "#SGACT=1,1", "#SGACT: 10.0.0.1", NULL },
+        { "#SI;#SS",
+          "#SI: 1,5,0,0,0\n#SI: 2,104857,209715,0,0\n#SI: 3,104857,209715,0,0\n"
+          "#SI: 4,104857,209715,0,0\n#SI: 5,104857,209715,0,0\n#SI: 6,104857,209715,0,0\n"
+          "#SS: 1,2,10.0.0.1,1024,1.2.3.4,80\n#SS: 2,2,10.0.0.1,1025,1.2.3.4,80\n"
+          "#SS: 3,2,10.0.0.1,1026,1.2.3.4,80\n#SS: 4,0\n#SS: 5,0\n#SS: 6,0", NULL },
+        { "#SI=1;#SS=1", "#SI: 1,5,0,0,0\n#SS: 1,2,10.0.0.1,1024,1.2.3.4,80", NULL },
+        { "#SI=2;#SS=2", "#SI: 2,104857,209715,0,0\n#SS: 2,2,10.0.0.1,1025,1.2.3.4,80", NULL },
+        { "#SI=3;#SS=3", "#SI: 3,104857,209715,0,0\n#SS: 3,2,10.0.0.1,1026,1.2.3.4,80", NULL },
+        { "#SI=4;#SS=4", "#SI: 4,0,0,0,0\n#SS: 4,0", NULL },
+        { "#SI=5;#SS=5", "#SI: 5,0,0,0,0\n#SS: 5,0", NULL },
+        { "#SI=6;#SS=6", "#SI: 6,0,0,0,0\n#SS: 6,0", NULL },
+        { "#SI=1;#SS=1", "#SI: 1,10,0,0,0\n#SS: 1,2,10.0.0.1,1024,1.2.3.4,80", NULL },
+    };
+
+    struct cellular *modem = telit2_start();
+    sim_start(script, sizeof(script)/sizeof(*script));
+
+    ck_assert_int_eq(modem->ops->socket_connect(modem, 1, "1.2.3.4", 80), 0);
+    ck_assert_int_eq(modem->ops->socket_send(modem, 1, "hello", 5, 0), 5);
+    ck_assert_int_eq(modem->ops->socket_waitack(modem, 1), 0);
+    const struct cellular_op_account *account = cellular_account(modem, "socket_waitack");
+    ck_assert(account != NULL);
+    ck_assert_int_eq(account->commands, 1 + 6);
+
+    /* Closed sockets are skipped from then on, and the overflow isn't retried. */
+    ck_assert_int_eq(modem->ops->socket_send(modem, 1, "hello", 5, 0), 5);
+    ck_assert_int_eq(modem->ops->socket_waitack(modem, 1), 0);
+    ck_assert_int_eq(account->commands, 1 + 6 + 3);
+
+    cellular_telit2_free(modem);
+}
+END_TEST
+
+/* Sends like SIM800 does: a command, then the payload without a response. */
+static ssize_t writer_socket_send(struct cellular *modem, int connid, const void *buffer, size_t amount, int flags)
+{
+    (void) flags;
+    if (!at_command(modem->at, "AT+CIPSEND=%d,%d", connid, (int) amount))
+        return -1;
+    at_send_raw(modem->at, buffer, amount);
+    return amount;
+}
+
+START_TEST(test_budget_writes)
+{
+    printf(":: test_budget_writes\n");
+
+    static const struct cellular_ops writer_ops = {
+        .socket_send = writer_socket_send,
+    };
+    static struct cellular_ops wrapped;
+
+    sim_reset();
+    struct cellular modem = {
+        .ops = &writer_ops,
+        .at = &sim.at,
+    };
+    cellular_wrap_ops(&modem, &wrapped);
+
+    ck_assert_int_eq(modem.ops->socket_send(&modem, 0, "hello", 5, 0), 5);
+    ck_assert_int_eq(modem.ops->socket_send(&modem, 0, "hello", 5, 0), 5);
+    const struct cellular_op_account *account = cellular_account(&modem, "socket_send");
+    ck_assert(account != NULL);
+    ck_assert_int_eq(account->commands, 2);
+    ck_assert_int_eq(account->writes, 2);
+    ck_assert_int_eq(account->max_writes, 1);
+
+    /* Writes have a budget of their own. */
+    static const struct cellular_budget budgets[] = {
+        { "socket_send", 1, 1 },
+    };
+    static const struct cellular_budget no_writes[] = {
+        { "socket_send", 1, 0 },
+    };
+    ck_assert_int_eq(cellular_account_check(&modem, budgets, 1), 0);
+    ck_assert_int_eq(cellular_account_check(&modem, no_writes, 1), 1);
+}
+END_TEST
+
+static void dns_resolve(struct cellular *modem, const char *host, const char *expect, unsigned lookups)
+{
+    char ip[CELLULAR_IP_LENGTH];
+    unsigned commands = sim.at.stats.commands;
+
+    ck_assert_int_eq(cellular_resolve(modem, host, ip, sizeof(ip)), 0);
+    ck_assert_str_eq(ip, expect);
+    ck_assert_int_eq(sim.at.stats.commands - commands, lookups);
+}
+
+START_TEST(test_dns_cache)
+{
+    printf(":: test_dns_cache\n");
+
+    static const struct sim_exchange script[] = {
+        { "#SGACT=1,1", "#SGACT: 10.0.0.1", NULL },
+        { "#QDNS=\"a.example\"", "#QDNS: \"a.example\",\"10.0.1.1\"", NULL },
+        { "#QDNS=\"a.example\"", "#QDNS: \"a.example\",\"10.0.1.2\"", NULL },
+        { "#QDNS=\"a.example\"", "+CME ERROR: no route", NULL },
+        { "#QDNS=\"a.example\"", "#QDNS: \"a.example\",\"10.0.1.3\"", NULL },
+    };
+
+    struct cellular *modem = telit2_start();
+    sim_start(script, sizeof(script)/sizeof(*script));
+
+    /* Addresses skip the cache; fresh entries skip the modem. */
+    dns_resolve(modem, "10.9.9.9", "10.9.9.9", 0);
+    dns_resolve(modem, "a.example", "10.0.1.1", 3);     /* With pdp_open. */
+    dns_resolve(modem, "a.example", "10.0.1.1", 0);
+
+    /* Stale entries are looked up again. */
+    sim.now += CELLULAR_DNS_TTL;
+    dns_resolve(modem, "a.example", "10.0.1.2", 1);
+
+    /* A stale entry still beats a failed lookup. */
+    sim.now += CELLULAR_DNS_TTL;
+    dns_resolve(modem, "a.example", "10.0.1.2", 1);
+
+    /* Forgotten entries are looked up right away. */
+    cellular_dns_forget(modem, "a.example");
+    dns_resolve(modem, "a.example", "10.0.1.3", 1);
+
+    cellular_telit2_free(modem);
+}
+END_TEST
+
+START_TEST(test_dns_evict)
+{
+    printf(":: test_dns_evict\n");
+
+    struct cellular *modem = telit2_start();
+    char host[16], ip[CELLULAR_IP_LENGTH];
+
+    /* Fill the cache, oldest first. */
+    for (int i=0; i<CELLULAR_DNS_CACHE; i++) {
+        snprintf(host, sizeof(host), "h%d.example", i);
+        snprintf(ip, sizeof(ip), "10.0.2.%d", i);
+        cellular_dns_store(modem, host, ip);
+        sim.now += 1000;
+    }
+
+    /* Refresh the first one; the second is the oldest now. */
+    cellular_dns_store(modem, "h0.example", "10.0.3.0");
+    sim.now += 1000;
+    cellular_dns_store(modem, "new.example", "10.0.4.0");
+
+    dns_resolve(modem, "h0.example", "10.0.3.0", 0);
+    dns_resolve(modem, "new.example", "10.0.4.0", 0);
+    for (int i=2; i<CELLULAR_DNS_CACHE; i++) {
+        snprintf(host, sizeof(host), "h%d.example", i);
+        snprintf(ip, sizeof(ip), "10.0.2.%d", i);
+        dns_resolve(modem, host, ip, 0);
+    }
+
+    /* The evicted one goes to the modem, which fails it. */
+    unsigned commands = sim.at.stats.commands;
+    ck_assert_int_eq(cellular_resolve(modem, "h1.example", ip, sizeof(ip)), -1);
+    ck_assert_int_ne(sim.at.stats.commands, commands);
+
+    cellular_telit2_free(modem);
+}
+END_TEST
+
+Suite *attentive_suite(void)
+{
+    Suite *s = suite_create("attentive");
+    TCase *tc;
+
+    tc = tcase_create("budget");
+    tcase_add_test(tc, test_budget_telit2);
+    tcase_add_test(tc, test_budget_accounting);
+    tcase_add_test(tc, test_budget_timeout);
+    tcase_add_test(tc, test_budget_writes);
+    tcase_add_test(tc, test_budget_waitack_backoff);
+    tcase_add_test(tc, test_budget_ackpoll_split);
+    suite_add_tcase(s, tc);
+
+    tc = tcase_create("dns");
+    tcase_add_test(tc, test_dns_cache);
+    tcase_add_test(tc, test_dns_evict);
+    suite_add_tcase(s, tc);
+
+    return s;
+}
+
+int main()
+{
+    int number_failed;
+    Suite *s = attentive_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* vim: set ts=4 sw=4 et: */
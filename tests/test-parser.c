@@ -210,6 +210,35 @@ START_TEST(test_parser_overflow)
 }
 END_TEST
 
+START_TEST(test_parser_truncations)
+{
+    printf(":: test_parser_truncations\n");
+
+    struct at_parser_callbacks cbs = {
+        .handle_response = handle_response,
+        .handle_urc = handle_urc,
+    };
+    struct at_parser *parser = at_parser_alloc(&cbs, 8, NULL);
+    ck_assert(parser != NULL);
+
+    expect_prepare();
+
+    /* an overlong URC is truncated and discarded... */
+    expect_urc("+URC:12");
+    at_parser_feed(parser, STR_LEN("+URC:123456\r\n"));
+    expect_nothing();
+    ck_assert_int_eq(at_parser_truncations(parser), 1);
+
+    /* ...and doesn't hide the next truncated line. */
+    expect_urc("+URC:ab");
+    at_parser_feed(parser, STR_LEN("+URC:abcdef\r\n"));
+    expect_nothing();
+    ck_assert_int_eq(at_parser_truncations(parser), 2);
+
+    at_parser_free(parser);
+}
+END_TEST
+
 static enum at_response_type line_scanner(const char *line, size_t len, void *priv)
 {
     (void) len;
@@ -251,6 +280,51 @@ START_TEST(test_parser_rawdata)
 }
 END_TEST
 
+static char sink_buf[64];
+static size_t sink_used;
+static int sink_calls;
+
+static void rawdata_sink(const void *data, size_t len, void *arg)
+{
+    (void) arg;
+    ck_assert(sink_used + len <= sizeof(sink_buf));
+    memcpy(sink_buf + sink_used, data, len);
+    sink_used += len;
+    sink_calls++;
+}
+
+START_TEST(test_parser_rawdata_sink)
+{
+    printf(":: test_parser_rawdata_sink\n");
+
+    struct at_parser_callbacks cbs = {
+        .handle_response = handle_response,
+        .handle_urc = handle_urc,
+        .scan_line = line_scanner,
+    };
+    /* Payload is larger than the response buffer. */
+    struct at_parser *parser = at_parser_alloc(&cbs, 16, NULL);
+    ck_assert(parser != NULL);
+
+    expect_prepare();
+    sink_used = 0;
+    sink_calls = 0;
+
+    expect_response("+RAWDATA: 24");
+    at_parser_set_rawdata_sink(parser, rawdata_sink, NULL);
+    at_parser_await_response(parser);
+    at_parser_feed(parser, STR_LEN("\r\n+RAWDATA: 24\r\n0123456789"));
+    at_parser_feed(parser, STR_LEN("abcdefghijklmn\r\nOK\r\n"));
+    expect_nothing();
+
+    ck_assert_int_eq(sink_used, 24);
+    ck_assert(!memcmp(sink_buf, "0123456789abcdefghijklmn", 24));
+    ck_assert_int_eq(sink_calls, 2);
+
+    at_parser_free(parser);
+}
+END_TEST
+
 START_TEST(test_parser_hexdata)
 {
     printf(":: test_parser_hexdata\n");
@@ -315,7 +389,9 @@ Suite *attentive_suite(void)
     tcase_add_test(tc, test_parser_urc);
     tcase_add_test(tc, test_parser_mixed);
     tcase_add_test(tc, test_parser_overflow);
+    tcase_add_test(tc, test_parser_truncations);
     tcase_add_test(tc, test_parser_rawdata);
+    tcase_add_test(tc, test_parser_rawdata_sink);
     tcase_add_test(tc, test_parser_hexdata);
     tcase_add_test(tc, test_parser_dataprompt);
     suite_add_tcase(s, tc);
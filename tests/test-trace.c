@@ -0,0 +1,146 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <check.h>
+
+#include <attentive/trace.h>
+
+
+#define STR_LEN(s) s, strlen(s)
+
+static struct at_trace trace;
+static struct at_trace_event events[AT_TRACE_ENTRIES];
+
+
+START_TEST(test_trace_order)
+{
+    printf(":: test_trace_order\n");
+
+    at_trace_init(&trace);
+    ck_assert_int_eq(at_trace_dump(&trace, events, AT_TRACE_ENTRIES), 0);
+
+    at_trace_record(&trace, AT_TRACE_TX, STR_LEN("AT+CREG?\r"), 100);
+    at_trace_record(&trace, AT_TRACE_RX, STR_LEN("+CREG: 0,1"), 120);
+    at_trace_record(&trace, AT_TRACE_URC, STR_LEN("RING"), 130);
+
+    ck_assert_int_eq(at_trace_dump(&trace, events, AT_TRACE_ENTRIES), 3);
+    ck_assert_int_eq(events[0].seq, 1);
+    ck_assert_int_eq(events[0].type, AT_TRACE_TX);
+    ck_assert_int_eq(events[0].timestamp, 100);
+    ck_assert_int_eq(events[1].seq, 2);
+    ck_assert_int_eq(events[1].type, AT_TRACE_RX);
+    ck_assert_int_eq(events[1].len, strlen("+CREG: 0,1"));
+    ck_assert(!memcmp(events[1].data, "+CREG: 0,1", events[1].len));
+    ck_assert_int_eq(events[2].seq, 3);
+    ck_assert_int_eq(events[2].type, AT_TRACE_URC);
+
+    /* A short destination gets the newest events. */
+    ck_assert_int_eq(at_trace_dump(&trace, events, 2), 2);
+    ck_assert_int_eq(events[0].seq, 2);
+    ck_assert_int_eq(events[1].seq, 3);
+}
+END_TEST
+
+START_TEST(test_trace_wraparound)
+{
+    printf(":: test_trace_wraparound\n");
+
+    at_trace_init(&trace);
+    for (uint32_t i=0; i<AT_TRACE_ENTRIES+5; i++)
+        at_trace_record(&trace, AT_TRACE_TX, &i, sizeof(i), i);
+
+    /* The oldest five were overwritten; the rest come out oldest first. */
+    ck_assert_int_eq(at_trace_dump(&trace, events, AT_TRACE_ENTRIES), AT_TRACE_ENTRIES);
+    for (uint32_t i=0; i<AT_TRACE_ENTRIES; i++) {
+        uint32_t value;
+        memcpy(&value, events[i].data, sizeof(value));
+        ck_assert_int_eq(events[i].seq, i+6);
+        ck_assert_int_eq(events[i].timestamp, i+5);
+        ck_assert_int_eq(value, i+5);
+    }
+
+    /* Events being written are skipped. */
+    trace.events[(AT_TRACE_ENTRIES+4) % AT_TRACE_ENTRIES].seq = 0;
+    ck_assert_int_eq(at_trace_dump(&trace, events, AT_TRACE_ENTRIES), AT_TRACE_ENTRIES-1);
+    ck_assert_int_eq(events[AT_TRACE_ENTRIES-2].seq, AT_TRACE_ENTRIES+4);
+}
+END_TEST
+
+START_TEST(test_trace_truncation)
+{
+    printf(":: test_trace_truncation\n");
+
+    char data[AT_TRACE_DATA+8];
+    memset(data, 'x', sizeof(data));
+
+    at_trace_init(&trace);
+    at_trace_record(&trace, AT_TRACE_RX, data, sizeof(data), 0);
+    ck_assert_int_eq(at_trace_dump(&trace, events, AT_TRACE_ENTRIES), 1);
+    ck_assert_int_eq(events[0].len, AT_TRACE_DATA);
+    ck_assert_int_eq(events[0].size, sizeof(data));
+
+    char line[128];
+    int len = at_trace_format(&events[0], line, sizeof(line));
+    ck_assert_int_eq(len, strlen(line));
+    ck_assert(strstr(line, "RX") != NULL);
+    ck_assert_str_eq(line + len - strlen(" [+8 bytes]"), " [+8 bytes]");
+}
+END_TEST
+
+START_TEST(test_trace_format)
+{
+    printf(":: test_trace_format\n");
+
+    at_trace_init(&trace);
+    at_trace_record(&trace, AT_TRACE_TX, STR_LEN("AT\\\r\n\x01\x80~"), 61234);
+    ck_assert_int_eq(at_trace_dump(&trace, events, AT_TRACE_ENTRIES), 1);
+
+    char line[128];
+    int len = at_trace_format(&events[0], line, sizeof(line));
+    ck_assert_str_eq(line, "        61.234 TX      AT\\x5c\\r\\n\\x01\\x80~");
+    ck_assert_int_eq(len, strlen(line));
+
+    /* A short destination is cut, not overrun. */
+    memset(line, '#', sizeof(line));
+    len = at_trace_format(&events[0], line, 30);
+    ck_assert_int_le(strlen(line), 29);
+    ck_assert_int_eq(line[30], '#');
+}
+END_TEST
+
+Suite *attentive_suite(void)
+{
+    Suite *s = suite_create("attentive");
+    TCase *tc;
+
+    tc = tcase_create("trace");
+    tcase_add_test(tc, test_trace_order);
+    tcase_add_test(tc, test_trace_wraparound);
+    tcase_add_test(tc, test_trace_truncation);
+    tcase_add_test(tc, test_trace_format);
+    suite_add_tcase(s, tc);
+
+    return s;
+}
+
+int main()
+{
+    int number_failed;
+    Suite *s = attentive_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* vim: set ts=4 sw=4 et: */